@@ -0,0 +1,1468 @@
+#include "Benchmarks.h"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <array>
+#include <random>
+
+
+namespace Benchmarks {
+
+	void printStatistics(const std::string& name, const KdStructs::BatchStatistics& statistics)
+	{
+		std::cout << std::left << std::setw(32) << name << std::right
+			<< std::setw(12) << static_cast<long long>(statistics.raysPerSecond()) << " rays/s  "
+			<< std::setw(10) << static_cast<long long>(statistics.seconds * 1000000) << " microseconds  "
+			<< statistics.hitCount << " hits" << std::endl;
+	}
+
+	KdStructs::BatchStatistics castBatch(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays, const KdStructs::BatchOptions& options)
+	{
+		std::vector<KdStructs::RayHit*> hits(rays.size(), nullptr);
+		KdStructs::BatchStatistics statistics = kdtree->raycastBatch(rays.data(), rays.size(), hits.data(), options);
+		for (KdStructs::RayHit* hit : hits)
+			delete hit;
+		return statistics;
+	}
+
+	// Rays from the first count random origins through the center of a triangle each, so that every ray crosses the mesh at least once.
+	std::vector<KdStructs::Ray> getTargetRays(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays, size_t count)
+	{
+		std::vector<KdStructs::Ray> targetRays;
+		for (size_t i = 0; i < count && kdtree->getTriangleCount() > 0; i++) {
+			const KdStructs::Triangle* target = kdtree->getTriangle(i % kdtree->getTriangleCount());
+			KdStructs::Vector center = (target->a + target->b + target->c) * (1.0f / 3);
+			targetRays.push_back(KdStructs::Ray(rays[i].origin, center - rays[i].origin, rays[i].distance));
+		}
+		return targetRays;
+	}
+
+	struct SharedEdge
+	{
+		KdStructs::Vector start;
+		KdStructs::Vector end;
+		// Third vertex of both triangles.
+		KdStructs::Vector opposite[2];
+	};
+
+	std::vector<SharedEdge> findSharedEdges(KdTree* kdtree)
+	{
+		// Edge (ordered endpoints) -> third vertices of the triangles using it.
+		std::map<std::array<float, 6>, std::vector<KdStructs::Vector>> edges;
+		for (size_t i = 0; i < kdtree->getTriangleCount(); i++)
+		{
+			const KdStructs::Triangle* triangle = kdtree->getTriangle(i);
+			const KdStructs::Vector* vertices[3] = { &triangle->a, &triangle->b, &triangle->c };
+			for (int corner = 0; corner < 3; corner++)
+			{
+				const KdStructs::Vector* start = vertices[corner];
+				const KdStructs::Vector* end = vertices[(corner + 1) % 3];
+				if (std::lexicographical_compare(end->values, end->values + 3, start->values, start->values + 3))
+					std::swap(start, end);
+				std::array<float, 6> key = { (*start)[0], (*start)[1], (*start)[2], (*end)[0], (*end)[1], (*end)[2] };
+				edges[key].push_back(*vertices[(corner + 2) % 3]);
+			}
+		}
+
+		std::vector<SharedEdge> sharedEdges;
+		for (const auto& edge : edges)
+		{
+			if (edge.second.size() != 2)
+				continue;
+			const std::array<float, 6>& key = edge.first;
+			sharedEdges.push_back({ KdStructs::Vector(key[0], key[1], key[2]), KdStructs::Vector(key[3], key[4], key[5]), { edge.second[0], edge.second[1] } });
+		}
+		return sharedEdges;
+	}
+
+	void compareNearestPoint(const std::string& name, KdTree* kdtree, const std::vector<KdStructs::Vector>& queries)
+	{
+		std::vector<KdStructs::Neighbour> nearest(queries.size());
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < queries.size(); i++)
+			nearest[i] = kdtree->nearestPoint(queries[i]);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << name + ", kd-tree" << std::right
+			<< std::setw(12) << static_cast<long long>(queries.size() / seconds) << " queries/s" << std::endl;
+
+		// Brute force over a flat copy of the points, limited to about a billion distances.
+		std::vector<float> positions;
+		positions.reserve(kdtree->getPointCount() * 3);
+		for (size_t i = 0; i < kdtree->getPointCount(); i++)
+			for (int axis = 0; axis < 3; axis++)
+				positions.push_back(kdtree->getPoint(i)->pos[axis]);
+		size_t bruteCount = std::min(queries.size(), std::max<size_t>(1, 1000000000 / std::max<size_t>(1, kdtree->getPointCount())));
+
+		size_t mismatches = 0;
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < bruteCount; i++) {
+			float best = std::numeric_limits<float>::infinity();
+			for (size_t j = 0; j < positions.size(); j += 3) {
+				float distance = 0;
+				for (int axis = 0; axis < 3; axis++)
+					distance += (queries[i][axis] - positions[j + axis]) * (queries[i][axis] - positions[j + axis]);
+				best = std::min(best, distance);
+			}
+			if (nearest[i].point == nullptr || nearest[i].distance != std::sqrt(best))
+				mismatches++;
+		}
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << name + ", brute force" << std::right
+			<< std::setw(12) << static_cast<long long>(bruteCount / seconds) << " queries/s  "
+			<< mismatches << " of " << bruteCount << " differ" << std::endl;
+	}
+
+	// Bounds of all vertices.
+	void getMeshBounds(KdTree* kdtree, KdStructs::Vector& min, KdStructs::Vector& max)
+	{
+		min = KdStructs::Vector(std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity());
+		max = min * -1;
+		for (size_t i = 0; i < kdtree->getPointCount(); i++)
+			for (int axis = 0; axis < 3; axis++) {
+				min[axis] = std::min(min[axis], kdtree->getPoint(i)->pos[axis]);
+				max[axis] = std::max(max[axis], kdtree->getPoint(i)->pos[axis]);
+			}
+	}
+
+	KdStructs::Vector normalize(const KdStructs::Vector& vector)
+	{
+		return vector * (1 / std::sqrt(vector.dot(vector)));
+	}
+
+	// Six inward facing planes of a camera at eye looking at target, halfAngle in radians for both directions.
+	std::array<KdStructs::Plane, 6> createFrustum(const KdStructs::Vector& eye, const KdStructs::Vector& target, float halfAngle, float nearDistance, float farDistance)
+	{
+		KdStructs::Vector forward = normalize(target - eye);
+		KdStructs::Vector up(0, 1, 0);
+		if (std::abs(forward.dot(up)) > 0.99f)
+			up = KdStructs::Vector(1, 0, 0);
+		KdStructs::Vector right = normalize(forward.cross(up));
+		up = right.cross(forward);
+
+		float sine = std::sin(halfAngle);
+		float cosine = std::cos(halfAngle);
+		std::array<KdStructs::Vector, 6> normals = { forward, forward * -1,
+			forward * sine - right * cosine, forward * sine + right * cosine,
+			forward * sine - up * cosine, forward * sine + up * cosine };
+		std::array<KdStructs::Plane, 6> planes;
+		for (size_t i = 0; i < normals.size(); i++)
+			planes[i] = KdStructs::Plane(normals[i], -normals[i].dot(eye));
+		planes[0].offset -= nearDistance;
+		planes[1].offset += farDistance;
+		return planes;
+	}
+
+	// Tree over count random points in the unit cube. The caller deletes it.
+	KdTree* createRandomCloud(size_t count, std::mt19937& random)
+	{
+		std::uniform_real_distribution<float> distribution(0, 1);
+		std::vector<KdStructs::Point*> points;
+		points.reserve(count);
+		for (size_t i = 0; i < count; i++)
+			points.push_back(new KdStructs::Point(KdStructs::Vector(distribution(random), distribution(random), distribution(random))));
+
+		auto start = std::chrono::steady_clock::now();
+		KdTree* cloud = new KdTree(points);
+		auto end = std::chrono::steady_clock::now();
+		std::cout << "Built tree of " << count << " random points in "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " milliseconds" << std::endl;
+		return cloud;
+	}
+
+	// Copy of the mesh with every vertex moved to transform(position, vertex index). nullptr if its triangles have no vertex indices. The caller deletes it.
+	KdTree* createTransformedMesh(KdTree* kdtree, const std::function<KdStructs::Vector(const KdStructs::Vector&, unsigned int)>& transform)
+	{
+		unsigned int vertexCount = 0;
+		for (size_t i = 0; i < kdtree->getTriangleCount(); i++)
+			for (unsigned int vertex : kdtree->getTriangle(i)->vertices)
+				if (vertex != KdStructs::NO_ID)
+					vertexCount = std::max(vertexCount, vertex + 1);
+		std::vector<float> vertices(vertexCount * 3, 0);
+		std::vector<unsigned int> indices;
+		indices.reserve(kdtree->getTriangleCount() * 3);
+		for (size_t i = 0; i < kdtree->getTriangleCount(); i++) {
+			const KdStructs::Triangle* triangle = kdtree->getTriangle(i);
+			if (triangle->vertices[0] == KdStructs::NO_ID || triangle->vertices[1] == KdStructs::NO_ID || triangle->vertices[2] == KdStructs::NO_ID)
+				continue;
+			const KdStructs::Vector* corners[3] = { &triangle->a, &triangle->b, &triangle->c };
+			for (int j = 0; j < 3; j++) {
+				KdStructs::Vector position = transform(*corners[j], triangle->vertices[j]);
+				std::copy(position.values, position.values + 3, &vertices[triangle->vertices[j] * 3]);
+				indices.push_back(triangle->vertices[j]);
+			}
+		}
+		if (indices.empty()) {
+			std::cout << "Mesh has no vertex indices" << std::endl;
+			return nullptr;
+		}
+		return new KdTree(vertices.data(), vertexCount, indices.data(), static_cast<unsigned int>(indices.size()));
+	}
+
+	// Closed torus around the z axis with the given radii, rings x sides quads. The caller deletes it.
+	KdTree* createTorus(unsigned int rings, unsigned int sides, float radius, float tube)
+	{
+		std::vector<float> vertices;
+		std::vector<unsigned int> indices;
+		for (unsigned int i = 0; i < rings; i++)
+			for (unsigned int j = 0; j < sides; j++) {
+				float ring = 2 * 3.14159265f * i / rings;
+				float side = 2 * 3.14159265f * j / sides;
+				vertices.insert(vertices.end(), { (radius + tube * std::cos(side)) * std::cos(ring), (radius + tube * std::cos(side)) * std::sin(ring), tube * std::sin(side) });
+				unsigned int a = i * sides + j;
+				unsigned int b = ((i + 1) % rings) * sides + j;
+				unsigned int c = ((i + 1) % rings) * sides + (j + 1) % sides;
+				unsigned int d = i * sides + (j + 1) % sides;
+				indices.insert(indices.end(), { a, b, c, a, c, d });
+			}
+		auto start = std::chrono::steady_clock::now();
+		KdTree* torus = new KdTree(vertices.data(), static_cast<unsigned int>(vertices.size() / 3), indices.data(), static_cast<unsigned int>(indices.size()));
+		std::cout << "Built torus of " << indices.size() / 3 << " triangles in "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << " milliseconds" << std::endl;
+		return torus;
+	}
+
+	// Closed axis aligned cube around the origin, each face split into subdivisions x subdivisions quads. The caller deletes it.
+	KdTree* createBox(unsigned int subdivisions, float halfSize)
+	{
+		std::vector<float> vertices;
+		std::vector<unsigned int> indices;
+		std::map<std::array<unsigned int, 3>, unsigned int> lattice;
+		// Vertex at lattice coordinates (0 to subdivisions per axis), shared by the faces meeting there.
+		auto getVertex = [&](const unsigned int coordinates[3]) {
+			std::array<unsigned int, 3> key = { coordinates[0], coordinates[1], coordinates[2] };
+			auto found = lattice.find(key);
+			if (found != lattice.end())
+				return found->second;
+			unsigned int index = static_cast<unsigned int>(vertices.size() / 3);
+			for (int axis = 0; axis < 3; axis++)
+				vertices.push_back(-halfSize + 2 * halfSize * coordinates[axis] / subdivisions);
+			lattice[key] = index;
+			return index;
+		};
+		for (int axis = 0; axis < 3; axis++)
+			for (unsigned int side = 0; side < 2; side++)
+				for (unsigned int i = 0; i < subdivisions; i++)
+					for (unsigned int j = 0; j < subdivisions; j++) {
+						// Corners in (u, v) order, reversed on the negative side so that all faces point outward.
+						unsigned int corners[4];
+						const unsigned int steps[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+						for (int c = 0; c < 4; c++) {
+							unsigned int coordinates[3];
+							coordinates[axis] = side * subdivisions;
+							coordinates[(axis + 1) % 3] = i + steps[side == 1 ? c : 3 - c][0];
+							coordinates[(axis + 2) % 3] = j + steps[side == 1 ? c : 3 - c][1];
+							corners[c] = getVertex(coordinates);
+						}
+						indices.insert(indices.end(), { corners[0], corners[1], corners[2], corners[0], corners[2], corners[3] });
+					}
+		return new KdTree(vertices.data(), static_cast<unsigned int>(vertices.size() / 3), indices.data(), static_cast<unsigned int>(indices.size()));
+	}
+
+	// Position of every voxel of grid, in storage order.
+	std::vector<KdStructs::Vector> getVoxelPositions(const KdStructs::SdfGrid& grid)
+	{
+		std::vector<KdStructs::Vector> voxels;
+		voxels.reserve(grid.getVoxelCount());
+		for (unsigned int z = 0; z < grid.resolution[2]; z++)
+			for (unsigned int y = 0; y < grid.resolution[1]; y++)
+				for (unsigned int x = 0; x < grid.resolution[0]; x++)
+					voxels.push_back(KdStructs::Vector(grid.origin[0] + x * grid.voxelSize, grid.origin[1] + y * grid.voxelSize, grid.origin[2] + z * grid.voxelSize));
+		return voxels;
+	}
+
+	// Errors of a distance field against the exact one: within the band, everywhere, and signs further than a voxel from the surface.
+	void printFieldErrors(const std::string& name, const KdStructs::SdfGrid& grid, const std::vector<KdStructs::Vector>& voxels, const float* distances, double seconds,
+		const std::function<float(const KdStructs::Vector&)>& getExactDistance)
+	{
+		float bandError = 0, maxError = 0;
+		size_t wrongSigns = 0;
+		for (size_t i = 0; i < voxels.size(); i++) {
+			float exact = getExactDistance(voxels[i]);
+			float error = std::fabs(std::fabs(distances[i]) - std::fabs(exact));
+			maxError = std::max(maxError, error);
+			if (std::fabs(exact) < grid.bandWidth * grid.voxelSize)
+				bandError = std::max(bandError, error);
+			if (std::fabs(exact) > grid.voxelSize && (distances[i] < 0) != (exact < 0))
+				wrongSigns++;
+		}
+		std::cout << std::left << std::setw(32) << name << std::right
+			<< std::setw(12) << static_cast<long long>(voxels.size() / seconds) << " voxels/s  max error " << bandError << " in band, "
+			<< maxError << " overall, " << wrongSigns << " wrong signs" << std::endl;
+	}
+
+	bool run(const std::string& name, KdTree* kdtree, const std::vector<KdStructs::Ray>& rays, const std::vector<float>& normals, const std::vector<float>& uvs)
+	{
+		if (name == "sorting")
+			raySorting(kdtree, rays);
+		else if (name == "occlusion")
+			occlusion(kdtree, rays);
+		else if (name == "stackless")
+			stackless(kdtree, rays);
+		else if (name == "all")
+			multiHit(kdtree, rays);
+		else if (name == "kernel")
+			triangleKernel(kdtree, rays);
+		else if (name == "watertight")
+			watertight(kdtree, rays);
+		else if (name == "projection")
+			projection(kdtree, rays);
+		else if (name == "attributes")
+			vertexAttributes(kdtree, rays, normals, uvs);
+		else if (name == "nearest")
+			nearestPoint(kdtree, rays);
+		else if (name == "knn")
+			knn(rays);
+		else if (name == "radius")
+			radius(rays);
+		else if (name == "box")
+			boxQuery(kdtree, rays);
+		else if (name == "closest")
+			closestPoint(kdtree, rays);
+		else if (name == "frustum")
+			frustum(kdtree, rays);
+		else if (name == "approximate")
+			approximateKnn(rays);
+		else if (name == "graph")
+			knnGraph(rays);
+		else if (name == "join")
+			epsilonJoin(rays);
+		else if (name == "overlap")
+			triangleOverlap(kdtree);
+		else if (name == "hausdorff")
+			hausdorff(kdtree);
+		else if (name == "inside")
+			pointInMesh(rays);
+		else if (name == "sdf")
+			signedDistanceField(rays);
+		else
+			return false;
+		return true;
+	}
+
+	void raySorting(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: ray sorting (" << rays.size() << " rays)" << std::endl;
+
+		KdStructs::BatchOptions options;
+		// Warm up caches and thread pool.
+		castBatch(kdtree, rays, options);
+
+		options.packets = false;
+		options.sortRays = false;
+		printStatistics("Arrival order", castBatch(kdtree, rays, options));
+		options.sortRays = true;
+		printStatistics("Sorted", castBatch(kdtree, rays, options));
+
+		options.packets = true;
+		options.sortRays = false;
+		printStatistics("Arrival order, packets", castBatch(kdtree, rays, options));
+		options.sortRays = true;
+		printStatistics("Sorted, packets", castBatch(kdtree, rays, options));
+	}
+
+	void occlusion(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: occlusion (" << rays.size() << " rays)" << std::endl;
+
+		KdStructs::BatchOptions options;
+		options.packets = false;
+		std::vector<uint64_t> occludedMask((rays.size() + 63) / 64);
+		// Warm up caches and thread pool.
+		kdtree->occludedBatch(rays.data(), rays.size(), occludedMask.data(), options);
+
+		printStatistics("Closest hit", castBatch(kdtree, rays, options));
+		printStatistics("Any hit", kdtree->occludedBatch(rays.data(), rays.size(), occludedMask.data(), options));
+	}
+
+	void stackless(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: stackless traversal (" << rays.size() << " rays)" << std::endl;
+
+		auto start = std::chrono::steady_clock::now();
+		kdtree->buildRopes();
+		auto end = std::chrono::steady_clock::now();
+		std::cout << "Ropes built in " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+			<< " microseconds, " << kdtree->getRopeMemory() / 1024 << " KiB" << std::endl;
+
+		KdStructs::BatchOptions options;
+		options.packets = false;
+		// Warm up caches and thread pool.
+		castBatch(kdtree, rays, options);
+
+		printStatistics("Stack", castBatch(kdtree, rays, options));
+		options.stackless = true;
+		printStatistics("Stackless (ropes)", castBatch(kdtree, rays, options));
+	}
+
+	void multiHit(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: multi-hit raycastAll" << std::endl;
+
+		TriangleKernel::Triangles triangles;
+		triangles.resize(kdtree->getTriangleCount());
+		for (size_t i = 0; i < triangles.count; i++)
+			triangles.set(i, *kdtree->getTriangle(i));
+		if (triangles.count == 0) {
+			std::cout << "Mesh has no triangles" << std::endl;
+			return;
+		}
+
+		// Brute force tests every triangle, so the count is limited to about 100 million tests.
+		size_t rayCount = std::min(rays.size(), std::max<size_t>(1, 100000000 / triangles.count));
+		std::vector<KdStructs::Ray> targetRays = getTargetRays(kdtree, rays, rayCount);
+
+		// Every hit of every ray, sorted by distance, with the ids of equally distant hits in ascending order.
+		std::vector<std::vector<std::pair<float, unsigned int>>> reference(rayCount);
+		size_t outputSize = triangles.count + TriangleKernel::MAX_WIDTH;
+		std::vector<float> distances(outputSize), u(outputSize), v(outputSize);
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < rayCount; i++) {
+			const KdStructs::Ray& ray = targetRays[i];
+			float origin[3] = { ray.origin[0], ray.origin[1], ray.origin[2] };
+			float direction[3] = { ray.direction[0], ray.direction[1], ray.direction[2] };
+			TriangleKernel::intersect(TriangleKernel::Isa::SCALAR, triangles, 0, triangles.count, origin, direction, distances.data(), u.data(), v.data());
+			for (size_t j = 0; j < triangles.count; j++)
+				if (distances[j] >= 0 && distances[j] <= ray.distance)
+					reference[i].push_back(std::make_pair(distances[j], static_cast<unsigned int>(j)));
+			std::sort(reference[i].begin(), reference[i].end());
+		}
+		double bruteSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		// Both sides compute distances with their own Moller-Trumbore code, equal up to rounding.
+		auto isClose = [](float a, float b) { return std::abs(a - b) <= 1e-4f * std::max(1.0f, std::abs(a)); };
+
+		const size_t MAX_HITS = 64;
+		std::vector<KdStructs::Hit> hits(MAX_HITS);
+		// Hit limit, and whether tMin lies between the first two hits of each ray (it is 0 otherwise).
+		const std::pair<size_t, bool> settings[] = { { 1, false }, { 4, false }, { MAX_HITS, false }, { 1, true }, { 4, true }, { MAX_HITS, true } };
+		for (const std::pair<size_t, bool>& setting : settings)
+		{
+			size_t maxHits = setting.first;
+			size_t hitCount = 0, truncated = 0, mismatches = 0, duplicates = 0;
+			double seconds = 0;
+			for (size_t i = 0; i < rayCount; i++) {
+				float tMin = setting.second && reference[i].size() > 1 ? (reference[i][0].first + reference[i][1].first) / 2 : 0;
+				auto rayStart = std::chrono::steady_clock::now();
+				size_t count = kdtree->raycastAll(targetRays[i], tMin, std::numeric_limits<float>::infinity(), hits.data(), maxHits);
+				seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - rayStart).count();
+				hitCount += count;
+
+				std::vector<std::pair<float, unsigned int>> expected;
+				for (const std::pair<float, unsigned int>& hit : reference[i])
+					if (hit.first >= tMin)
+						expected.push_back(hit);
+				if (expected.size() > maxHits) {
+					expected.resize(maxHits);
+					truncated++;
+				}
+
+				// Positions may only swap triangles hit at the same distance, e.g. through a shared edge.
+				bool differs = count != expected.size();
+				for (size_t j = 0; j < count && !differs; j++) {
+					differs = !isClose(hits[j].distance, expected[j].first) || (j > 0 && hits[j].distance < hits[j - 1].distance);
+					if (hits[j].triangle != expected[j].second) {
+						auto same = std::find_if(reference[i].begin(), reference[i].end(), [&hits, j](const std::pair<float, unsigned int>& hit) { return hit.second == hits[j].triangle; });
+						differs = differs || same == reference[i].end() || !isClose(same->first, expected[j].first);
+					}
+					for (size_t k = 0; k < j; k++)
+						if (hits[k].triangle == hits[j].triangle)
+							duplicates++;
+				}
+				if (differs)
+					mismatches++;
+			}
+
+			std::string name = "raycastAll (" + std::to_string(maxHits) + " hits, tMin " + (setting.second ? "past first" : "0") + ")";
+			std::cout << std::left << std::setw(40) << name << std::right
+				<< std::setw(12) << static_cast<long long>(rayCount / seconds) << " rays/s  "
+				<< hitCount << " hits, " << truncated << " rays truncated, " << mismatches << " of " << rayCount << " rays differ, " << duplicates << " duplicates" << std::endl;
+		}
+		std::cout << std::left << std::setw(40) << "Brute force" << std::right
+			<< std::setw(12) << static_cast<long long>(rayCount / bruteSeconds) << " rays/s" << std::endl;
+	}
+
+	void triangleKernel(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: triangle kernel" << std::endl;
+
+		TriangleKernel::Triangles triangles;
+		triangles.resize(kdtree->getTriangleCount());
+		for (size_t i = 0; i < triangles.count; i++)
+			triangles.set(i, *kdtree->getTriangle(i));
+
+		// Every ray against every triangle, limited to about 100 million tests. The rays are aimed at the mesh, so that hits get compared too.
+		size_t rayCount = std::min(rays.size(), std::max<size_t>(1, 100000000 / std::max<size_t>(1, triangles.count)));
+		std::vector<KdStructs::Ray> targetRays = getTargetRays(kdtree, rays, rayCount);
+		rayCount = targetRays.size();
+		size_t outputSize = triangles.count + TriangleKernel::MAX_WIDTH;
+		std::vector<float> distances(outputSize), u(outputSize), v(outputSize);
+		std::vector<float> referenceDistances(outputSize), referenceU(outputSize), referenceV(outputSize);
+
+		for (TriangleKernel::Isa isa : { TriangleKernel::Isa::SCALAR, TriangleKernel::Isa::SSE, TriangleKernel::Isa::AVX2, TriangleKernel::Isa::AVX512 })
+		{
+			if (!TriangleKernel::isSupported(isa)) {
+				std::cout << std::left << std::setw(32) << TriangleKernel::getName(isa) << "not supported" << std::endl;
+				continue;
+			}
+
+			size_t hits = 0;
+			size_t mismatches = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < rayCount; i++) {
+				float origin[3] = { targetRays[i].origin[0], targetRays[i].origin[1], targetRays[i].origin[2] };
+				float direction[3] = { targetRays[i].direction[0], targetRays[i].direction[1], targetRays[i].direction[2] };
+				TriangleKernel::intersect(isa, triangles, 0, triangles.count, origin, direction, distances.data(), u.data(), v.data());
+				for (size_t j = 0; j < triangles.count; j++)
+					if (distances[j] >= 0)
+						hits++;
+
+				// Compare against the scalar kernel outside of the measurement: the same hits, bit-identical distances,
+				// and bit-identical barycentric coordinates for the hits (they are undefined for misses).
+				auto pause = std::chrono::steady_clock::now();
+				TriangleKernel::intersect(TriangleKernel::Isa::SCALAR, triangles, 0, triangles.count, origin, direction, referenceDistances.data(), referenceU.data(), referenceV.data());
+				for (size_t j = 0; j < triangles.count; j++) {
+					bool hit = distances[j] >= 0;
+					if (hit != (referenceDistances[j] >= 0) || std::memcmp(&distances[j], &referenceDistances[j], sizeof(float)) != 0
+						|| (hit && (std::memcmp(&u[j], &referenceU[j], sizeof(float)) != 0 || std::memcmp(&v[j], &referenceV[j], sizeof(float)) != 0))) {
+						mismatches++;
+						break;
+					}
+				}
+				start += std::chrono::steady_clock::now() - pause;
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			std::cout << std::left << std::setw(32) << TriangleKernel::getName(isa) << std::right
+				<< std::setw(12) << static_cast<long long>(rayCount * triangles.count / seconds) << " triangles/s  "
+				<< hits << " hits, " << mismatches << " rays differ from scalar" << std::endl;
+		}
+
+		KdStructs::BatchOptions options;
+		options.packets = false;
+		kdtree->setIntersectionMode(KdStructs::IntersectionMode::MOLLER_TRUMBORE);
+		printStatistics("Raycast, Moller-Trumbore", castBatch(kdtree, rays, options));
+		kdtree->setIntersectionMode(KdStructs::IntersectionMode::SIMD);
+		printStatistics(std::string("Raycast, SIMD (") + TriangleKernel::getName(TriangleKernel::getBestIsa()) + ")", castBatch(kdtree, rays, options));
+		kdtree->setIntersectionMode(KdStructs::IntersectionMode::MOLLER_TRUMBORE);
+	}
+
+	void watertight(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: watertight intersection" << std::endl;
+
+		// Rays from the random origins towards points on edges shared by two triangles.
+		// Rays crossing the surface there have to hit one of them (grazing the silhouette doesn't count).
+		std::vector<SharedEdge> edges = findSharedEdges(kdtree);
+		std::vector<KdStructs::Ray> edgeRays;
+		for (size_t i = 0; i < rays.size() && !edges.empty(); i++)
+		{
+			const SharedEdge& edge = edges[i % edges.size()];
+			float weight = static_cast<float>(i % 7 + 1) / 8;
+			KdStructs::Vector target = edge.start + (edge.end - edge.start) * weight;
+			KdStructs::Vector direction = target - rays[i].origin;
+
+			// Opposite vertices on the same side of the plane through edge and ray -> silhouette.
+			KdStructs::Vector normal = (edge.end - edge.start).cross(direction);
+			float side0 = normal.dot(edge.opposite[0] - edge.start);
+			float side1 = normal.dot(edge.opposite[1] - edge.start);
+			if ((side0 < 0) == (side1 < 0) || side0 == 0 || side1 == 0)
+				continue;
+			edgeRays.push_back(KdStructs::Ray(rays[i].origin, direction, 2));
+		}
+
+		KdStructs::BatchOptions options;
+		options.packets = false;
+		for (KdStructs::IntersectionMode mode : { KdStructs::IntersectionMode::MOLLER_TRUMBORE, KdStructs::IntersectionMode::WATERTIGHT })
+		{
+			std::string name = mode == KdStructs::IntersectionMode::WATERTIGHT ? "Watertight" : "Moller-Trumbore";
+			kdtree->setIntersectionMode(mode);
+			printStatistics(name, castBatch(kdtree, rays, options));
+
+			KdStructs::BatchStatistics statistics = castBatch(kdtree, edgeRays, options);
+			std::cout << std::left << std::setw(32) << name + ", edge rays" << std::right
+				<< std::setw(12) << statistics.rayCount - statistics.hitCount << " of " << statistics.rayCount << " slipped through" << std::endl;
+		}
+		kdtree->setIntersectionMode(KdStructs::IntersectionMode::MOLLER_TRUMBORE);
+	}
+
+	void projection(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: projection records (" << rays.size() << " rays)" << std::endl;
+
+		KdStructs::BatchOptions options;
+		options.packets = false;
+		kdtree->setIntersectionMode(KdStructs::IntersectionMode::MOLLER_TRUMBORE);
+		castBatch(kdtree, rays, options);
+		printStatistics("Moller-Trumbore", castBatch(kdtree, rays, options));
+
+		auto start = std::chrono::steady_clock::now();
+		kdtree->setIntersectionMode(KdStructs::IntersectionMode::PROJECTION);
+		auto end = std::chrono::steady_clock::now();
+		printStatistics("Projection", castBatch(kdtree, rays, options));
+		kdtree->setIntersectionMode(KdStructs::IntersectionMode::MOLLER_TRUMBORE);
+
+		size_t triangleCount = kdtree->getTriangleCount();
+		std::cout << "Triangles: " << triangleCount << ", " << sizeof(KdStructs::Triangle) << " bytes each ("
+			<< triangleCount * sizeof(KdStructs::Triangle) / 1024 << " KiB)" << std::endl;
+		std::cout << "Projection records: " << sizeof(KdStructs::ProjectedTriangle) << " bytes each (" << kdtree->getProjectionMemory() / 1024 << " KiB), built in "
+			<< std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " microseconds" << std::endl;
+	}
+
+	void vertexAttributes(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays, const std::vector<float>& normals, const std::vector<float>& uvs)
+	{
+		std::cout << "\n[*] Benchmark: vertex attributes" << std::endl;
+		if (normals.empty() || kdtree->getTriangleCount() == 0) {
+			std::cout << "Needs a mesh loaded with --load" << std::endl;
+			return;
+		}
+
+		// Short rays onto a corner of a triangle each, from the front side of the triangle and tilted by the random ray's direction.
+		// Far away origins would make the barycentric coordinates less precise than the tolerance below.
+		size_t triangleCount = kdtree->getTriangleCount();
+		std::vector<KdStructs::Ray> vertexRays;
+		vertexRays.reserve(rays.size());
+		for (size_t i = 0; i < rays.size(); i++) {
+			const KdStructs::Triangle* target = kdtree->getTriangle(i % triangleCount);
+			const KdStructs::Vector* corners[3] = { &target->a, &target->b, &target->c };
+			const KdStructs::Vector& corner = *corners[i / triangleCount % 3];
+			KdStructs::Vector normal = (target->b - target->a).cross(target->c - target->a);
+			float edge = std::sqrt((target->b - target->a).dot(target->b - target->a));
+			float length = std::sqrt(normal.dot(normal));
+			if (!(length > 0))
+				continue;
+			KdStructs::Vector offset = normal * (edge / length) + (rays[i].direction - KdStructs::Vector(0.5f, 0.5f, 0.5f)) * edge;
+			vertexRays.push_back(KdStructs::Ray(corner + offset, offset * -1.0f, 2));
+		}
+
+		KdStructs::BatchOptions options;
+		options.packets = false;
+		std::vector<KdStructs::RayHit*> hits(vertexRays.size(), nullptr);
+		// Warm up caches and thread pool.
+		castBatch(kdtree, vertexRays, options);
+		printStatistics("raycastBatch", castBatch(kdtree, vertexRays, options));
+		options.attributes = true;
+		printStatistics("raycastBatch, attributes", kdtree->raycastBatch(vertexRays.data(), vertexRays.size(), hits.data(), options));
+
+		// Hits on the targeted vertex have to reproduce the file's data of the hit triangle's corner there.
+		const float TOLERANCE = 1e-3f;
+		size_t vertexHits = 0, wrongNormals = 0, wrongUvs = 0, invalidNormals = 0, differFromRaycast = 0;
+		float normalError = 0, uvError = 0;
+		for (size_t i = 0; i < vertexRays.size(); i++) {
+			const KdStructs::RayHit* hit = hits[i];
+			if (hit == nullptr)
+				continue;
+
+			// Grazing rays get imprecise barycentric coordinates, even where the hit position is exact.
+			KdStructs::Vector normal = (hit->triangle->b - hit->triangle->a).cross(hit->triangle->c - hit->triangle->a);
+			const KdStructs::Vector& direction = vertexRays[i].direction;
+			float cosine = normal.dot(direction);
+			if (cosine * cosine < 0.01f * normal.dot(normal) * direction.dot(direction))
+				continue;
+
+			// Corner of the hit triangle closest to the hit. Something in front of the targeted vertex may be hit instead,
+			// so the hit has to lie on the corner (up to rounding, relative to the triangle's size).
+			const KdStructs::Vector* corners[3] = { &hit->triangle->a, &hit->triangle->b, &hit->triangle->c };
+			int closest = 0;
+			float closestDistance = std::numeric_limits<float>::infinity();
+			float size = 0;
+			for (int j = 0; j < 3; j++) {
+				KdStructs::Vector offset = *corners[j] - hit->position;
+				float distance = offset.dot(offset);
+				if (distance < closestDistance) {
+					closestDistance = distance;
+					closest = j;
+				}
+				KdStructs::Vector edge = *corners[(j + 1) % 3] - *corners[j];
+				size = std::max(size, edge.dot(edge));
+			}
+			unsigned int vertex = hit->triangle->vertices[closest];
+			if (closestDistance > 1e-8f * size || vertex == KdStructs::NO_ID || vertex >= normals.size() / 3)
+				continue;
+			vertexHits++;
+
+			const float* expected = &normals[vertex * 3];
+			float length = std::sqrt(expected[0] * expected[0] + expected[1] * expected[1] + expected[2] * expected[2]);
+			if (!hit->attributes.validNormal) {
+				if (length > 0)
+					invalidNormals++;
+			}
+			else {
+				float error = 0;
+				for (int axis = 0; axis < 3; axis++)
+					error = std::max(error, std::abs(hit->attributes.normal[axis] - expected[axis] / length));
+				normalError = std::max(normalError, error);
+				if (error > TOLERANCE)
+					wrongNormals++;
+			}
+			float error = 0;
+			for (int j = 0; j < 2; j++)
+				error = std::max(error, std::abs(hit->attributes.uv[j] - uvs[vertex * 2 + j]));
+			uvError = std::max(uvError, error);
+			if (error > TOLERANCE)
+				wrongUvs++;
+
+			// Single ray query with attributes, it runs the same traversal.
+			KdStructs::HitAttributes attributes;
+			kdtree->raycast(vertexRays[i], attributes);
+			if (std::memcmp(attributes.normal, hit->attributes.normal, sizeof(attributes.normal)) != 0 || std::memcmp(attributes.uv, hit->attributes.uv, sizeof(attributes.uv)) != 0)
+				differFromRaycast++;
+		}
+		for (KdStructs::RayHit* hit : hits)
+			delete hit;
+
+		std::cout << vertexHits << " of " << vertexRays.size() << " rays hit their vertex (at an angle of more than 6 degrees)" << std::endl;
+		std::cout << "Normals: max error " << normalError << ", " << wrongNormals << " wrong, " << invalidNormals << " invalid" << std::endl;
+		std::cout << "UVs: max error " << uvError << ", " << wrongUvs << " wrong" << std::endl;
+		std::cout << differFromRaycast << " differ from raycast with attributes" << std::endl;
+	}
+
+	void nearestPoint(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: nearest point" << std::endl;
+
+		// Mesh queries: the triangles' corners, moved by up to 5% of the mesh's size along each axis.
+		KdStructs::Vector meshMin(0, 0, 0);
+		KdStructs::Vector meshMax(0, 0, 0);
+		getMeshBounds(kdtree, meshMin, meshMax);
+		std::mt19937 random(42);
+		std::uniform_real_distribution<float> jitter(-0.05f, 0.05f);
+		std::vector<KdStructs::Vector> queries;
+		queries.reserve(rays.size());
+		for (size_t i = 0; i < rays.size() && kdtree->getTriangleCount() > 0; i++) {
+			const KdStructs::Triangle* triangle = kdtree->getTriangle(i % kdtree->getTriangleCount());
+			const KdStructs::Vector* corners[3] = { &triangle->a, &triangle->b, &triangle->c };
+			KdStructs::Vector query = *corners[i / kdtree->getTriangleCount() % 3];
+			for (int axis = 0; axis < 3; axis++)
+				query[axis] += jitter(random) * (meshMax[axis] - meshMin[axis]);
+			queries.push_back(query);
+		}
+		compareNearestPoint("Mesh (" + std::to_string(kdtree->getPointCount()) + " points)", kdtree, queries);
+
+		std::uniform_real_distribution<float> distribution(0, 1);
+		KdTree* cloud = createRandomCloud(rays.size(), random);
+		queries.resize(rays.size(), KdStructs::Vector(0, 0, 0));
+
+		for (KdStructs::Vector& query : queries)
+			query = KdStructs::Vector(distribution(random), distribution(random), distribution(random));
+		compareNearestPoint("Random points", cloud, queries);
+		delete cloud;
+	}
+
+	void knn(const std::vector<KdStructs::Ray>& rays)
+	{
+		const unsigned int K = 16;
+		std::cout << "\n[*] Benchmark: k nearest neighbours (k = " << K << ")" << std::endl;
+
+		std::mt19937 random(42);
+		std::uniform_real_distribution<float> distribution(0, 1);
+		KdTree* cloud = createRandomCloud(rays.size(), random);
+
+		std::vector<KdStructs::Vector> queries;
+		queries.reserve(rays.size());
+		for (size_t i = 0; i < rays.size(); i++)
+			queries.push_back(KdStructs::Vector(distribution(random), distribution(random), distribution(random)));
+
+		std::vector<unsigned int> ids(queries.size() * K);
+		std::vector<float> distances(queries.size() * K);
+		KdStructs::BatchStatistics statistics = cloud->knnBatch(queries.data(), queries.size(), K, ids.data(), distances.data());
+		std::cout << std::left << std::setw(32) << "knnBatch" << std::right
+			<< std::setw(12) << static_cast<long long>(statistics.raysPerSecond()) << " queries/s  "
+			<< std::setw(10) << static_cast<long long>(statistics.seconds * 1000000) << " microseconds" << std::endl;
+
+		// Compare all k neighbours of some queries against brute force, in order. Only points at the same distance may swap places.
+		size_t checkCount = std::min<size_t>(queries.size(), std::max<size_t>(1, 200000000 / std::max<size_t>(1, cloud->getPointCount())));
+		size_t mismatches = 0;
+		auto getSquaredDistance = [cloud](const KdStructs::Vector& query, unsigned int id) {
+			float distance = 0;
+			for (int axis = 0; axis < 3; axis++)
+				distance += (query[axis] - cloud->getPoint(id)->pos[axis]) * (query[axis] - cloud->getPoint(id)->pos[axis]);
+			return distance;
+		};
+		std::vector<std::pair<float, unsigned int>> all(cloud->getPointCount());
+		for (size_t i = 0; i < checkCount; i++) {
+			for (unsigned int j = 0; j < all.size(); j++)
+				all[j] = std::make_pair(getSquaredDistance(queries[i], j), j);
+			size_t found = std::min<size_t>(K, all.size());
+			std::partial_sort(all.begin(), all.begin() + found, all.end());
+			for (size_t j = 0; j < K; j++) {
+				float expected = j < found ? std::sqrt(all[j].first) : std::numeric_limits<float>::infinity();
+				unsigned int id = ids[i * K + j];
+				bool sameId = j < found ? id == all[j].second || (id < all.size() && std::sqrt(getSquaredDistance(queries[i], id)) == expected) : id == KdStructs::NO_ID;
+				if (distances[i * K + j] != expected || !sameId) {
+					mismatches++;
+					break;
+				}
+			}
+		}
+		std::cout << mismatches << " of " << checkCount << " queries differ from brute force" << std::endl;
+		delete cloud;
+	}
+
+	void radius(const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: fixed-radius search" << std::endl;
+
+		std::mt19937 random(42);
+		std::uniform_real_distribution<float> distribution(0, 1);
+		KdTree* cloud = createRandomCloud(rays.size(), random);
+
+		std::vector<KdStructs::Vector> queries;
+		queries.reserve(rays.size());
+		for (size_t i = 0; i < rays.size(); i++)
+			queries.push_back(KdStructs::Vector(distribution(random), distribution(random), distribution(random)));
+
+		// Spheres holding about 32 and 1024 points; the larger ones accept more subtrees wholesale.
+		const float PI = 3.14159265f;
+		for (float expected : { 32.0f, 1024.0f })
+		{
+			float radius = std::cbrt(expected / std::max<size_t>(1, cloud->getPointCount()) * 3 / (4 * PI));
+			std::cout << "Radius " << radius << std::endl;
+
+			std::vector<size_t> counts(queries.size());
+			auto start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < queries.size(); i++)
+				counts[i] = cloud->radiusCount(queries[i], radius);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::cout << std::left << std::setw(32) << "radiusCount" << std::right
+				<< std::setw(12) << static_cast<long long>(queries.size() / seconds) << " queries/s" << std::endl;
+
+			std::vector<size_t> found(queries.size());
+			size_t total = 0;
+			start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < queries.size(); i++)
+				cloud->radiusSearch(queries[i], radius, [&](const KdStructs::Point*, float) { found[i]++; });
+			seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			for (size_t count : found)
+				total += count;
+			std::cout << std::left << std::setw(32) << "radiusSearch" << std::right
+				<< std::setw(12) << static_cast<long long>(queries.size() / seconds) << " queries/s  "
+				<< static_cast<double>(total) / std::max<size_t>(1, queries.size()) << " points per query" << std::endl;
+
+			size_t checkCount = std::min<size_t>(queries.size(), std::max<size_t>(1, 200000000 / std::max<size_t>(1, cloud->getPointCount())));
+			size_t mismatches = 0;
+			for (size_t i = 0; i < checkCount; i++) {
+				size_t inside = 0;
+				for (size_t j = 0; j < cloud->getPointCount(); j++) {
+					float distance = 0;
+					for (int axis = 0; axis < 3; axis++)
+						distance += (queries[i][axis] - cloud->getPoint(j)->pos[axis]) * (queries[i][axis] - cloud->getPoint(j)->pos[axis]);
+					if (distance <= radius * radius)
+						inside++;
+				}
+				if (counts[i] != inside || found[i] != inside)
+					mismatches++;
+			}
+			std::cout << mismatches << " of " << checkCount << " queries differ from brute force" << std::endl;
+		}
+		delete cloud;
+	}
+
+	void boxQuery(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: box query" << std::endl;
+
+		KdStructs::Vector meshMin(0, 0, 0);
+		KdStructs::Vector meshMax(0, 0, 0);
+		getMeshBounds(kdtree, meshMin, meshMax);
+
+		std::mt19937 random(42);
+		std::uniform_real_distribution<float> distribution(0, 1);
+		std::vector<KdStructs::Vector> mins(rays.size(), KdStructs::Vector(0, 0, 0));
+		std::vector<KdStructs::Vector> maxs(rays.size(), KdStructs::Vector(0, 0, 0));
+		for (size_t i = 0; i < rays.size(); i++)
+			for (int axis = 0; axis < 3; axis++) {
+				float extent = meshMax[axis] - meshMin[axis];
+				float center = meshMin[axis] + distribution(random) * extent;
+				float halfSize = (0.01f + 0.04f * distribution(random)) * extent;
+				mins[i][axis] = center - halfSize;
+				maxs[i][axis] = center + halfSize;
+			}
+
+		std::vector<std::vector<unsigned int>> single(rays.size());
+		size_t total = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < rays.size(); i++)
+			total += kdtree->queryBox(mins[i], maxs[i], single[i]);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << "queryBox" << std::right
+			<< std::setw(12) << static_cast<long long>(rays.size() / seconds) << " boxes/s  "
+			<< static_cast<double>(total) / std::max<size_t>(1, rays.size()) << " triangles per box" << std::endl;
+
+		std::vector<std::vector<unsigned int>> batch(rays.size());
+		KdStructs::BatchStatistics statistics = kdtree->queryBoxBatch(mins.data(), maxs.data(), rays.size(), batch.data());
+		std::cout << std::left << std::setw(32) << "queryBoxBatch" << std::right
+			<< std::setw(12) << static_cast<long long>(statistics.raysPerSecond()) << " boxes/s  "
+			<< statistics.hitCount << " boxes overlap the mesh" << std::endl;
+
+		size_t bruteCount = std::min(rays.size(), std::max<size_t>(1, 200000000 / std::max<size_t>(1, kdtree->getTriangleCount())));
+		size_t mismatches = 0;
+		std::vector<unsigned int> expected;
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < bruteCount; i++) {
+			expected.clear();
+			for (size_t j = 0; j < kdtree->getTriangleCount(); j++)
+				if (KdTree::triangleOverlapsBox(*kdtree->getTriangle(j), mins[i], maxs[i]))
+					expected.push_back(static_cast<unsigned int>(j));
+			std::sort(single[i].begin(), single[i].end());
+			std::sort(batch[i].begin(), batch[i].end());
+			if (single[i] != expected || batch[i] != expected)
+				mismatches++;
+		}
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << "Brute force" << std::right
+			<< std::setw(12) << static_cast<long long>(bruteCount / seconds) << " boxes/s  "
+			<< mismatches << " of " << bruteCount << " differ" << std::endl;
+	}
+
+	void closestPoint(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: closest point on mesh" << std::endl;
+
+		// Queries in the mesh's bounds grown by half their size on every side.
+		KdStructs::Vector meshMin(0, 0, 0);
+		KdStructs::Vector meshMax(0, 0, 0);
+		getMeshBounds(kdtree, meshMin, meshMax);
+		std::mt19937 random(42);
+		std::uniform_real_distribution<float> distribution(-0.5f, 1.5f);
+		std::vector<KdStructs::Vector> queries(rays.size(), KdStructs::Vector(0, 0, 0));
+		for (KdStructs::Vector& query : queries)
+			for (int axis = 0; axis < 3; axis++)
+				query[axis] = meshMin[axis] + distribution(random) * (meshMax[axis] - meshMin[axis]);
+
+		std::vector<KdStructs::SurfacePoint> single(queries.size());
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < queries.size(); i++)
+			single[i] = kdtree->closestPointOnMesh(queries[i]);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << "closestPointOnMesh" << std::right
+			<< std::setw(12) << static_cast<long long>(queries.size() / seconds) << " queries/s" << std::endl;
+
+		std::vector<KdStructs::SurfacePoint> batch(queries.size());
+		KdStructs::BatchStatistics statistics = kdtree->closestPointOnMeshBatch(queries.data(), queries.size(), std::numeric_limits<float>::infinity(), batch.data());
+		std::cout << std::left << std::setw(32) << "closestPointOnMeshBatch" << std::right
+			<< std::setw(12) << static_cast<long long>(statistics.raysPerSecond()) << " queries/s" << std::endl;
+
+		size_t bruteCount = std::min(queries.size(), std::max<size_t>(1, 200000000 / std::max<size_t>(1, kdtree->getTriangleCount())));
+		size_t mismatches = 0;
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < bruteCount; i++) {
+			float query[3] = { queries[i][0], queries[i][1], queries[i][2] };
+			float best = std::numeric_limits<float>::infinity();
+			for (size_t j = 0; j < kdtree->getTriangleCount(); j++) {
+				float closest[3];
+				best = std::min(best, KdTree::closestPointOnTriangle(*kdtree->getTriangle(j), query, closest));
+			}
+			if (!single[i].valid || single[i].distance != std::sqrt(best) || !batch[i].valid || batch[i].distance != std::sqrt(best))
+				mismatches++;
+		}
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << "Brute force" << std::right
+			<< std::setw(12) << static_cast<long long>(bruteCount / seconds) << " queries/s  "
+			<< mismatches << " of " << bruteCount << " differ" << std::endl;
+	}
+
+	void frustum(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: frustum culling" << std::endl;
+
+		// Cameras on a sphere around the mesh, looking at random points inside it with 15 to 45 degree wide views.
+		KdStructs::Vector meshMin(0, 0, 0);
+		KdStructs::Vector meshMax(0, 0, 0);
+		getMeshBounds(kdtree, meshMin, meshMax);
+		KdStructs::Vector center = (meshMin + meshMax) * 0.5f;
+		float size = std::sqrt((meshMax - meshMin).dot(meshMax - meshMin));
+		std::mt19937 random(42);
+		std::uniform_real_distribution<float> distribution(0, 1);
+		std::normal_distribution<float> normal(0, 1);
+		std::vector<std::array<KdStructs::Plane, 6>> frustums;
+		frustums.reserve(rays.size());
+		for (size_t i = 0; i < rays.size(); i++) {
+			KdStructs::Vector eye = center + normalize(KdStructs::Vector(normal(random), normal(random), normal(random))) * size;
+			KdStructs::Vector target(0, 0, 0);
+			for (int axis = 0; axis < 3; axis++)
+				target[axis] = meshMin[axis] + distribution(random) * (meshMax[axis] - meshMin[axis]);
+			float halfAngle = (7.5f + 15 * distribution(random)) * 3.14159265f / 180;
+			frustums.push_back(createFrustum(eye, target, halfAngle, 0.1f * size, 2 * size));
+		}
+
+		std::vector<unsigned int> triangleIds;
+		size_t total = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (const auto& planes : frustums)
+			total += kdtree->queryPolytope(planes.data(), static_cast<unsigned int>(planes.size()), triangleIds);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << "queryPolytope" << std::right
+			<< std::setw(12) << static_cast<long long>(frustums.size() / seconds) << " frustums/s  "
+			<< static_cast<double>(total) / std::max<size_t>(1, frustums.size()) << " of " << kdtree->getTriangleCount() << " triangles per frustum" << std::endl;
+
+		size_t bruteCount = std::min(frustums.size(), std::max<size_t>(1, 100000000 / std::max<size_t>(1, kdtree->getTriangleCount())));
+		size_t mismatches = 0;
+		std::vector<unsigned int> expected;
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < bruteCount; i++) {
+			expected.clear();
+			for (size_t j = 0; j < kdtree->getTriangleCount(); j++) {
+				const KdStructs::Triangle* triangle = kdtree->getTriangle(j);
+				bool outside = false;
+				for (const KdStructs::Plane& plane : frustums[i])
+					outside = outside || (plane.getDistance(triangle->a.values) < 0 && plane.getDistance(triangle->b.values) < 0 && plane.getDistance(triangle->c.values) < 0);
+				if (!outside)
+					expected.push_back(static_cast<unsigned int>(j));
+			}
+			kdtree->queryPolytope(frustums[i].data(), static_cast<unsigned int>(frustums[i].size()), triangleIds);
+			std::sort(triangleIds.begin(), triangleIds.end());
+			if (triangleIds != expected)
+				mismatches++;
+		}
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << "Brute force" << std::right
+			<< std::setw(12) << static_cast<long long>(bruteCount / seconds) << " frustums/s  "
+			<< mismatches << " of " << bruteCount << " differ" << std::endl;
+	}
+
+	void approximateKnn(const std::vector<KdStructs::Ray>& rays)
+	{
+		const unsigned int K = 16;
+		std::cout << "\n[*] Benchmark: approximate k nearest neighbours (k = " << K << ")" << std::endl;
+
+		std::mt19937 random(42);
+		std::uniform_real_distribution<float> distribution(0, 1);
+		KdTree* cloud = createRandomCloud(rays.size(), random);
+
+		std::vector<KdStructs::Vector> queries;
+		queries.reserve(rays.size());
+		for (size_t i = 0; i < rays.size(); i++)
+			queries.push_back(KdStructs::Vector(distribution(random), distribution(random), distribution(random)));
+
+		std::vector<unsigned int> exactIds(queries.size() * K);
+		std::vector<float> exactDistances(queries.size() * K);
+		// Warm up caches and thread pool, so that the first row of the table isn't slowed down.
+		cloud->knnBatch(queries.data(), queries.size(), K, exactIds.data(), exactDistances.data());
+		// Exact reference for the recall.
+		cloud->knnBatch(queries.data(), queries.size(), K, exactIds.data(), exactDistances.data());
+
+		std::cout << std::left << std::setw(10) << "Epsilon" << std::setw(12) << "Max visits" << std::right
+			<< std::setw(14) << "queries/s" << std::setw(10) << "recall" << std::setw(16) << "worst k-th" << std::endl;
+		std::vector<unsigned int> ids(queries.size() * K);
+		std::vector<float> distances(queries.size() * K);
+		for (unsigned int maxVisits : { 0u, 256u, 64u })
+		{
+			for (float epsilon : { 0.0f, 0.5f, 1.0f, 2.0f })
+			{
+				KdStructs::Approximation approximation;
+				approximation.epsilon = epsilon;
+				approximation.maxVisits = maxVisits;
+				KdStructs::BatchStatistics statistics = cloud->knnBatch(queries.data(), queries.size(), K, ids.data(), distances.data(), KdStructs::BatchOptions(), approximation);
+
+				// Recall: share of the exact neighbours found. Worst k-th: largest ratio of found to exact k-th distance.
+				size_t found = 0;
+				float worst = 1;
+				for (size_t i = 0; i < queries.size(); i++) {
+					std::vector<unsigned int> exact(exactIds.begin() + i * K, exactIds.begin() + (i + 1) * K);
+					std::sort(exact.begin(), exact.end());
+					for (unsigned int j = 0; j < K; j++)
+						if (std::binary_search(exact.begin(), exact.end(), ids[i * K + j]))
+							found++;
+					if (exactDistances[i * K + K - 1] > 0)
+						worst = std::max(worst, distances[i * K + K - 1] / exactDistances[i * K + K - 1]);
+				}
+
+				std::cout << std::left << std::setw(10) << epsilon << std::setw(12) << (maxVisits > 0 ? std::to_string(maxVisits) : "-") << std::right
+					<< std::setw(14) << static_cast<long long>(statistics.raysPerSecond())
+					<< std::setw(10) << std::fixed << std::setprecision(4) << static_cast<double>(found) / std::max<size_t>(1, queries.size() * K)
+					<< std::setw(16) << worst << std::defaultfloat << std::endl;
+			}
+		}
+		delete cloud;
+	}
+
+	void knnGraph(const std::vector<KdStructs::Ray>& rays)
+	{
+		const unsigned int K = 16;
+		std::cout << "\n[*] Benchmark: k nearest neighbour graph (k = " << K << ")" << std::endl;
+
+		std::mt19937 random(42);
+		KdTree* cloud = createRandomCloud(rays.size(), random);
+
+		KdStructs::NeighbourGraph graph;
+		KdStructs::BatchStatistics statistics = cloud->buildKnnGraph(K, graph);
+		std::cout << std::left << std::setw(32) << "buildKnnGraph" << std::right
+			<< std::setw(12) << static_cast<long long>(statistics.raysPerSecond()) << " points/s  "
+			<< std::setw(10) << static_cast<long long>(statistics.seconds * 1000) << " milliseconds" << std::endl;
+
+		// Every point as query, k + 1 to skip the point itself.
+		std::vector<KdStructs::Vector> queries;
+		queries.reserve(cloud->getPointCount());
+		for (size_t i = 0; i < cloud->getPointCount(); i++)
+			queries.push_back(cloud->getPoint(i)->pos);
+		std::vector<unsigned int> ids(queries.size() * (K + 1));
+		std::vector<float> distances(queries.size() * (K + 1));
+		statistics = cloud->knnBatch(queries.data(), queries.size(), K + 1, ids.data(), distances.data());
+		std::cout << std::left << std::setw(32) << "knnBatch per point" << std::right
+			<< std::setw(12) << static_cast<long long>(statistics.raysPerSecond()) << " points/s  "
+			<< std::setw(10) << static_cast<long long>(statistics.seconds * 1000) << " milliseconds" << std::endl;
+
+		size_t mismatches = 0;
+		for (size_t i = 0; i < queries.size(); i++) {
+			size_t count = graph.offsets[i + 1] - graph.offsets[i];
+			for (size_t j = 0; j < count; j++)
+				if (graph.neighbours[graph.offsets[i] + j] != ids[i * (K + 1) + j + 1] || graph.distances[graph.offsets[i] + j] != distances[i * (K + 1) + j + 1]) {
+					mismatches++;
+					break;
+				}
+		}
+		std::cout << mismatches << " of " << queries.size() << " points differ from knnBatch" << std::endl;
+		delete cloud;
+	}
+
+	void epsilonJoin(const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: epsilon join" << std::endl;
+
+		std::mt19937 random(42);
+		KdTree* first = createRandomCloud(rays.size(), random);
+
+		// Second epoch: every point moved by a tenth of the average spacing.
+		float spacing = std::cbrt(1.0f / std::max<size_t>(1, first->getPointCount()));
+		std::normal_distribution<float> jitter(0, spacing / 10);
+		std::vector<KdStructs::Point*> points;
+		points.reserve(first->getPointCount());
+		for (size_t i = 0; i < first->getPointCount(); i++) {
+			const KdStructs::Vector& position = first->getPoint(i)->pos;
+			points.push_back(new KdStructs::Point(KdStructs::Vector(position[0] + jitter(random), position[1] + jitter(random), position[2] + jitter(random))));
+		}
+		KdTree* second = new KdTree(points);
+
+		float epsilon = spacing / 2;
+		std::vector<std::vector<unsigned int>> counts(first->getThreadCount(), std::vector<unsigned int>(first->getPointCount(), 0));
+		auto start = std::chrono::steady_clock::now();
+		size_t pairCount = first->epsilonJoin(*second, epsilon, [&counts](const KdStructs::Point* a, const KdStructs::Point*, float, unsigned int worker) {
+			counts[worker][a->id]++;
+		});
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "Epsilon " << epsilon << std::endl;
+		std::cout << std::left << std::setw(32) << "epsilonJoin" << std::right
+			<< std::setw(12) << static_cast<long long>(first->getPointCount() / seconds) << " points/s  "
+			<< std::setw(10) << static_cast<long long>(seconds * 1000) << " milliseconds  " << pairCount << " pairs" << std::endl;
+
+		size_t bruteCount = std::min(first->getPointCount(), std::max<size_t>(1, 200000000 / std::max<size_t>(1, second->getPointCount())));
+		size_t mismatches = 0;
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < bruteCount; i++) {
+			const KdStructs::Vector& a = first->getPoint(i)->pos;
+			unsigned int expected = 0;
+			for (size_t j = 0; j < second->getPointCount(); j++) {
+				const KdStructs::Vector& b = second->getPoint(j)->pos;
+				float distance = 0;
+				for (int axis = 0; axis < 3; axis++)
+					distance += (a[axis] - b[axis]) * (a[axis] - b[axis]);
+				if (distance <= epsilon * epsilon)
+					expected++;
+			}
+			unsigned int found = 0;
+			for (const std::vector<unsigned int>& workerCounts : counts)
+				found += workerCounts[i];
+			if (found != expected)
+				mismatches++;
+		}
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << "Brute force" << std::right
+			<< std::setw(12) << static_cast<long long>(bruteCount / seconds) << " points/s  "
+			<< mismatches << " of " << bruteCount << " points differ" << std::endl;
+		delete first;
+		delete second;
+	}
+
+	void triangleOverlap(KdTree* kdtree)
+	{
+		std::cout << "\n[*] Benchmark: triangle overlap of two meshes" << std::endl;
+
+		// Second mesh: the loaded one, rotated by 30 degrees around y and moved by a tenth of its size.
+		KdStructs::Vector meshMin(0, 0, 0);
+		KdStructs::Vector meshMax(0, 0, 0);
+		getMeshBounds(kdtree, meshMin, meshMax);
+		KdStructs::Vector center = (meshMin + meshMax) * 0.5f;
+		float size = std::sqrt((meshMax - meshMin).dot(meshMax - meshMin));
+		float angle = 30 * 3.14159265f / 180;
+		KdTree* other = createTransformedMesh(kdtree, [center, size, angle](const KdStructs::Vector& position, unsigned int) {
+			KdStructs::Vector local = position - center;
+			return KdStructs::Vector(center[0] + std::cos(angle) * local[0] + std::sin(angle) * local[2] + size / 10, center[1] + local[1],
+				center[2] - std::sin(angle) * local[0] + std::cos(angle) * local[2]);
+		});
+		if (other == nullptr)
+			return;
+
+		std::vector<std::vector<std::pair<unsigned int, unsigned int>>> pairs(kdtree->getThreadCount());
+		auto start = std::chrono::steady_clock::now();
+		size_t pairCount = kdtree->findOverlappingTriangles(*other, [&pairs](unsigned int first, unsigned int second, unsigned int worker) {
+			pairs[worker].push_back(std::make_pair(first, second));
+		});
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << "findOverlappingTriangles" << std::right
+			<< std::setw(12) << static_cast<long long>(seconds * 1000) << " milliseconds  " << pairCount << " pairs of "
+			<< kdtree->getTriangleCount() << " x " << other->getTriangleCount() << " triangles" << std::endl;
+
+		std::vector<std::pair<unsigned int, unsigned int>> found;
+		for (const auto& workerPairs : pairs)
+			found.insert(found.end(), workerPairs.begin(), workerPairs.end());
+		std::sort(found.begin(), found.end());
+		size_t duplicates = found.size() - (std::unique(found.begin(), found.end()) - found.begin());
+
+		// Brute force on the first triangles, all of the other mesh each.
+		size_t bruteCount = std::min(kdtree->getTriangleCount(), std::max<size_t>(1, 100000000 / std::max<size_t>(1, other->getTriangleCount())));
+		size_t mismatches = 0;
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < bruteCount; i++) {
+			const KdStructs::Triangle* triangle = kdtree->getTriangle(i);
+			for (size_t j = 0; j < other->getTriangleCount(); j++) {
+				bool expected = KdTree::trianglesOverlap(*triangle, *other->getTriangle(j));
+				bool reported = std::binary_search(found.begin(), found.end(), std::make_pair(triangle->id, other->getTriangle(j)->id));
+				if (expected != reported)
+					mismatches++;
+			}
+		}
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << "Brute force" << std::right
+			<< std::setw(12) << static_cast<long long>(bruteCount / seconds) << " triangles/s  "
+			<< mismatches << " pairs of " << bruteCount << " triangles differ, " << duplicates << " duplicates" << std::endl;
+		delete other;
+	}
+
+	void hausdorff(KdTree* kdtree)
+	{
+		std::cout << "\n[*] Benchmark: Hausdorff distance" << std::endl;
+
+		// Candidate mesh: every vertex moved randomly by up to a thousandth of the mesh size, plus a smooth bump of a fiftieth of the size around one vertex.
+		KdStructs::Vector meshMin(0, 0, 0);
+		KdStructs::Vector meshMax(0, 0, 0);
+		getMeshBounds(kdtree, meshMin, meshMax);
+		float size = std::sqrt((meshMax - meshMin).dot(meshMax - meshMin));
+		KdStructs::Vector bump = kdtree->getPoint(kdtree->getPointCount() / 3)->pos;
+		KdTree* other = createTransformedMesh(kdtree, [size, bump](const KdStructs::Vector& position, unsigned int vertex) {
+			std::minstd_rand random(vertex + 1);
+			std::uniform_real_distribution<float> distribution(-1, 1);
+			float height = std::max(0.0f, 1 - std::sqrt((position - bump).dot(position - bump)) / (size / 10));
+			return position + KdStructs::Vector(distribution(random), distribution(random), distribution(random)) * (size / 1000) + KdStructs::Vector(0, 1, 0) * (height * size / 50);
+		});
+		if (other == nullptr)
+			return;
+
+		float tolerance = size / 10000;
+		std::cout << "Tolerance " << tolerance << std::endl;
+		KdStructs::HausdorffDistance results[3];
+		const char* names[3] = { "hausdorffDistance (mesh -> copy)", "hausdorffDistance (copy -> mesh)", "symmetricHausdorffDistance" };
+		for (int i = 0; i < 3; i++) {
+			auto start = std::chrono::steady_clock::now();
+			if (i == 0)
+				results[i] = kdtree->hausdorffDistance(*other, tolerance);
+			else if (i == 1)
+				results[i] = other->hausdorffDistance(*kdtree, tolerance);
+			else
+				results[i] = kdtree->symmetricHausdorffDistance(*other, tolerance);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::cout << std::left << std::setw(36) << names[i] << std::right
+				<< std::setw(8) << static_cast<long long>(seconds * 1000) << " milliseconds  "
+				<< results[i].distance << " (upper bound " << results[i].upperBound << ")" << std::endl;
+		}
+
+		// Only samples: the distance from every vertex, which can miss the maximum inside triangles.
+		std::vector<KdStructs::Vector> vertices;
+		vertices.reserve(kdtree->getTriangleCount() * 3);
+		for (size_t i = 0; i < kdtree->getTriangleCount(); i++) {
+			const KdStructs::Triangle* triangle = kdtree->getTriangle(i);
+			vertices.insert(vertices.end(), { triangle->a, triangle->b, triangle->c });
+		}
+		std::vector<KdStructs::SurfacePoint> closest(vertices.size());
+		KdStructs::BatchStatistics statistics = other->closestPointOnMeshBatch(vertices.data(), vertices.size(), std::numeric_limits<float>::infinity(), closest.data());
+		float vertexMaximum = 0;
+		for (const KdStructs::SurfacePoint& point : closest)
+			vertexMaximum = std::max(vertexMaximum, point.distance);
+		std::cout << std::left << std::setw(36) << "closestPointOnMeshBatch (vertices)" << std::right
+			<< std::setw(8) << static_cast<long long>(statistics.seconds * 1000) << " milliseconds  " << vertexMaximum << std::endl;
+
+		// Brute force: the reported point must have the reported distance, and samples of the first triangles must stay below the upper bound.
+		float closestPoint[3];
+		float resultDistance = std::numeric_limits<float>::infinity();
+		for (size_t j = 0; j < other->getTriangleCount(); j++)
+			resultDistance = std::min(resultDistance, KdTree::closestPointOnTriangle(*other->getTriangle(j), results[0].from.values, closestPoint));
+		size_t bruteCount = std::min(kdtree->getTriangleCount(), std::max<size_t>(1, 10000000 / std::max<size_t>(1, other->getTriangleCount())));
+		float sampleMaximum = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < bruteCount; i++) {
+			const KdStructs::Triangle* triangle = kdtree->getTriangle(i);
+			for (int u = 0; u <= 4; u++)
+				for (int v = 0; u + v <= 4; v++) {
+					KdStructs::Vector sample = triangle->a + (triangle->b - triangle->a) * (u / 4.0f) + (triangle->c - triangle->a) * (v / 4.0f);
+					float distance = std::numeric_limits<float>::infinity();
+					for (size_t j = 0; j < other->getTriangleCount(); j++)
+						distance = std::min(distance, KdTree::closestPointOnTriangle(*other->getTriangle(j), sample.values, closestPoint));
+					sampleMaximum = std::max(sampleMaximum, std::sqrt(distance));
+				}
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(36) << "Brute force" << std::right
+			<< std::setw(8) << static_cast<long long>(seconds * 1000) << " milliseconds  "
+			<< "reported point at " << std::sqrt(resultDistance) << ", samples of " << bruteCount << " triangles up to " << sampleMaximum
+			<< (sampleMaximum <= results[0].upperBound ? " (within upper bound)" : " (above upper bound)") << std::endl;
+		delete other;
+	}
+
+	void pointInMesh(const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: point in mesh" << std::endl;
+
+		// Closed torus (radii 1 and 0.4), 512 x 256 quads, and as many random points in its bounds as there are rays.
+		const float RADIUS = 1;
+		const float TUBE = 0.4f;
+		KdTree* torus = createTorus(512, 256, RADIUS, TUBE);
+
+		std::mt19937 random(42);
+		std::uniform_real_distribution<float> distribution(-1, 1);
+		std::vector<KdStructs::Vector> points;
+		points.reserve(rays.size());
+		for (size_t i = 0; i < rays.size(); i++)
+			points.push_back(KdStructs::Vector(distribution(random) * (RADIUS + TUBE), distribution(random) * (RADIUS + TUBE), distribution(random) * TUBE));
+		// Points closer to the surface than the tessellation error are left out of the comparison with the exact torus.
+		auto getSurfaceDistance = [RADIUS, TUBE](const KdStructs::Vector& point) {
+			float ring = std::sqrt(point[0] * point[0] + point[1] * point[1]) - RADIUS;
+			return std::sqrt(ring * ring + point[2] * point[2]) - TUBE;
+		};
+
+		// How it is done without containsBatch: raycast again from every hit until the ray leaves the mesh, odd hit counts are inside.
+		KdStructs::Vector direction = normalize(KdStructs::Vector(0.8017f, 0.4527f, 0.3905f));
+		std::vector<bool> recast(points.size());
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < points.size(); i++) {
+			KdStructs::Ray ray(points[i], direction, std::numeric_limits<float>::infinity());
+			unsigned int hitCount = 0;
+			for (KdStructs::Hit hit = torus->raycast(ray); hit.valid; hit = torus->raycast(ray)) {
+				hitCount++;
+				ray.origin = hit.getPosition(ray) + direction * 0.00001f;
+			}
+			recast[i] = hitCount % 2 == 1;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		size_t wrong = 0;
+		for (size_t i = 0; i < points.size(); i++)
+			if (std::fabs(getSurfaceDistance(points[i])) > 0.001f && recast[i] != (getSurfaceDistance(points[i]) < 0))
+				wrong++;
+		std::cout << std::left << std::setw(32) << "raycast until leaving" << std::right
+			<< std::setw(12) << static_cast<long long>(points.size() / seconds) << " points/s  " << wrong << " wrong" << std::endl;
+
+		bool* inside = new bool[points.size()];
+		for (unsigned int directions : { 1u, 3u })
+			for (unsigned int groupSize : { 1u, 8u, 32u })
+			{
+				KdStructs::ContainmentOptions containment;
+				containment.directions = directions;
+				containment.groupSize = groupSize;
+				KdStructs::BatchStatistics statistics = torus->containsBatch(points.data(), points.size(), inside, KdStructs::BatchOptions(), containment);
+				wrong = 0;
+				for (size_t i = 0; i < points.size(); i++)
+					if (std::fabs(getSurfaceDistance(points[i])) > 0.001f && inside[i] != (getSurfaceDistance(points[i]) < 0))
+						wrong++;
+				std::string name = "containsBatch (" + std::to_string(directions) + " x " + std::to_string(groupSize) + ")";
+				std::cout << std::left << std::setw(32) << name << std::right
+					<< std::setw(12) << static_cast<long long>(statistics.raysPerSecond()) << " points/s  "
+					<< wrong << " wrong, " << statistics.hitCount << " of " << points.size() << " inside" << std::endl;
+			}
+		delete[] inside;
+		delete torus;
+	}
+
+	void signedDistanceField(const std::vector<KdStructs::Ray>& rays)
+	{
+		std::cout << "\n[*] Benchmark: signed distance field" << std::endl;
+
+		const float RADIUS = 1;
+		const float TUBE = 0.4f;
+		KdTree* torus = createTorus(512, 256, RADIUS, TUBE);
+		auto getSurfaceDistance = [RADIUS, TUBE](const KdStructs::Vector& point) {
+			float ring = std::sqrt(point[0] * point[0] + point[1] * point[1]) - RADIUS;
+			return std::sqrt(ring * ring + point[2] * point[2]) - TUBE;
+		};
+
+		// About as many voxels as there are rays, over the torus' bounds plus a margin.
+		KdStructs::SdfGrid grid;
+		unsigned int resolution = std::max(16u, std::min(512u, static_cast<unsigned int>(std::cbrt(static_cast<double>(rays.size()) * 3.0 / 1.2))));
+		grid.voxelSize = 3.0f / (resolution - 1);
+		grid.origin = KdStructs::Vector(-1.5f, -1.5f, -0.6f);
+		grid.resolution[0] = resolution;
+		grid.resolution[1] = resolution;
+		grid.resolution[2] = static_cast<unsigned int>(std::ceil(1.2f / grid.voxelSize)) + 1;
+		size_t voxelCount = grid.getVoxelCount();
+		std::cout << grid.resolution[0] << " x " << grid.resolution[1] << " x " << grid.resolution[2] << " voxels of " << grid.voxelSize << std::endl;
+
+		std::vector<KdStructs::Vector> voxels = getVoxelPositions(grid);
+
+		// Per voxel: closest point without a distance limit and a containment query.
+		std::vector<KdStructs::SurfacePoint> closest(voxelCount);
+		bool* inside = new bool[voxelCount];
+		std::vector<float> reference(voxelCount);
+		auto start = std::chrono::steady_clock::now();
+		torus->closestPointOnMeshBatch(voxels.data(), voxelCount, std::numeric_limits<float>::infinity(), closest.data());
+		torus->containsBatch(voxels.data(), voxelCount, inside);
+		for (size_t i = 0; i < voxelCount; i++)
+			reference[i] = inside[i] ? -closest[i].distance : closest[i].distance;
+		printFieldErrors("closest point + contains", grid, voxels, reference.data(), std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), getSurfaceDistance);
+		delete[] inside;
+
+		// Brute force over every triangle, on as many voxels as fit in about 200 million triangle tests.
+		size_t bruteCount = std::min(voxelCount, std::max<size_t>(1, 200000000 / torus->getTriangleCount()));
+		size_t mismatches = 0;
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < bruteCount; i++) {
+			size_t voxel = i * (voxelCount / bruteCount);
+			float position[3] = { voxels[voxel][0], voxels[voxel][1], voxels[voxel][2] };
+			float closestPosition[3];
+			float best = std::numeric_limits<float>::infinity();
+			for (unsigned int j = 0; j < torus->getTriangleCount(); j++)
+				best = std::min(best, KdTree::closestPointOnTriangle(*torus->getTriangle(j), position, closestPosition));
+			if (std::fabs(std::sqrt(best) - closest[voxel].distance) > 0.00001f)
+				mismatches++;
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(32) << "brute force, unsigned" << std::right
+			<< std::setw(12) << static_cast<long long>(bruteCount / seconds) << " voxels/s  " << mismatches << " of " << bruteCount << " differ from closest point" << std::endl;
+
+		std::vector<float> distances(voxelCount);
+		for (unsigned int directions : { 1u, 3u })
+		{
+			grid.signDirections = directions;
+			KdStructs::BatchStatistics statistics = torus->bakeSignedDistanceField(grid, distances.data());
+			printFieldErrors("bakeSignedDistanceField (" + std::to_string(directions) + ")", grid, voxels, distances.data(), statistics.seconds, getSurfaceDistance);
+		}
+		delete torus;
+
+		// Axis aligned box on a grid whose voxel rows run along its faces and edges.
+		const float HALF_SIZE = 0.5f;
+		KdTree* box = createBox(8, HALF_SIZE);
+		KdStructs::SdfGrid boxGrid;
+		boxGrid.voxelSize = HALF_SIZE / 16;
+		boxGrid.origin = KdStructs::Vector(-2 * HALF_SIZE, -2 * HALF_SIZE, -2 * HALF_SIZE);
+		for (int axis = 0; axis < 3; axis++)
+			boxGrid.resolution[axis] = 65;
+		std::cout << "Box of " << box->getTriangleCount() << " triangles, 65 x 65 x 65 voxels of " << boxGrid.voxelSize << std::endl;
+		auto getBoxDistance = [HALF_SIZE](const KdStructs::Vector& point) {
+			float outside = 0, inside = -std::numeric_limits<float>::infinity();
+			for (int axis = 0; axis < 3; axis++) {
+				float offset = std::fabs(point[axis]) - HALF_SIZE;
+				outside += std::max(offset, 0.0f) * std::max(offset, 0.0f);
+				inside = std::max(inside, offset);
+			}
+			return std::sqrt(outside) + std::min(inside, 0.0f);
+		};
+		voxels = getVoxelPositions(boxGrid);
+		distances.resize(boxGrid.getVoxelCount());
+		for (unsigned int directions : { 1u, 3u })
+		{
+			boxGrid.signDirections = directions;
+			KdStructs::BatchStatistics statistics = box->bakeSignedDistanceField(boxGrid, distances.data());
+			printFieldErrors("box (" + std::to_string(directions) + ")", boxGrid, voxels, distances.data(), statistics.seconds, getBoxDistance);
+		}
+		delete box;
+	}
+}
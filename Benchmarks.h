@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include "KdTree.h"
+
+/// <summary>
+/// Benchmarks selectable with --benchmark.
+/// </summary>
+namespace Benchmarks {
+
+	// Returns false if there is no benchmark with that name.
+	// normals and uvs are the loaded file's per-vertex data (3 and 2 floats per vertex), empty without a file.
+	bool run(const std::string& name, KdTree* kdtree, const std::vector<KdStructs::Ray>& rays, const std::vector<float>& normals, const std::vector<float>& uvs);
+
+	// Batch throughput with and without sorting the rays (and with and without packets).
+	void raySorting(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays);
+
+	// Closest hit vs. any hit (occlusion) for the same rays.
+	void occlusion(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays);
+
+	// Stack-based vs. stackless (rope) traversal.
+	void stackless(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays);
+
+	// raycastAll with several hit limits and tMin values, checked against testing every triangle (sorted order, truncation, no duplicates).
+	void multiHit(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays);
+
+	// Triangles tested per second by the SIMD kernel for each instruction set, and raycasts with and without it.
+	void triangleKernel(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays);
+
+	// Moller-Trumbore vs. watertight intersection: throughput, and rays aimed at triangle edges that slip through.
+	void watertight(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays);
+
+	// Moller-Trumbore vs. precomputed projection records: throughput and memory.
+	void projection(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays);
+
+	// raycastBatch with and without vertex attributes. Rays aimed at vertices are checked against the file's normals and texture coordinates there.
+	void vertexAttributes(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays, const std::vector<float>& normals, const std::vector<float>& uvs);
+
+	// Nearest vertex queries vs. brute force, on the mesh (queries next to its vertices) and on as many random points as there are rays.
+	void nearestPoint(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays);
+
+	// knnBatch with k = 16 on as many random points and queries as there are rays, checked against brute force.
+	void knn(const std::vector<KdStructs::Ray>& rays);
+
+	// radiusCount and radiusSearch on as many random points and queries as there are rays, with about 32 and 1024 points per sphere, checked against brute force.
+	void radius(const std::vector<KdStructs::Ray>& rays);
+
+	// queryBox and queryBoxBatch with as many boxes as there are rays, of 2% to 10% of the mesh's size, vs. brute force.
+	void boxQuery(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays);
+
+	// closestPointOnMesh and its batch version on as many points around the mesh as there are rays, vs. testing every triangle.
+	void closestPoint(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays);
+
+	// queryPolytope with as many random camera frustums around the mesh as there are rays, vs. testing every triangle.
+	void frustum(KdTree* kdtree, const std::vector<KdStructs::Ray>& rays);
+
+	// Recall and speed of approximate knnBatch (k = 16) for several epsilons and visit limits, vs. the exact search.
+	void approximateKnn(const std::vector<KdStructs::Ray>& rays);
+
+	// buildKnnGraph (k = 16) on as many random points as there are rays, vs. one knnBatch query per point.
+	void knnGraph(const std::vector<KdStructs::Ray>& rays);
+
+	// epsilonJoin of a random point cloud and a jittered copy of it, with as many points as there are rays, vs. brute force.
+	void epsilonJoin(const std::vector<KdStructs::Ray>& rays);
+
+	// findOverlappingTriangles of the mesh and a rotated, shifted copy of it, vs. brute force over the first triangles.
+	void triangleOverlap(KdTree* kdtree);
+
+	// hausdorffDistance between the mesh and a randomly deformed copy of it in both directions, vs. closest points of the vertices and brute force samples.
+	void hausdorff(KdTree* kdtree);
+
+	// containsBatch on a closed torus and as many random points as there are rays, with 1 and 3 directions and several group sizes,
+	// vs. raycasting again from every hit. Both are checked against the exact torus.
+	void pointInMesh(const std::vector<KdStructs::Ray>& rays);
+
+	// bakeSignedDistanceField of a closed torus on a grid with about as many voxels as there are rays, vs. a closest point and containment query per voxel
+	// and brute force on some voxels. All are checked against the exact torus. Then an axis aligned box whose faces and edges lie on voxel rows.
+	void signedDistanceField(const std::vector<KdStructs::Ray>& rays);
+}
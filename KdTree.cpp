@@ -6,6 +6,9 @@
 #include <fstream>
 #include <limits>
 #include <cmath>
+#include <chrono>
+
+#include "Morton.h"
 
 
 KdTree::KdTree(float* vertices, unsigned int vertexCount, unsigned int* indices, unsigned int indexCount) :
@@ -30,7 +33,21 @@ KdTree::KdTree(std::vector<KdStructs::Point*> points)
 		min[axis] = minPoint->pos[axis];
 	}
 
+	// Give every point and triangle an id (triangles are shared between points).
+	for (KdStructs::Point* point : points) {
+		point->id = this->points.size();
+		this->points.push_back(point);
+		for (KdStructs::Triangle* triangle : point->triangles) {
+			if (triangle->id != KdStructs::NO_ID)
+				continue;
+			triangle->id = triangles.size();
+			triangles.push_back(triangle);
+		}
+	}
+	mailbox.resize(triangles.size());
+
 	root = createKdTree(points, 0, max, min);
+	computeTriangleBounds(root);
 }
 
 KdTree::~KdTree()
@@ -40,14 +57,717 @@ KdTree::~KdTree()
 	triangles.clear();
 
 	delete root;
+	delete threadPool;
 }
 
 void KdTree::raycast(KdStructs::Ray ray, KdStructs::RayHit*& hit)
 {
-	checkCache++;
-	if (checkCache == std::numeric_limits<unsigned int>::max())
-		checkCache = 0;
-	findIntersection(root, ray, hit);
+	storeRayHit(ray, raycast(ray), hit);
+}
+
+KdStructs::Hit KdTree::raycast(const KdStructs::Ray& ray)
+{
+	KdStructs::Hit hit;
+	traceRay(ray, hit, mailbox);
+	return hit;
+}
+
+KdStructs::Hit KdTree::raycast(const KdStructs::Ray& ray, KdStructs::HitAttributes& attributes)
+{
+	KdStructs::Hit hit = raycast(ray);
+	interpolateAttributes(hit, attributes);
+	return hit;
+}
+
+void KdTree::interpolateAttributes(const KdStructs::Hit& hit, KdStructs::HitAttributes& attributes) const
+{
+	attributes = KdStructs::HitAttributes();
+	if (!hit.valid || vertexAttributes.empty())
+		return;
+
+	const KdStructs::Triangle* triangle = triangles[hit.triangle];
+	for (unsigned int vertex : triangle->vertices)
+		if (vertex >= vertexAttributes.size())
+			return;
+
+	const KdStructs::VertexAttributes& a = vertexAttributes[triangle->vertices[0]];
+	const KdStructs::VertexAttributes& b = vertexAttributes[triangle->vertices[1]];
+	const KdStructs::VertexAttributes& c = vertexAttributes[triangle->vertices[2]];
+	float weightA = 1 - hit.u - hit.v;
+
+	float length = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++) {
+		attributes.normal[axis] = a.normal[axis] * weightA + b.normal[axis] * hit.u + c.normal[axis] * hit.v;
+		length += attributes.normal[axis] * attributes.normal[axis];
+	}
+	if (length > 0) {
+		length = std::sqrt(length);
+		for (float& component : attributes.normal)
+			component /= length;
+		attributes.validNormal = true;
+	}
+	for (int i = 0; i < 2; i++)
+		attributes.uv[i] = a.uv[i] * weightA + b.uv[i] * hit.u + c.uv[i] * hit.v;
+
+	attributes.valid = true;
+}
+
+void KdTree::setVertexAttributes(const float* normals, const float* uvs, unsigned int vertexCount)
+{
+	vertexAttributes.assign(vertexCount, KdStructs::VertexAttributes());
+	for (unsigned int i = 0; i < vertexCount; i++) {
+		KdStructs::VertexAttributes& attributes = vertexAttributes[i];
+		for (int axis = 0; axis < DIMENSIONS; axis++)
+			attributes.normal[axis] = normals != nullptr ? normals[i * 3 + axis] : 0;
+		for (int j = 0; j < 2; j++)
+			attributes.uv[j] = uvs != nullptr ? uvs[i * 2 + j] : 0;
+	}
+}
+
+KdStructs::BatchStatistics KdTree::raycastBatch(const KdStructs::Ray* rays, size_t count, KdStructs::RayHit** hits, const KdStructs::BatchOptions& options)
+{
+	if (options.sortRays) {
+		auto start = std::chrono::steady_clock::now();
+
+		std::vector<unsigned int> order = getRayOrder(rays, count);
+		std::vector<KdStructs::Ray> sortedRays;
+		sortedRays.reserve(count);
+		for (unsigned int index : order)
+			sortedRays.push_back(rays[index]);
+
+		KdStructs::BatchOptions sortedOptions = options;
+		sortedOptions.sortRays = false;
+		std::vector<KdStructs::RayHit*> sortedHits(count, nullptr);
+		KdStructs::BatchStatistics statistics = raycastBatch(sortedRays.data(), count, sortedHits.data(), sortedOptions);
+
+		// Scatter hits back to the caller's order.
+		for (size_t i = 0; i < count; i++)
+			hits[order[i]] = sortedHits[i];
+
+		auto end = std::chrono::steady_clock::now();
+		statistics.seconds = std::chrono::duration<double>(end - start).count();
+		return statistics;
+	}
+
+	ThreadPool* pool = getThreadPool();
+	std::atomic<size_t> hitCount(0);
+	if (options.stackless && ropeCells.empty())
+		buildRopes();
+
+	auto start = std::chrono::steady_clock::now();
+	pool->parallelFor(count, options.chunkSize, [this, rays, hits, &options, &hitCount](size_t begin, size_t end, unsigned int worker) {
+		KdStructs::Mailbox& workerMailbox = workerMailboxes[worker];
+		size_t chunkHits = 0;
+		auto store = [this, rays, hits, &options, &chunkHits](size_t i, const KdStructs::Hit& hit) {
+			hits[i] = nullptr;
+			storeRayHit(rays[i], hit, hits[i]);
+			if (!hit.valid)
+				return;
+			if (options.attributes)
+				interpolateAttributes(hit, hits[i]->attributes);
+			chunkHits++;
+		};
+		size_t i = begin;
+		if (options.stackless) {
+			for (; i < end; i++) {
+				KdStructs::Hit hit;
+				traceRayStackless(rays[i], hit, workerMailbox);
+				store(i, hit);
+			}
+		}
+		else if (options.packets && !options.attributes && intersectionMode == KdStructs::IntersectionMode::MOLLER_TRUMBORE) {
+			for (; i + KdStructs::PACKET_SIZE <= end; i += KdStructs::PACKET_SIZE)
+				chunkHits += raycastPacket(rays + i, hits + i, workerMailbox);
+		}
+		for (; i < end; i++) {
+			KdStructs::Hit hit;
+			traceRay(rays[i], hit, workerMailbox);
+			store(i, hit);
+		}
+		hitCount += chunkHits;
+	});
+	auto end = std::chrono::steady_clock::now();
+
+	return KdStructs::BatchStatistics(count, hitCount, std::chrono::duration<double>(end - start).count());
+}
+
+bool KdTree::occluded(const KdStructs::Ray& ray, float maxDistance)
+{
+	return traceOcclusion(ray, maxDistance, mailbox);
+}
+
+KdStructs::BatchStatistics KdTree::occludedBatch(const KdStructs::Ray* rays, size_t count, uint64_t* occludedMask, const KdStructs::BatchOptions& options)
+{
+	ThreadPool* pool = getThreadPool();
+	std::atomic<size_t> hitCount(0);
+
+	// Work is split by mask words, so no two threads write to the same word.
+	size_t wordCount = (count + 63) / 64;
+	size_t wordsPerChunk = (options.chunkSize + 63) / 64;
+
+	auto start = std::chrono::steady_clock::now();
+	pool->parallelFor(wordCount, wordsPerChunk, [this, rays, count, occludedMask, &hitCount](size_t begin, size_t end, unsigned int worker) {
+		KdStructs::Mailbox& workerMailbox = workerMailboxes[worker];
+		size_t chunkHits = 0;
+		for (size_t word = begin; word < end; word++) {
+			uint64_t bits = 0;
+			size_t last = std::min(count, (word + 1) * 64);
+			for (size_t i = word * 64; i < last; i++) {
+				if (traceOcclusion(rays[i], rays[i].distance, workerMailbox)) {
+					bits |= 1ull << (i % 64);
+					chunkHits++;
+				}
+			}
+			occludedMask[word] = bits;
+		}
+		hitCount += chunkHits;
+	});
+	auto end = std::chrono::steady_clock::now();
+
+	return KdStructs::BatchStatistics(count, hitCount, std::chrono::duration<double>(end - start).count());
+}
+
+KdStructs::Neighbour KdTree::nearestPoint(const KdStructs::Vector& query, float maxDistance)
+{
+	KdStructs::Neighbour nearest;
+	// Squared, only points closer than this are accepted.
+	float nearestDistance = maxDistance * maxDistance;
+	float position[DIMENSIONS] = { query[0], query[1], query[2] };
+	float offsets[DIMENSIONS] = { 0, 0, 0 };
+	findNearestPoint(root, position, offsets, 0, nearest, nearestDistance);
+
+	if (nearest.point != nullptr)
+		nearest.distance = std::sqrt(nearestDistance);
+	return nearest;
+}
+
+KdStructs::BatchStatistics KdTree::knnBatch(const KdStructs::Vector* queries, size_t count, unsigned int k, unsigned int* ids, float* distances,
+	const KdStructs::BatchOptions& options, const KdStructs::Approximation& approximation)
+{
+	if (k == 0 || k > KdStructs::MAX_NEIGHBOURS) {
+		std::fill(ids, ids + count * k, KdStructs::NO_ID);
+		std::fill(distances, distances + count * k, std::numeric_limits<float>::infinity());
+		return KdStructs::BatchStatistics(count, 0, 0);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<unsigned int> order = getPointOrder(queries, count);
+	std::atomic<size_t> foundCount(0);
+
+	getThreadPool()->parallelFor(count, options.chunkSize, [this, queries, k, ids, distances, &approximation, &order, &foundCount](size_t begin, size_t end, unsigned int) {
+		size_t chunkFound = 0;
+		for (size_t i = begin; i < end; i++)
+		{
+			unsigned int index = order[i];
+			if (searchNearestPoints(queries[index], k, ids + static_cast<size_t>(index) * k, distances + static_cast<size_t>(index) * k, approximation) == k)
+				chunkFound++;
+		}
+		foundCount += chunkFound;
+	});
+
+	auto end = std::chrono::steady_clock::now();
+	return KdStructs::BatchStatistics(count, foundCount, std::chrono::duration<double>(end - start).count());
+}
+
+KdStructs::SurfacePoint KdTree::closestPointOnMesh(const KdStructs::Vector& query, float maxDistance)
+{
+	KdStructs::SurfacePoint best;
+	float bestDistance = maxDistance * maxDistance;
+	float position[DIMENSIONS] = { query[0], query[1], query[2] };
+	mailbox.next();
+	if (root != nullptr)
+		findClosestPoint(root, position, getTriangleBoundsDistance(root, position), best, bestDistance, mailbox);
+
+	if (best.valid)
+		best.distance = std::sqrt(bestDistance);
+	return best;
+}
+
+KdStructs::BatchStatistics KdTree::closestPointOnMeshBatch(const KdStructs::Vector* queries, size_t count, float maxDistance, KdStructs::SurfacePoint* results, const KdStructs::BatchOptions& options)
+{
+	ThreadPool* pool = getThreadPool();
+	auto start = std::chrono::steady_clock::now();
+	std::vector<unsigned int> order = getPointOrder(queries, count);
+	std::atomic<size_t> foundCount(0);
+
+	pool->parallelFor(count, options.chunkSize, [this, queries, maxDistance, results, &order, &foundCount](size_t begin, size_t end, unsigned int worker) {
+		KdStructs::Mailbox& workerMailbox = workerMailboxes[worker];
+		size_t chunkFound = 0;
+		for (size_t i = begin; i < end; i++)
+		{
+			unsigned int index = order[i];
+			float query[DIMENSIONS] = { queries[index][0], queries[index][1], queries[index][2] };
+			KdStructs::SurfacePoint best;
+			float bestDistance = maxDistance * maxDistance;
+			workerMailbox.next();
+			if (root != nullptr)
+				findClosestPoint(root, query, getTriangleBoundsDistance(root, query), best, bestDistance, workerMailbox);
+
+			if (best.valid) {
+				best.distance = std::sqrt(bestDistance);
+				chunkFound++;
+			}
+			results[index] = best;
+		}
+		foundCount += chunkFound;
+	});
+
+	auto end = std::chrono::steady_clock::now();
+	return KdStructs::BatchStatistics(count, foundCount, std::chrono::duration<double>(end - start).count());
+}
+
+KdStructs::HausdorffDistance KdTree::hausdorffDistance(KdTree& other, float tolerance)
+{
+	return computeHausdorffDistance(other, tolerance, 0);
+}
+
+KdStructs::HausdorffDistance KdTree::symmetricHausdorffDistance(KdTree& other, float tolerance)
+{
+	// The second direction only has to show whether it exceeds the first one.
+	KdStructs::HausdorffDistance forward = computeHausdorffDistance(other, tolerance, 0);
+	KdStructs::HausdorffDistance backward = other.computeHausdorffDistance(*this, tolerance, forward.distance);
+	KdStructs::HausdorffDistance& larger = backward.distance > forward.distance ? backward : forward;
+	larger.upperBound = std::max(forward.upperBound, backward.upperBound);
+	return larger;
+}
+
+KdStructs::BatchStatistics KdTree::buildKnnGraph(unsigned int k, KdStructs::NeighbourGraph& graph)
+{
+	size_t pointCount = points.size();
+	k = std::min<unsigned int>(k, pointCount > 0 ? static_cast<unsigned int>(pointCount - 1) : 0);
+	graph.offsets.resize(pointCount + 1);
+	for (size_t i = 0; i <= pointCount; i++)
+		graph.offsets[i] = i * k;
+	graph.neighbours.assign(pointCount * k, KdStructs::NO_ID);
+	graph.distances.assign(pointCount * k, std::numeric_limits<float>::infinity());
+	if (k == 0 || k > KdStructs::MAX_NEIGHBOURS || root == nullptr)
+		return KdStructs::BatchStatistics(pointCount, 0, 0);
+
+	ThreadPool* pool = getThreadPool();
+	auto start = std::chrono::steady_clock::now();
+
+	KnnGraphState state;
+	state.k = k;
+	state.ids = graph.neighbours.data();
+	state.distances = graph.distances.data();
+	state.nodes.reserve(pointCount);
+	flattenTree(root, state.nodes);
+	for (int axis = 0; axis < DIMENSIONS; axis++) {
+		state.positions[axis].resize(pointCount);
+		for (size_t i = 0; i < pointCount; i++)
+			state.positions[axis][i] = state.nodes[i].position[axis];
+	}
+	state.sizes.assign(pointCount, 0);
+	state.bounds.assign(pointCount, std::numeric_limits<float>::infinity());
+
+	// Query blocks: the buckets, and the single points of the nodes above them.
+	std::vector<unsigned int> blocks;
+	for (unsigned int node = 0; node < pointCount; node += state.nodes[node].pointCount <= KdStructs::GRAPH_BUCKET_SIZE ? state.nodes[node].pointCount : 1)
+		blocks.push_back(node);
+
+	pool->parallelFor(blocks.size(), 16, [this, &blocks, &state](size_t begin, size_t end, unsigned int) {
+		std::vector<unsigned int> stack;
+		for (size_t i = begin; i < end; i++)
+			findBucketNeighbours(blocks[i], stack, state);
+	});
+
+	// Heaps to sorted lists of distances.
+	pool->parallelFor(pointCount, 4096, [&state](size_t begin, size_t end, unsigned int) {
+		for (size_t i = begin; i < end; i++) {
+			unsigned int size = state.sizes[i];
+			KdStructs::NeighbourHeap heap(state.k, state.ids + i * state.k, state.distances + i * state.k, size);
+			heap.sort();
+			for (unsigned int j = 0; j < size; j++)
+				heap.distances[j] = std::sqrt(heap.distances[j]);
+		}
+	});
+
+	// From node order to point order, following each cycle of the permutation.
+	std::vector<bool> placed(pointCount, false);
+	std::vector<unsigned int> carriedIds(k);
+	std::vector<float> carriedDistances(k);
+	for (size_t start = 0; start < pointCount; start++)
+	{
+		if (placed[start])
+			continue;
+		std::copy(state.ids + start * k, state.ids + (start + 1) * k, carriedIds.begin());
+		std::copy(state.distances + start * k, state.distances + (start + 1) * k, carriedDistances.begin());
+		placed[start] = true;
+		for (size_t target = state.nodes[start].id; target != start; target = state.nodes[target].id) {
+			std::swap_ranges(carriedIds.begin(), carriedIds.end(), state.ids + target * k);
+			std::swap_ranges(carriedDistances.begin(), carriedDistances.end(), state.distances + target * k);
+			placed[target] = true;
+		}
+		std::copy(carriedIds.begin(), carriedIds.end(), state.ids + start * k);
+		std::copy(carriedDistances.begin(), carriedDistances.end(), state.distances + start * k);
+	}
+
+	size_t completeCount = std::count(state.sizes.begin(), state.sizes.end(), k);
+	auto end = std::chrono::steady_clock::now();
+	return KdStructs::BatchStatistics(pointCount, completeCount, std::chrono::duration<double>(end - start).count());
+}
+
+size_t KdTree::epsilonJoin(const KdTree& other, float epsilon, const JoinCallback& callback)
+{
+	if (root == nullptr || other.root == nullptr || epsilon < 0)
+		return 0;
+
+	ThreadPool* pool = getThreadPool();
+	std::vector<FlatNode> firstNodes;
+	std::vector<FlatNode> secondNodes;
+	firstNodes.reserve(points.size());
+	secondNodes.reserve(other.points.size());
+	flattenTree(root, firstNodes);
+	flattenTree(other.root, secondNodes);
+
+	// Points of the nodes above the subtrees are joined one by one.
+	std::vector<unsigned int> subtrees;
+	std::vector<unsigned int> upperNodes;
+	splitForThreads(firstNodes, subtrees, upperNodes);
+
+	std::atomic<size_t> pairCount(0);
+	size_t taskCount = subtrees.size() + upperNodes.size();
+	pool->parallelFor(taskCount, 1, [this, &other, epsilon, &callback, &firstNodes, &secondNodes, &subtrees, &upperNodes, &pairCount](size_t begin, size_t end, unsigned int worker) {
+		JoinState state = { &firstNodes, &secondNodes, &other, epsilon * epsilon, &callback, worker, 0 };
+		for (size_t i = begin; i < end; i++) {
+			if (i < subtrees.size())
+				joinSubtrees(subtrees[i], 0, state);
+			else
+				joinPoint(upperNodes[i - subtrees.size()], 0, true, state);
+		}
+		pairCount += state.pairCount;
+	});
+	return pairCount;
+}
+
+size_t KdTree::findOverlappingTriangles(KdTree& other, const OverlapCallback& callback)
+{
+	if (root == nullptr || other.root == nullptr)
+		return 0;
+
+	ThreadPool* pool = getThreadPool();
+	if (ownedTriangleIds.empty())
+		buildOwnedTriangles();
+	if (other.ownedTriangleIds.empty())
+		other.buildOwnedTriangles();
+
+	// Owned triangles of the nodes above the subtrees are tested one by one.
+	std::vector<KdStructs::Node*> subtrees;
+	std::vector<KdStructs::Node*> upperNodes;
+	splitForThreads(root, subtrees, upperNodes);
+
+	std::atomic<size_t> pairCount(0);
+	size_t taskCount = subtrees.size() + upperNodes.size();
+	pool->parallelFor(taskCount, 1, [this, &other, &callback, &subtrees, &upperNodes, &pairCount](size_t begin, size_t end, unsigned int worker) {
+		OverlapState state = { &other, &callback, worker, 0 };
+		for (size_t i = begin; i < end; i++) {
+			if (i < subtrees.size())
+				overlapSubtrees(subtrees[i], other.root, state);
+			else
+				overlapOwnedTriangles(upperNodes[i - subtrees.size()], true, other.root, state);
+		}
+		pairCount += state.pairCount;
+	});
+	return pairCount;
+}
+
+unsigned int KdTree::knn(const KdStructs::Vector& query, unsigned int k, unsigned int* ids, float* distances, const KdStructs::Approximation& approximation)
+{
+	if (k == 0 || k > KdStructs::MAX_NEIGHBOURS) {
+		std::fill(ids, ids + k, KdStructs::NO_ID);
+		std::fill(distances, distances + k, std::numeric_limits<float>::infinity());
+		return 0;
+	}
+	return searchNearestPoints(query, k, ids, distances, approximation);
+}
+
+unsigned int KdTree::searchNearestPoints(const KdStructs::Vector& query, unsigned int k, unsigned int* ids, float* distances, const KdStructs::Approximation& approximation)
+{
+	float position[DIMENSIONS] = { query[0], query[1], query[2] };
+	float offsets[DIMENSIONS] = { 0, 0, 0 };
+	float pruneScale = (1 + approximation.epsilon) * (1 + approximation.epsilon);
+	unsigned int visitsLeft = approximation.maxVisits > 0 ? approximation.maxVisits : std::numeric_limits<unsigned int>::max();
+	KdStructs::NeighbourHeap heap(k);
+	findNearestPoints(root, position, offsets, 0, pruneScale, visitsLeft, heap);
+	heap.sort();
+
+	for (unsigned int j = 0; j < k; j++) {
+		ids[j] = j < heap.size ? heap.ids[j] : KdStructs::NO_ID;
+		distances[j] = j < heap.size ? std::sqrt(heap.distances[j]) : std::numeric_limits<float>::infinity();
+	}
+	return heap.size;
+}
+
+void KdTree::radiusSearch(const KdStructs::Vector& center, float radius, const std::function<void(const KdStructs::Point*, float)>& callback)
+{
+	float position[DIMENSIONS] = { center[0], center[1], center[2] };
+	findPointsInRadius(root, position, radius * radius, callback);
+}
+
+size_t KdTree::radiusCount(const KdStructs::Vector& center, float radius)
+{
+	float position[DIMENSIONS] = { center[0], center[1], center[2] };
+	return countPointsInRadius(root, position, radius * radius);
+}
+
+size_t KdTree::queryBox(const KdStructs::Vector& min, const KdStructs::Vector& max, std::vector<unsigned int>& triangleIds)
+{
+	triangleIds.clear();
+	mailbox.next();
+	findTrianglesInBox(root, min, max, triangleIds, mailbox);
+	return triangleIds.size();
+}
+
+KdStructs::BatchStatistics KdTree::queryBoxBatch(const KdStructs::Vector* mins, const KdStructs::Vector* maxs, size_t count, std::vector<unsigned int>* triangleIds, const KdStructs::BatchOptions& options)
+{
+	ThreadPool* pool = getThreadPool();
+	auto start = std::chrono::steady_clock::now();
+
+	// Neighbouring boxes visit the same nodes, so group them by their centers.
+	std::vector<KdStructs::Vector> centers;
+	centers.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		centers.push_back(KdStructs::Vector((mins[i][0] + maxs[i][0]) / 2, (mins[i][1] + maxs[i][1]) / 2, (mins[i][2] + maxs[i][2]) / 2));
+	std::vector<unsigned int> order = getPointOrder(centers.data(), count);
+	std::atomic<size_t> hitCount(0);
+
+	pool->parallelFor(count, options.chunkSize, [this, mins, maxs, triangleIds, &order, &hitCount](size_t begin, size_t end, unsigned int worker) {
+		KdStructs::Mailbox& workerMailbox = workerMailboxes[worker];
+		size_t chunkHits = 0;
+		for (size_t i = begin; i < end; i++)
+		{
+			unsigned int index = order[i];
+			triangleIds[index].clear();
+			workerMailbox.next();
+			findTrianglesInBox(root, mins[index], maxs[index], triangleIds[index], workerMailbox);
+			if (!triangleIds[index].empty())
+				chunkHits++;
+		}
+		hitCount += chunkHits;
+	});
+
+	auto end = std::chrono::steady_clock::now();
+	return KdStructs::BatchStatistics(count, hitCount, std::chrono::duration<double>(end - start).count());
+}
+
+size_t KdTree::queryPolytope(const KdStructs::Plane* planes, unsigned int planeCount, std::vector<unsigned int>& triangleIds)
+{
+	triangleIds.clear();
+	if (planeCount > KdStructs::MAX_PLANES)
+		return 0;
+
+	if (ownedTriangleIds.empty())
+		buildOwnedTriangles();
+	findTrianglesInPolytope(root, planes, (1u << planeCount) - 1, triangleIds);
+	return triangleIds.size();
+}
+
+size_t KdTree::raycastAll(const KdStructs::Ray& ray, float tMin, float tMax, KdStructs::Hit* hits, size_t maxHits)
+{
+	if (maxHits == 0)
+		return 0;
+
+	KdStructs::PreparedRay prepared(ray);
+	prepared.maxDistance = std::min(prepared.maxDistance, tMax);
+	float tNear, tFar;
+	if (!clipToBounds(prepared, tNear, tFar))
+		return 0;
+	tNear = std::max(tNear, tMin);
+	if (tNear > tFar)
+		return 0;
+
+	KdStructs::HitBuffer buffer(hits, maxHits);
+	mailbox.next();
+	findAllIntersections(root, ray, prepared, tMin, tNear, tFar, buffer, mailbox);
+	return buffer.count;
+}
+
+bool KdTree::contains(const KdStructs::Vector& point, unsigned int directions)
+{
+	std::vector<Crossing> crossings;
+	return isInside(point, directions, crossings, mailbox);
+}
+
+KdStructs::BatchStatistics KdTree::containsBatch(const KdStructs::Vector* points, size_t count, bool* inside, const KdStructs::BatchOptions& options, const KdStructs::ContainmentOptions& containment)
+{
+	ThreadPool* pool = getThreadPool();
+	auto start = std::chrono::steady_clock::now();
+	std::vector<unsigned int> order = getPointOrder(points, count);
+	std::vector<std::vector<Crossing>> workerCrossings(pool->getThreadCount());
+	std::atomic<size_t> insideCount(0);
+	unsigned int groupSize = std::max(1u, containment.groupSize);
+	unsigned int directions = std::min(std::max(containment.directions, 1u), KdStructs::MAX_CONTAINMENT_DIRECTIONS);
+
+	pool->parallelFor(count, options.chunkSize, [this, points, inside, directions, groupSize, &order, &workerCrossings, &insideCount](size_t begin, size_t end, unsigned int worker) {
+		KdStructs::Mailbox& workerMailbox = workerMailboxes[worker];
+		std::vector<Crossing>& crossings = workerCrossings[worker];
+		// Odd number of crossings on the segment between from and to.
+		auto crossesOddly = [this, &crossings, &workerMailbox](const KdStructs::Vector& from, const KdStructs::Vector& to) {
+			KdStructs::Vector offset = to - from;
+			float length = std::sqrt(offset.dot(offset));
+			return length > 0 && countCrossings(from, offset * (1 / length), length, crossings, workerMailbox) % 2 == 1;
+		};
+		KdStructs::Vector leader(0, 0, 0);
+		bool leaderParities[KdStructs::MAX_CONTAINMENT_DIRECTIONS];
+		size_t chunkInside = 0;
+		for (size_t i = begin; i < end; i++)
+		{
+			unsigned int index = order[i];
+			const KdStructs::Vector& point = points[index];
+			unsigned int votes = 0;
+			if ((i - begin) % groupSize == 0) {
+				leader = point;
+				for (unsigned int d = 0; d < directions; d++) {
+					leaderParities[d] = countCrossings(point, getContainmentDirection(d), std::numeric_limits<float>::infinity(), crossings, workerMailbox) % 2 == 1;
+					if (leaderParities[d])
+						votes++;
+				}
+			}
+			else if (directions == 1) {
+				// Every crossing between the group's first point and this one switches sides.
+				if (leaderParities[0] != crossesOddly(leader, point))
+					votes++;
+			}
+			else {
+				// Each direction's answer of the first point is carried along its own path, bent out along that direction,
+				// so a miscounted crossing on one path only costs one vote.
+				KdStructs::Vector offset = point - leader;
+				float length = std::sqrt(offset.dot(offset));
+				for (unsigned int d = 0; d < directions; d++) {
+					KdStructs::Vector corner = leader + offset * 0.5f + getContainmentDirection(d) * (0.5f * length);
+					if (leaderParities[d] != (crossesOddly(leader, corner) != crossesOddly(corner, point)))
+						votes++;
+				}
+			}
+			bool result = 2 * votes > directions;
+			inside[index] = result;
+			if (result)
+				chunkInside++;
+		}
+		insideCount += chunkInside;
+	});
+
+	auto end = std::chrono::steady_clock::now();
+	return KdStructs::BatchStatistics(count, insideCount, std::chrono::duration<double>(end - start).count());
+}
+
+KdStructs::BatchStatistics KdTree::bakeSignedDistanceField(const KdStructs::SdfGrid& grid, float* distances)
+{
+	ThreadPool* pool = getThreadPool();
+	auto start = std::chrono::steady_clock::now();
+	size_t voxelCount = grid.getVoxelCount();
+	if (voxelCount == 0)
+		return KdStructs::BatchStatistics(0, 0, 0);
+	if (triangles.empty() || !(grid.voxelSize > 0)) {
+		std::fill(distances, distances + voxelCount, std::numeric_limits<float>::infinity());
+		return KdStructs::BatchStatistics(voxelCount, 0, 0);
+	}
+
+	unsigned int tiles[DIMENSIONS];
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+		tiles[axis] = (grid.resolution[axis] + KdStructs::SDF_TILE_SIZE - 1) / KdStructs::SDF_TILE_SIZE;
+	size_t tileCount = static_cast<size_t>(tiles[0]) * tiles[1] * tiles[2];
+	auto bakeTiles = [this, pool, &grid, distances, &tiles, tileCount](float band) {
+		pool->parallelFor(tileCount, 1, [this, &grid, distances, &tiles, band](size_t begin, size_t end, unsigned int worker) {
+			for (size_t i = begin; i < end; i++) {
+				unsigned int tile[DIMENSIONS] = { static_cast<unsigned int>(i % tiles[0]), static_cast<unsigned int>(i / tiles[0] % tiles[1]), static_cast<unsigned int>(i / tiles[0] / tiles[1]) };
+				bakeDistanceTile(grid, tile, band, distances, workerMailboxes[worker]);
+			}
+		});
+	};
+	bakeTiles(grid.bandWidth * grid.voxelSize);
+
+	if (std::none_of(distances, distances + voxelCount, [](float distance) { return std::signbit(distance); })) {
+		// No voxel within the band (the surface is outside the grid or between voxels of a thin band): nothing to sweep from, so every voxel is queried exactly.
+		bakeTiles(std::numeric_limits<float>::infinity());
+	}
+	else {
+		// One sweep per direction is enough for voxels whose closest point can be reached on a straight line through the band.
+		for (unsigned int direction = 0; direction < 8; direction++)
+			sweepDistances(grid, direction, distances);
+	}
+
+	unsigned int directions = std::min(std::max(grid.signDirections, 1u), 3u);
+	std::vector<unsigned char> votes(voxelCount, 0);
+	for (unsigned int axis = 0; axis < directions; axis++)
+		voteInside(grid, axis, votes);
+
+	std::atomic<size_t> insideCount(0);
+	pool->parallelFor(voxelCount, 65536, [distances, directions, &votes, &insideCount](size_t begin, size_t end, unsigned int) {
+		size_t chunkInside = 0;
+		for (size_t i = begin; i < end; i++) {
+			bool inside = 2 * votes[i] > directions;
+			distances[i] = inside ? -std::abs(distances[i]) : std::abs(distances[i]);
+			if (inside)
+				chunkInside++;
+		}
+		insideCount += chunkInside;
+	});
+
+	auto end = std::chrono::steady_clock::now();
+	return KdStructs::BatchStatistics(voxelCount, insideCount, std::chrono::duration<double>(end - start).count());
+}
+
+void KdTree::raycastStackless(KdStructs::Ray ray, KdStructs::RayHit*& hit)
+{
+	if (ropeCells.empty())
+		buildRopes();
+	KdStructs::Hit result;
+	traceRayStackless(ray, result, mailbox);
+	storeRayHit(ray, result, hit);
+}
+
+/// <summary>
+/// 1. Copy the kd-tree's subdivision into cells. Missing children become empty leaves.
+/// 2. Link ropes: a leaf's rope points to the neighbour across that face,
+///    pushed down as far as the neighbour subtree allows.
+/// 3. Add every triangle to all leaves its bounds overlap (triangles reach out of their vertices' cells).
+/// </summary>
+void KdTree::buildRopes()
+{
+	ropeCells.clear();
+	ropeTriangles.clear();
+
+	float min[DIMENSIONS], max[DIMENSIONS];
+	for (int axis = 0; axis < DIMENSIONS; axis++) {
+		min[axis] = root->triangleMin[axis];
+		max[axis] = root->triangleMax[axis];
+	}
+	createRopeCell(root, min, max);
+
+	const unsigned int noRopes[6] = { KdStructs::NO_ID, KdStructs::NO_ID, KdStructs::NO_ID, KdStructs::NO_ID, KdStructs::NO_ID, KdStructs::NO_ID };
+	linkRopes(0, noRopes);
+
+	std::vector<std::vector<unsigned int>> leafTriangles(ropeCells.size());
+	for (KdStructs::Triangle* triangle : triangles) {
+		for (int axis = 0; axis < DIMENSIONS; axis++) {
+			min[axis] = std::min({ triangle->a[axis], triangle->b[axis], triangle->c[axis] });
+			max[axis] = std::max({ triangle->a[axis], triangle->b[axis], triangle->c[axis] });
+		}
+		addRopeTriangle(0, triangle, min, max, leafTriangles);
+	}
+
+	for (size_t i = 0; i < ropeCells.size(); i++) {
+		ropeCells[i].triangleBegin = ropeTriangles.size();
+		ropeCells[i].triangleCount = leafTriangles[i].size();
+		ropeTriangles.insert(ropeTriangles.end(), leafTriangles[i].begin(), leafTriangles[i].end());
+	}
+}
+
+size_t KdTree::getRopeMemory() const
+{
+	return ropeCells.size() * sizeof(KdStructs::RopeCell) + ropeTriangles.size() * sizeof(unsigned int);
+}
+
+void KdTree::setThreadCount(unsigned int threadCount)
+{
+	if (this->threadCount == threadCount)
+		return;
+
+	this->threadCount = threadCount;
+	// Recreated with the new size on the next batch.
+	delete threadPool;
+	threadPool = nullptr;
 }
 
 std::vector<KdStructs::Node*> KdTree::getNodes()
@@ -121,6 +841,17 @@ void KdTree::printStatistics()
 	std::cout << "Max number of triangles per point: " << maxNumberTrianglesPerPoint << std::endl;
 }
 
+ThreadPool* KdTree::getThreadPool()
+{
+	if (threadPool == nullptr) {
+		threadPool = new ThreadPool(threadCount);
+		workerMailboxes.resize(threadPool->getThreadCount());
+		for (KdStructs::Mailbox& workerMailbox : workerMailboxes)
+			workerMailbox.resize(triangles.size());
+	}
+	return threadPool;
+}
+
 std::vector<KdStructs::Point*> KdTree::getPointList(float* vertices, unsigned int vertexCount, unsigned int* indices, unsigned int indexCount)
 {
 	std::vector<KdStructs::Point*> points;
@@ -140,6 +871,9 @@ std::vector<KdStructs::Point*> KdTree::getPointList(float* vertices, unsigned in
 
 		KdStructs::Triangle* triangle = new KdStructs::Triangle(a, b, c);
 		//triangles.push_back(triangle);
+		triangle->vertices[0] = indices[i];
+		triangle->vertices[1] = indices[i + 1];
+		triangle->vertices[2] = indices[i + 2];
 
 		int pointIndex1 = vertexIndex1 / 3;
 		int pointIndex2 = vertexIndex2 / 3;
@@ -181,6 +915,9 @@ std::vector<KdStructs::Point*> KdTree::getPointList(float* vertices, unsigned in
 
 		KdStructs::Triangle* triangle = new KdStructs::Triangle(a, b, c);
 		//triangles.push_back(triangle);
+		triangle->vertices[0] = i;
+		triangle->vertices[1] = i + 1;
+		triangle->vertices[2] = i + 2;
 
 		// Check if point is already in list (duplicate vertex).
 		// For a.
@@ -259,20 +996,100 @@ KdStructs::Node* KdTree::createKdTree(std::vector<KdStructs::Point*> points, int
 	KdStructs::Node* left = createKdTree(leftPoints, depth + 1, newMax, min);
 	KdStructs::Node* right = createKdTree(rightPoints, depth + 1, max, newMin);
 
-	return new KdStructs::Node(medianPoint, left, right, axis, max, min);
+	KdStructs::Node* node = new KdStructs::Node(medianPoint, left, right, axis, max, min);
+	node->pointCount = points.size();
+	return node;
+}
+
+void KdTree::traceRay(const KdStructs::Ray& ray, KdStructs::Hit& hit, KdStructs::Mailbox& mailbox)
+{
+	KdStructs::PreparedRay prepared(ray);
+	float tNear, tFar;
+	// Rays missing the tree cost a single box test.
+	if (!clipToBounds(prepared, tNear, tFar))
+		return;
+
+	mailbox.next();
+	findIntersection(root, ray, prepared, tNear, tFar, hit, mailbox);
+}
+
+bool KdTree::traceOcclusion(const KdStructs::Ray& ray, float maxDistance, KdStructs::Mailbox& mailbox)
+{
+	KdStructs::PreparedRay prepared(ray);
+	prepared.maxDistance = maxDistance;
+	float tNear, tFar;
+	if (!clipToBounds(prepared, tNear, tFar))
+		return false;
+
+	mailbox.next();
+	return findOcclusion(root, ray, prepared, tNear, tFar, mailbox);
+}
+
+/// <summary>
+/// Slab test against the bounds of the root node.
+/// </summary>
+bool KdTree::clipToBounds(const KdStructs::PreparedRay& ray, float& tNear, float& tFar)
+{
+	tNear = 0;
+	tFar = ray.maxDistance;
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+	{
+		// Parallel to the slab -> either always or never inside.
+		if (ray.direction[axis] == 0.0f) {
+			if (ray.origin[axis] < root->triangleMin[axis] || ray.origin[axis] > root->triangleMax[axis])
+				return false;
+			continue;
+		}
+
+		const KdStructs::Vector& entry = ray.sign[axis] ? root->triangleMax : root->triangleMin;
+		const KdStructs::Vector& exit = ray.sign[axis] ? root->triangleMin : root->triangleMax;
+		float tEntry = (entry[axis] - ray.origin[axis]) * ray.inverseDirection[axis];
+		float tExit = (exit[axis] - ray.origin[axis]) * ray.inverseDirection[axis];
+		if (tEntry > tNear)
+			tNear = tEntry;
+		if (tExit < tFar)
+			tFar = tExit;
+		if (tNear > tFar)
+			return false;
+	}
+	return true;
+}
+
+void KdTree::computeTriangleBounds(KdStructs::Node* node)
+{
+	if (node == nullptr)
+		return;
+
+	computeTriangleBounds(node->left);
+	computeTriangleBounds(node->right);
+
+	node->triangleMax = node->point->pos;
+	node->triangleMin = node->point->pos;
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+	{
+		for (KdStructs::Triangle* triangle : node->point->triangles) {
+			node->triangleMax[axis] = std::max({ node->triangleMax[axis], triangle->a[axis], triangle->b[axis], triangle->c[axis] });
+			node->triangleMin[axis] = std::min({ node->triangleMin[axis], triangle->a[axis], triangle->b[axis], triangle->c[axis] });
+		}
+		for (KdStructs::Node* child : { node->left, node->right }) {
+			if (child == nullptr)
+				continue;
+			node->triangleMax[axis] = std::max(node->triangleMax[axis], child->triangleMax[axis]);
+			node->triangleMin[axis] = std::min(node->triangleMin[axis], child->triangleMin[axis]);
+		}
+	}
 }
 
 /// <summary>
 /// 1. Check current node
-/// 2. Check near node first
-/// Skip far node if:
-/// - Non parallel ray (would never intersect far plane)
-/// - Distance from ray to splitting plane smaller 0 -> far plane behind us
-/// - Distance greater than maxDistance
-/// - Distance greater than current intersection
-/// 3. Check far node
+/// 2. Clip the ray's interval [tNear, tFar] against the children's triangle bounds along the splitting axis
+///    Children overlap (their triangles reach over the splitting plane), so each child has its own plane:
+///    the left child ends at its maximum, the right child starts at its minimum.
+/// 3. Check near node (the one the ray's direction points away from) with its part of the interval
+/// 4. Check far node with its part of the interval, cut off at the current hit
+/// A child is skipped exactly when its part of the interval is empty.
 /// </summary>
-void KdTree::findIntersection(KdStructs::Node* node, KdStructs::Ray ray, KdStructs::RayHit*& hit)
+void KdTree::findIntersection(KdStructs::Node* node, const KdStructs::Ray& ray, const KdStructs::PreparedRay& prepared, float tNear, float tFar, KdStructs::Hit& hit, KdStructs::Mailbox& mailbox)
 {
 	// No node, no triangle to intersect.
 	if (node == nullptr)
@@ -280,60 +1097,2089 @@ void KdTree::findIntersection(KdStructs::Node* node, KdStructs::Ray ray, KdStruc
 
 
 	// Check current node.
-	for (KdStructs::Triangle* triangle : node->point->triangles) {
-		if (triangle->checkCache == this->checkCache)
-			continue;
-		else
-			triangle->checkCache = this->checkCache;
+	intersectNode(node, ray, prepared, hit, mailbox);
 
-		float distance = rayIntersectionWithTriangle(triangle, ray);
-		if (distance < 0)
-			continue;
 
-		KdStructs::Vector position = ray.origin + ray.direction * distance;
-		if (hit == nullptr)
-			hit = new KdStructs::RayHit(triangle, position, distance);
-		else if (distance <= hit->distance) {
-			hit->triangle = triangle;
-			hit->position = position;
-			hit->distance = distance;
-		}
+	float tLeft, tRight;
+	getChildPlaneDistances(node, prepared, tLeft, tRight);
+
+	int axis = node->axis;
+	bool leftFirst = prepared.sign[axis] == 0;
+	KdStructs::Node* near = leftFirst ? node->left : node->right;
+	KdStructs::Node* far = leftFirst ? node->right : node->left;
+
+	// Where the ray leaves the near child and enters the far child.
+	float tNearExit = leftFirst ? tLeft : tRight;
+	float tFarEntry = leftFirst ? tRight : tLeft;
+
+	float nearEnd = std::min(hit.valid ? std::min(tFar, hit.distance) : tFar, tNearExit);
+	if (near != nullptr && tNear <= nearEnd)
+		findIntersection(near, ray, prepared, tNear, nearEnd, hit, mailbox);
+
+	// Everything in the far node lies behind a hit before its bounds.
+	float farStart = std::max(tNear, tFarEntry);
+	float farEnd = hit.valid ? std::min(tFar, hit.distance) : tFar;
+	if (far != nullptr && farStart <= farEnd)
+		findIntersection(far, ray, prepared, farStart, farEnd, hit, mailbox);
+}
+
+/// <summary>
+/// 1. Check the node's point
+/// 2. Check the child on the query's side of the splitting plane
+/// 3. Check the other child if its cell is still closer than the nearest point
+///    Its distance is updated incrementally: only the offset along the splitting axis changes (Arya & Mount).
+/// </summary>
+void KdTree::findNearestPoint(KdStructs::Node* node, const float query[3], float offsets[3], float cellDistance, KdStructs::Neighbour& nearest, float& nearestDistance)
+{
+	if (node == nullptr)
+		return;
+
+	const KdStructs::Vector& position = node->point->pos;
+	float distance = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+		distance += (query[axis] - position[axis]) * (query[axis] - position[axis]);
+	if (distance < nearestDistance || (distance == nearestDistance && nearest.point == nullptr)) {
+		nearest.point = node->point;
+		nearestDistance = distance;
+	}
+
+	int axis = node->axis;
+	float difference = query[axis] - position[axis];
+	KdStructs::Node* near = difference < 0 ? node->left : node->right;
+	KdStructs::Node* far = difference < 0 ? node->right : node->left;
+
+	findNearestPoint(near, query, offsets, cellDistance, nearest, nearestDistance);
+
+	float offset = offsets[axis];
+	float farDistance = cellDistance - offset * offset + difference * difference;
+	if (far != nullptr && farDistance <= nearestDistance) {
+		offsets[axis] = difference;
+		findNearestPoint(far, query, offsets, farDistance, nearest, nearestDistance);
+		offsets[axis] = offset;
 	}
+}
+
+/// <summary>
+/// Same as findNearestPoint, subtrees are skipped once their cell is further away than the k-th closest point
+/// (divided by 1 + epsilon for approximate queries).
+/// </summary>
+void KdTree::findNearestPoints(KdStructs::Node* node, const float query[3], float offsets[3], float cellDistance, float pruneScale, unsigned int& visitsLeft, KdStructs::NeighbourHeap& heap)
+{
+	if (node == nullptr || visitsLeft == 0)
+		return;
+	visitsLeft--;
 
+	const KdStructs::Vector& position = node->point->pos;
+	float distance = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+		distance += (query[axis] - position[axis]) * (query[axis] - position[axis]);
+	heap.push(node->point->id, distance);
 
 	int axis = node->axis;
+	float difference = query[axis] - position[axis];
+	KdStructs::Node* near = difference < 0 ? node->left : node->right;
+	KdStructs::Node* far = difference < 0 ? node->right : node->left;
+
+	findNearestPoints(near, query, offsets, cellDistance, pruneScale, visitsLeft, heap);
+
+	float offset = offsets[axis];
+	float farDistance = cellDistance - offset * offset + difference * difference;
+	if (far != nullptr && farDistance * pruneScale < heap.getBound()) {
+		offsets[axis] = difference;
+		findNearestPoints(far, query, offsets, farDistance, pruneScale, visitsLeft, heap);
+		offsets[axis] = offset;
+	}
+}
+
+unsigned int KdTree::flattenTree(KdStructs::Node* node, std::vector<FlatNode>& nodes)
+{
+	if (node == nullptr)
+		return KdStructs::NO_ID;
+
+	unsigned int index = static_cast<unsigned int>(nodes.size());
+	nodes.emplace_back();
+	unsigned int left = flattenTree(node->left, nodes);
+	unsigned int right = flattenTree(node->right, nodes);
+
+	FlatNode& flat = nodes[index];
+	flat.id = node->point->id;
+	flat.left = left;
+	flat.right = right;
+	flat.pointCount = node->pointCount;
+	flat.axis = node->axis;
+	for (int axis = 0; axis < DIMENSIONS; axis++) {
+		flat.position[axis] = node->point->pos[axis];
+		flat.min[axis] = flat.position[axis];
+		flat.max[axis] = flat.position[axis];
+		for (unsigned int child : { left, right }) {
+			if (child == KdStructs::NO_ID)
+				continue;
+			flat.min[axis] = std::min(flat.min[axis], nodes[child].min[axis]);
+			flat.max[axis] = std::max(flat.max[axis], nodes[child].max[axis]);
+		}
+	}
+	return index;
+}
 
-	// Get near and far nodes depending on ray's origin (Before or after splitting plane?).
-	KdStructs::Node* near = ray.origin[axis] > node->point->pos[axis] ? node->right : node->left;
-	KdStructs::Node* far = near == node->right ? node->left : node->right;
+void KdTree::splitForThreads(const std::vector<FlatNode>& nodes, std::vector<unsigned int>& subtrees, std::vector<unsigned int>& upperNodes)
+{
+	subtrees.assign(nodes.empty() ? 0 : 1, 0);
+	upperNodes.clear();
+	while (!subtrees.empty() && subtrees.size() < 16 * getThreadPool()->getThreadCount()) {
+		std::vector<unsigned int> next;
+		for (unsigned int node : subtrees) {
+			upperNodes.push_back(node);
+			for (unsigned int child : { nodes[node].left, nodes[node].right })
+				if (child != KdStructs::NO_ID)
+					next.push_back(child);
+		}
+		subtrees.swap(next);
+	}
+}
 
+void KdTree::splitForThreads(KdStructs::Node* node, std::vector<KdStructs::Node*>& subtrees, std::vector<KdStructs::Node*>& upperNodes)
+{
+	subtrees.assign(node == nullptr ? 0 : 1, node);
+	upperNodes.clear();
+	while (!subtrees.empty() && subtrees.size() < 16 * getThreadPool()->getThreadCount()) {
+		std::vector<KdStructs::Node*> next;
+		for (KdStructs::Node* current : subtrees) {
+			upperNodes.push_back(current);
+			for (KdStructs::Node* child : { current->left, current->right })
+				if (child != nullptr)
+					next.push_back(child);
+		}
+		subtrees.swap(next);
+	}
+}
 
-	// If our direction is parallel to the axis, only visit near
-	if (ray.direction[axis] == 0.0f) {
-		findIntersection(near, ray, hit);
+/// <summary>
+/// Splits the larger subtree into its node's owned triangles and its children, like joinSubtrees.
+/// </summary>
+void KdTree::overlapSubtrees(KdStructs::Node* first, KdStructs::Node* second, OverlapState& state)
+{
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+		if (first->triangleMin[axis] > second->triangleMax[axis] || second->triangleMin[axis] > first->triangleMax[axis])
+			return;
+
+	if (first->pointCount >= second->pointCount) {
+		overlapOwnedTriangles(first, true, second, state);
+		for (KdStructs::Node* child : { first->left, first->right })
+			if (child != nullptr)
+				overlapSubtrees(child, second, state);
 	}
 	else {
-		// Distance from ray to splitting plane.
-		float t = (node->point->pos[axis] - ray.origin[axis]) / ray.direction[axis];
+		overlapOwnedTriangles(second, false, first, state);
+		for (KdStructs::Node* child : { second->left, second->right })
+			if (child != nullptr)
+				overlapSubtrees(first, child, state);
+	}
+}
 
-		KdStructs::Ray newRay = KdStructs::Ray(ray.origin, ray.direction, hit != nullptr ? hit->distance : ray.distance);
-		// Only check far node if intersection is possible (ray can reach it).
-		// Also skip if current hit is smaller than splitting plane distance.
-		if (0 <= t && t < ray.distance && (hit == nullptr || hit->distance > t)) {
-			findIntersection(near, newRay, hit);
-			findIntersection(far, newRay, hit);
-		}
-		else {
-			findIntersection(near, newRay, hit);
+void KdTree::overlapOwnedTriangles(KdStructs::Node* node, bool inFirst, KdStructs::Node* subtree, OverlapState& state)
+{
+	const KdTree* tree = inFirst ? this : state.second;
+	for (unsigned int i = node->ownedBegin; i < node->ownedBegin + node->ownedCount; i++)
+	{
+		const KdStructs::Triangle* triangle = tree->triangles[tree->ownedTriangleIds[i]];
+		float min[DIMENSIONS], max[DIMENSIONS];
+		for (int axis = 0; axis < DIMENSIONS; axis++) {
+			min[axis] = std::min({ triangle->a[axis], triangle->b[axis], triangle->c[axis] });
+			max[axis] = std::max({ triangle->a[axis], triangle->b[axis], triangle->c[axis] });
 		}
+		overlapTriangle(triangle, min, max, inFirst, subtree, state);
 	}
 }
 
 /// <summary>
-/// MllerTrumbore intersection algorithm
-/// https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
+/// Tests one triangle against the owned triangles of every node of the other tree's subtree whose triangle bounds it touches.
 /// </summary>
-float KdTree::rayIntersectionWithTriangle(KdStructs::Triangle* triangle, KdStructs::Ray ray)
+void KdTree::overlapTriangle(const KdStructs::Triangle* triangle, const float min[3], const float max[3], bool inFirst, KdStructs::Node* subtree, OverlapState& state)
+{
+	if (subtree == nullptr)
+		return;
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+		if (min[axis] > subtree->triangleMax[axis] || subtree->triangleMin[axis] > max[axis])
+			return;
+
+	const KdTree* tree = inFirst ? state.second : this;
+	for (unsigned int i = subtree->ownedBegin; i < subtree->ownedBegin + subtree->ownedCount; i++)
+	{
+		// Same argument order either way, so touching pairs get the same answer from both directions.
+		const KdStructs::Triangle* first = inFirst ? triangle : tree->triangles[tree->ownedTriangleIds[i]];
+		const KdStructs::Triangle* second = inFirst ? tree->triangles[tree->ownedTriangleIds[i]] : triangle;
+		if (!trianglesOverlap(*first, *second))
+			continue;
+		(*state.callback)(first->id, second->id, state.worker);
+		state.pairCount++;
+	}
+
+	overlapTriangle(triangle, min, max, inFirst, subtree->left, state);
+	overlapTriangle(triangle, min, max, inFirst, subtree->right, state);
+}
+
+bool KdTree::trianglesOverlap(const KdStructs::Triangle& first, const KdStructs::Triangle& second)
+{
+	KdStructs::Vector firstNormal = (first.b - first.a).cross(first.c - first.a);
+	KdStructs::Vector secondNormal = (second.b - second.a).cross(second.c - second.a);
+	if (firstNormal.dot(firstNormal) == 0 || secondNormal.dot(secondNormal) == 0)
+		return false;
+
+	// Distances of the vertices to the other triangle's plane (scaled by its normal's length). Rounding errors of nearly coplanar vertices
+	// would make the intervals below meaningless, so distances below a relative tolerance count as on the plane.
+	float size = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+		size = std::max(size, std::max({ first.a[axis], first.b[axis], first.c[axis], second.a[axis], second.b[axis], second.c[axis] })
+			- std::min({ first.a[axis], first.b[axis], first.c[axis], second.a[axis], second.b[axis], second.c[axis] }));
+	auto getPlaneDistances = [size](const KdStructs::Triangle& triangle, const KdStructs::Triangle& plane, const KdStructs::Vector& normal, float distances[3]) {
+		float tolerance = 1e-5f * std::sqrt(normal.dot(normal)) * size;
+		const KdStructs::Vector* vertices[3] = { &triangle.a, &triangle.b, &triangle.c };
+		for (int i = 0; i < 3; i++) {
+			distances[i] = normal.dot(*vertices[i] - plane.a);
+			if (std::abs(distances[i]) <= tolerance)
+				distances[i] = 0;
+		}
+		// All on one side -> disjoint.
+		return !(distances[0] > 0 && distances[1] > 0 && distances[2] > 0) && !(distances[0] < 0 && distances[1] < 0 && distances[2] < 0);
+	};
+	float firstDistances[3], secondDistances[3];
+	if (!getPlaneDistances(first, second, secondNormal, firstDistances) || !getPlaneDistances(second, first, firstNormal, secondDistances))
+		return false;
+
+	// Both cross the line where the planes meet. Compare their intervals on it, projected onto its largest axis.
+	KdStructs::Vector direction = firstNormal.cross(secondNormal);
+	int axis = 0;
+	for (int i = 1; i < DIMENSIONS; i++)
+		if (std::abs(direction[i]) > std::abs(direction[axis]))
+			axis = i;
+
+	float firstProjections[3] = { first.a[axis], first.b[axis], first.c[axis] };
+	float secondProjections[3] = { second.a[axis], second.b[axis], second.c[axis] };
+	float firstInterval[2], secondInterval[2];
+	if (!getTriangleInterval(firstProjections, firstDistances, firstInterval) || !getTriangleInterval(secondProjections, secondDistances, secondInterval))
+		return coplanarTrianglesOverlap(first, second, firstNormal);
+	return firstInterval[0] <= secondInterval[1] && secondInterval[0] <= firstInterval[1];
+}
+
+bool KdTree::getTriangleInterval(const float projections[3], const float distances[3], float interval[2])
+{
+	// Vertex alone on its side of the plane, the other two are on the other side or on the plane.
+	int alone;
+	if (distances[0] * distances[1] > 0)
+		alone = 2;
+	else if (distances[0] * distances[2] > 0)
+		alone = 1;
+	else if (distances[1] * distances[2] > 0 || distances[0] != 0)
+		alone = 0;
+	else if (distances[1] != 0)
+		alone = 1;
+	else if (distances[2] != 0)
+		alone = 2;
+	else
+		return false;
+
+	for (int i = 0; i < 2; i++) {
+		int other = (alone + 1 + i) % 3;
+		interval[i] = projections[alone] + (projections[other] - projections[alone]) * distances[alone] / (distances[alone] - distances[other]);
+	}
+	if (interval[0] > interval[1])
+		std::swap(interval[0], interval[1]);
+	return true;
+}
+
+/// <summary>
+/// Projects both triangles onto the axis plane where the first one is largest.
+/// They overlap if any edges cross or one triangle contains a vertex of the other.
+/// </summary>
+bool KdTree::coplanarTrianglesOverlap(const KdStructs::Triangle& first, const KdStructs::Triangle& second, const KdStructs::Vector& normal)
+{
+	int dropped = 0;
+	for (int i = 1; i < DIMENSIONS; i++)
+		if (std::abs(normal[i]) > std::abs(normal[dropped]))
+			dropped = i;
+	int x = (dropped + 1) % 3;
+	int y = (dropped + 2) % 3;
+
+	const KdStructs::Vector* triangles[2][3] = { { &first.a, &first.b, &first.c }, { &second.a, &second.b, &second.c } };
+	float points[2][3][2];
+	for (int t = 0; t < 2; t++)
+		for (int i = 0; i < 3; i++) {
+			points[t][i][0] = (*triangles[t][i])[x];
+			points[t][i][1] = (*triangles[t][i])[y];
+		}
+	// Positive if c is left of a -> b.
+	auto orientation = [](const float* a, const float* b, const float* c) { return (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]); };
+
+	for (int i = 0; i < 3; i++)
+	{
+		const float* p = points[0][i];
+		const float* q = points[0][(i + 1) % 3];
+		for (int j = 0; j < 3; j++)
+		{
+			const float* r = points[1][j];
+			const float* s = points[1][(j + 1) % 3];
+			float o1 = orientation(p, q, r);
+			float o2 = orientation(p, q, s);
+			float o3 = orientation(r, s, p);
+			float o4 = orientation(r, s, q);
+			if (o1 == 0 && o2 == 0) {
+				// Collinear: the segments' extents must overlap on both axes.
+				bool overlap = true;
+				for (int axis = 0; axis < 2; axis++)
+					overlap = overlap && std::min(p[axis], q[axis]) <= std::max(r[axis], s[axis]) && std::min(r[axis], s[axis]) <= std::max(p[axis], q[axis]);
+				if (overlap)
+					return true;
+			}
+			else if (((o1 <= 0 && o2 >= 0) || (o1 >= 0 && o2 <= 0)) && ((o3 <= 0 && o4 >= 0) || (o3 >= 0 && o4 <= 0)))
+				return true;
+		}
+	}
+
+	// No crossing edges, so either one contains the other or they are disjoint.
+	for (int t = 0; t < 2; t++)
+	{
+		const float* vertex = points[1 - t][0];
+		float o1 = orientation(points[t][0], points[t][1], vertex);
+		float o2 = orientation(points[t][1], points[t][2], vertex);
+		float o3 = orientation(points[t][2], points[t][0], vertex);
+		if ((o1 >= 0 && o2 >= 0 && o3 >= 0) || (o1 <= 0 && o2 <= 0 && o3 <= 0))
+			return true;
+	}
+	return false;
+}
+/// Like the subtree recursion of a dual-tree walk: splits the larger subtree into its node's point and its children.
+/// <summary>
+/// Splits the larger subtree into its node's point and its children (closer one first).
+/// Pairs of subtrees further apart than epsilon are skipped, pairs completely within epsilon are reported as a whole.
+/// </summary>
+void KdTree::joinSubtrees(unsigned int first, unsigned int second, JoinState& state)
+{
+	const FlatNode& firstNode = (*state.firstNodes)[first];
+	const FlatNode& secondNode = (*state.secondNodes)[second];
+	float closest = 0, furthest = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++) {
+		float gap = std::max({ secondNode.min[axis] - firstNode.max[axis], firstNode.min[axis] - secondNode.max[axis], 0.0f });
+		float span = std::max(firstNode.max[axis] - secondNode.min[axis], secondNode.max[axis] - firstNode.min[axis]);
+		closest += gap * gap;
+		furthest += span * span;
+	}
+	if (closest > state.epsilonSquared)
+		return;
+
+	if (furthest <= state.epsilonSquared) {
+		for (unsigned int i = first; i < first + firstNode.pointCount; i++)
+			for (unsigned int j = second; j < second + secondNode.pointCount; j++) {
+				const float* a = (*state.firstNodes)[i].position;
+				const float* b = (*state.secondNodes)[j].position;
+				reportJoinPair(i, j, std::sqrt((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) + (a[2] - b[2]) * (a[2] - b[2])), state);
+			}
+		return;
+	}
+
+	if (firstNode.pointCount >= secondNode.pointCount) {
+		joinPoint(first, second, true, state);
+		for (unsigned int child : { firstNode.left, firstNode.right })
+			if (child != KdStructs::NO_ID)
+				joinSubtrees(child, second, state);
+	}
+	else {
+		joinPoint(first, second, false, state);
+		for (unsigned int child : { secondNode.left, secondNode.right })
+			if (child != KdStructs::NO_ID)
+				joinSubtrees(first, child, state);
+	}
+}
+
+/// <summary>
+/// Radius search of one node's point within the subtree on the other side.
+/// </summary>
+void KdTree::joinPoint(unsigned int first, unsigned int second, bool pointInFirst, JoinState& state)
+{
+	const std::vector<FlatNode>& subtreeNodes = pointInFirst ? *state.secondNodes : *state.firstNodes;
+	const FlatNode& subtree = pointInFirst ? subtreeNodes[second] : subtreeNodes[first];
+	const float* position = pointInFirst ? (*state.firstNodes)[first].position : (*state.secondNodes)[second].position;
+
+	float closest = 0, furthest = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++) {
+		float gap = std::max({ subtree.min[axis] - position[axis], position[axis] - subtree.max[axis], 0.0f });
+		float span = std::max(position[axis] - subtree.min[axis], subtree.max[axis] - position[axis]);
+		closest += gap * gap;
+		furthest += span * span;
+	}
+	if (closest > state.epsilonSquared)
+		return;
+
+	// All points of the subtree when it is completely within epsilon, otherwise its node's point and then its children.
+	unsigned int begin = pointInFirst ? second : first;
+	unsigned int end = furthest <= state.epsilonSquared ? begin + subtree.pointCount : begin + 1;
+	for (unsigned int node = begin; node < end; node++) {
+		const float* other = subtreeNodes[node].position;
+		float distance = 0;
+		for (int axis = 0; axis < DIMENSIONS; axis++)
+			distance += (position[axis] - other[axis]) * (position[axis] - other[axis]);
+		if (distance <= state.epsilonSquared)
+			reportJoinPair(pointInFirst ? first : node, pointInFirst ? node : second, std::sqrt(distance), state);
+	}
+	if (end > begin + 1)
+		return;
+
+	for (unsigned int child : { subtree.left, subtree.right })
+		if (child != KdStructs::NO_ID)
+			joinPoint(pointInFirst ? first : child, pointInFirst ? child : second, pointInFirst, state);
+}
+
+void KdTree::reportJoinPair(unsigned int first, unsigned int second, float distance, JoinState& state)
+{
+	(*state.callback)(points[(*state.firstNodes)[first].id], state.second->points[(*state.secondNodes)[second].id], distance, state.worker);
+	state.pairCount++;
+}
+
+/// <summary>
+/// Searches the neighbours of all points of a query block at once: a bucket ([block, block + pointCount) of the flat tree),
+/// or the single point of a node above the buckets. Reference subtrees are visited closer side first and skipped once
+/// their bounds are further from the block's bounds than the worst k-th distance within the block.
+/// The block's own bucket comes first, which bounds every point before anything is skipped.
+/// </summary>
+void KdTree::findBucketNeighbours(unsigned int block, std::vector<unsigned int>& stack, KnnGraphState& state)
+{
+	const FlatNode& blockNode = state.nodes[block];
+	bool bucket = blockNode.pointCount <= KdStructs::GRAPH_BUCKET_SIZE;
+	unsigned int blockEnd = bucket ? block + blockNode.pointCount : block + 1;
+	const float* blockMin = bucket ? blockNode.min : blockNode.position;
+	const float* blockMax = bucket ? blockNode.max : blockNode.position;
+	float blockBound = std::numeric_limits<float>::infinity();
+
+	stack.assign(1, 0);
+	while (!stack.empty())
+	{
+		unsigned int reference = stack.back();
+		stack.pop_back();
+		const FlatNode& referenceNode = state.nodes[reference];
+		float boxDistance = 0;
+		for (int axis = 0; axis < DIMENSIONS; axis++) {
+			float gap = std::max({ referenceNode.min[axis] - blockMax[axis], blockMin[axis] - referenceNode.max[axis], 0.0f });
+			boxDistance += gap * gap;
+		}
+		if (boxDistance > blockBound)
+			continue;
+
+		if (referenceNode.pointCount <= KdStructs::GRAPH_BUCKET_SIZE) {
+			compareBuckets(block, blockEnd, reference, reference + referenceNode.pointCount, referenceNode.min, referenceNode.max, state);
+		}
+		else {
+			// Points above the buckets are often split points far from the block.
+			float pointDistance = 0;
+			for (int axis = 0; axis < DIMENSIONS; axis++) {
+				float gap = std::max({ referenceNode.position[axis] - blockMax[axis], blockMin[axis] - referenceNode.position[axis], 0.0f });
+				pointDistance += gap * gap;
+			}
+			if (pointDistance <= blockBound)
+				compareBuckets(block, blockEnd, reference, reference + 1, referenceNode.position, referenceNode.position, state);
+			int axis = referenceNode.axis;
+			bool leftFirst = blockMin[axis] + blockMax[axis] < 2 * referenceNode.position[axis];
+			unsigned int near = leftFirst ? referenceNode.left : referenceNode.right;
+			unsigned int far = leftFirst ? referenceNode.right : referenceNode.left;
+			if (far != KdStructs::NO_ID)
+				stack.push_back(far);
+			if (near != KdStructs::NO_ID)
+				stack.push_back(near);
+		}
+
+		blockBound = 0;
+		for (unsigned int query = block; query < blockEnd; query++)
+			blockBound = std::max(blockBound, state.bounds[query]);
+	}
+}
+
+/// <summary>
+/// Every pair of the query range and the reference range (node indices), skipping queries further from the reference bounds than their k-th distance.
+/// </summary>
+void KdTree::compareBuckets(unsigned int queryBegin, unsigned int queryEnd, unsigned int referenceBegin, unsigned int referenceEnd,
+	const float referenceMin[3], const float referenceMax[3], KnnGraphState& state)
+{
+	const float* xs = state.positions[0].data();
+	const float* ys = state.positions[1].data();
+	const float* zs = state.positions[2].data();
+	for (unsigned int query = queryBegin; query < queryEnd; query++)
+	{
+		float position[DIMENSIONS] = { xs[query], ys[query], zs[query] };
+		float bound = state.bounds[query];
+		float boxDistance = 0;
+		for (int axis = 0; axis < DIMENSIONS; axis++) {
+			float gap = std::max({ referenceMin[axis] - position[axis], position[axis] - referenceMax[axis], 0.0f });
+			boxDistance += gap * gap;
+		}
+		if (boxDistance > bound)
+			continue;
+
+		// All distances first, in a loop the compiler can vectorize.
+		float distances[KdStructs::GRAPH_BUCKET_SIZE];
+		unsigned int count = referenceEnd - referenceBegin;
+		for (unsigned int i = 0; i < count; i++) {
+			float dx = xs[referenceBegin + i] - position[0];
+			float dy = ys[referenceBegin + i] - position[1];
+			float dz = zs[referenceBegin + i] - position[2];
+			distances[i] = dx * dx + dy * dy + dz * dz;
+		}
+
+		size_t offset = static_cast<size_t>(query) * state.k;
+		KdStructs::NeighbourHeap heap(state.k, state.ids + offset, state.distances + offset, state.sizes[query]);
+		for (unsigned int i = 0; i < count; i++)
+			if (distances[i] < bound && referenceBegin + i != query) {
+				heap.push(state.nodes[referenceBegin + i].id, distances[i]);
+				bound = heap.getBound();
+			}
+		state.sizes[query] = heap.size;
+		state.bounds[query] = bound;
+	}
+}
+
+/// <summary>
+/// Akenine-Moller's test, in coordinates relative to the box center.
+/// The triangle and the box are disjoint if their projections onto any of the 13 axes are.
+/// </summary>
+bool KdTree::triangleOverlapsBox(const KdStructs::Triangle& triangle, const KdStructs::Vector& min, const KdStructs::Vector& max)
+{
+	float halfSize[DIMENSIONS];
+	float vertices[3][DIMENSIONS];
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+	{
+		float center = (min[axis] + max[axis]) / 2;
+		halfSize[axis] = (max[axis] - min[axis]) / 2;
+		vertices[0][axis] = triangle.a[axis] - center;
+		vertices[1][axis] = triangle.b[axis] - center;
+		vertices[2][axis] = triangle.c[axis] - center;
+
+		// Box normals: bounds of the triangle against the box.
+		if (std::min({ vertices[0][axis], vertices[1][axis], vertices[2][axis] }) > halfSize[axis] ||
+			std::max({ vertices[0][axis], vertices[1][axis], vertices[2][axis] }) < -halfSize[axis])
+			return false;
+	}
+
+	float edges[3][DIMENSIONS];
+	for (int i = 0; i < 3; i++)
+		for (int axis = 0; axis < DIMENSIONS; axis++)
+			edges[i][axis] = vertices[(i + 1) % 3][axis] - vertices[i][axis];
+
+	// Cross products of the box normals and the edges.
+	for (int boxAxis = 0; boxAxis < DIMENSIONS; boxAxis++)
+	{
+		int next = (boxAxis + 1) % 3;
+		int last = (boxAxis + 2) % 3;
+		for (const float* edge : edges)
+		{
+			// Unit vector along boxAxis cross edge, its boxAxis component is zero.
+			float axisNext = -edge[last];
+			float axisLast = edge[next];
+			float radius = halfSize[next] * std::abs(axisNext) + halfSize[last] * std::abs(axisLast);
+
+			float projectionMin = std::numeric_limits<float>::infinity();
+			float projectionMax = -std::numeric_limits<float>::infinity();
+			for (const float* vertex : vertices) {
+				float projection = vertex[next] * axisNext + vertex[last] * axisLast;
+				projectionMin = std::min(projectionMin, projection);
+				projectionMax = std::max(projectionMax, projection);
+			}
+			if (projectionMin > radius || projectionMax < -radius)
+				return false;
+		}
+	}
+
+	// Triangle normal: the box must reach the triangle's plane.
+	float normal[DIMENSIONS];
+	float distance = 0;
+	float radius = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+	{
+		int next = (axis + 1) % 3;
+		int last = (axis + 2) % 3;
+		normal[axis] = edges[0][next] * edges[1][last] - edges[0][last] * edges[1][next];
+	}
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+	{
+		distance += normal[axis] * vertices[0][axis];
+		radius += halfSize[axis] * std::abs(normal[axis]);
+	}
+	return std::abs(distance) <= radius;
+}
+
+/// <summary>
+/// Ericson's Voronoi region test: finds the vertex, edge or face region of query and projects onto it,
+/// using only dot products of the edges and query - a, - b, - c.
+/// </summary>
+float KdTree::closestPointOnTriangle(const KdStructs::Triangle& triangle, const float query[3], float closest[3])
+{
+	float ab[DIMENSIONS], ac[DIMENSIONS], ap[DIMENSIONS], bp[DIMENSIONS], cp[DIMENSIONS];
+	for (int axis = 0; axis < DIMENSIONS; axis++) {
+		ab[axis] = triangle.b[axis] - triangle.a[axis];
+		ac[axis] = triangle.c[axis] - triangle.a[axis];
+		ap[axis] = query[axis] - triangle.a[axis];
+		bp[axis] = query[axis] - triangle.b[axis];
+		cp[axis] = query[axis] - triangle.c[axis];
+	}
+	auto dot = [](const float* x, const float* y) { return x[0] * y[0] + x[1] * y[1] + x[2] * y[2]; };
+
+	// Barycentric weights of b and c.
+	float u, v;
+	float d1 = dot(ab, ap);
+	float d2 = dot(ac, ap);
+	float d3 = dot(ab, bp);
+	float d4 = dot(ac, bp);
+	float d5 = dot(ab, cp);
+	float d6 = dot(ac, cp);
+	float va = d3 * d6 - d5 * d4;
+	float vb = d5 * d2 - d1 * d6;
+	float vc = d1 * d4 - d3 * d2;
+
+	if (d1 <= 0 && d2 <= 0) {
+		// Vertex a
+		u = 0;
+		v = 0;
+	}
+	else if (d3 >= 0 && d4 <= d3) {
+		// Vertex b
+		u = 1;
+		v = 0;
+	}
+	else if (d6 >= 0 && d5 <= d6) {
+		// Vertex c
+		u = 0;
+		v = 1;
+	}
+	else if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+		// Edge ab
+		u = d1 / (d1 - d3);
+		v = 0;
+	}
+	else if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+		// Edge ac
+		u = 0;
+		v = d2 / (d2 - d6);
+	}
+	else if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+		// Edge bc
+		v = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+		u = 1 - v;
+	}
+	else {
+		// Face
+		float denominator = 1 / (va + vb + vc);
+		u = vb * denominator;
+		v = vc * denominator;
+	}
+
+	float distance = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++) {
+		closest[axis] = triangle.a[axis] + ab[axis] * u + ac[axis] * v;
+		distance += (query[axis] - closest[axis]) * (query[axis] - closest[axis]);
+	}
+	return distance;
+}
+
+float KdTree::getTriangleBoundsDistance(KdStructs::Node* node, const float query[3])
+{
+	float distance = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++) {
+		float outside = std::max({ node->triangleMin[axis] - query[axis], query[axis] - node->triangleMax[axis], 0.0f });
+		distance += outside * outside;
+	}
+	return distance;
+}
+
+/// <summary>
+/// Tests the node's triangles, then descends into the child whose triangle bounds are closer first.
+/// </summary>
+void KdTree::findClosestPoint(KdStructs::Node* node, const float query[3], float boundsDistance, KdStructs::SurfacePoint& best, float& bestDistance, KdStructs::Mailbox& mailbox)
+{
+	if (boundsDistance > bestDistance)
+		return;
+
+	for (KdStructs::Triangle* triangle : node->point->triangles) {
+		if (!mailbox.check(triangle->id))
+			continue;
+		float closest[DIMENSIONS];
+		float distance = closestPointOnTriangle(*triangle, query, closest);
+		if (distance < bestDistance || (distance == bestDistance && !best.valid)) {
+			bestDistance = distance;
+			best.triangle = triangle->id;
+			best.position = KdStructs::Vector(closest[0], closest[1], closest[2]);
+			best.valid = true;
+		}
+	}
+
+	KdStructs::Node* near = node->left;
+	KdStructs::Node* far = node->right;
+	float nearDistance = near != nullptr ? getTriangleBoundsDistance(near, query) : std::numeric_limits<float>::infinity();
+	float farDistance = far != nullptr ? getTriangleBoundsDistance(far, query) : std::numeric_limits<float>::infinity();
+	if (farDistance < nearDistance) {
+		std::swap(near, far);
+		std::swap(nearDistance, farDistance);
+	}
+
+	if (near != nullptr)
+		findClosestPoint(near, query, nearDistance, best, bestDistance, mailbox);
+	if (far != nullptr)
+		findClosestPoint(far, query, farDistance, best, bestDistance, mailbox);
+}
+
+KdStructs::HausdorffDistance KdTree::computeHausdorffDistance(KdTree& other, float tolerance, float lowerBound)
+{
+	KdStructs::HausdorffDistance result;
+	if (triangles.empty())
+		return result;
+	if (other.triangles.empty()) {
+		result.distance = std::numeric_limits<float>::infinity();
+		result.upperBound = result.distance;
+		return result;
+	}
+
+	ThreadPool* pool = getThreadPool();
+	if (ownedTriangleIds.empty())
+		buildOwnedTriangles();
+
+	// The upper nodes are spread over the whole mesh and go first, which raises the lower bound early.
+	std::vector<KdStructs::Node*> subtrees;
+	std::vector<KdStructs::Node*> upperNodes;
+	splitForThreads(root, subtrees, upperNodes);
+
+	// Searches on other run on the workers of this tree, so they need their own mailboxes for its triangles.
+	std::vector<KdStructs::Mailbox> mailboxes(pool->getThreadCount());
+	for (KdStructs::Mailbox& mailbox : mailboxes)
+		mailbox.resize(other.triangles.size());
+	std::vector<KdStructs::HausdorffDistance> results(pool->getThreadCount());
+	std::atomic<float> sharedLowerBound(lowerBound);
+
+	size_t taskCount = upperNodes.size() + subtrees.size();
+	pool->parallelFor(taskCount, 1, [this, &other, tolerance, &subtrees, &upperNodes, &mailboxes, &results, &sharedLowerBound](size_t begin, size_t end, unsigned int worker) {
+		HausdorffState state = { &other, &mailboxes[worker], &sharedLowerBound, tolerance, KdStructs::NO_ID, results[worker] };
+		for (size_t i = begin; i < end; i++) {
+			if (i < upperNodes.size())
+				findHausdorffDistance(upperNodes[i], false, state);
+			else
+				findHausdorffDistance(subtrees[i - upperNodes.size()], true, state);
+		}
+		results[worker] = state.result;
+	});
+
+	for (const KdStructs::HausdorffDistance& workerResult : results) {
+		if (workerResult.triangle != KdStructs::NO_ID && (result.triangle == KdStructs::NO_ID || workerResult.distance > result.distance)) {
+			float upperBound = result.upperBound;
+			result = workerResult;
+			result.upperBound = upperBound;
+		}
+		result.upperBound = std::max(result.upperBound, workerResult.upperBound);
+	}
+	result.upperBound = std::max(result.upperBound, result.distance);
+	return result;
+}
+
+/// <summary>
+/// Distance to a single target triangle is convex, so its largest value over any convex region (triangle bounds, source triangle) is at a corner.
+/// With the hint triangle that gives a cheap upper bound, which skips the subtree or triangle if it cannot raise the lower bound by more than tolerance.
+/// Triangles of upper nodes are handled without their subtrees, which are separate tasks.
+/// </summary>
+void KdTree::findHausdorffDistance(KdStructs::Node* node, bool recursive, HausdorffState& state)
+{
+	if (node == nullptr)
+		return;
+	if (state.hint == KdStructs::NO_ID)
+		state.hint = state.target->closestPointFromHint(node->point->pos, KdStructs::NO_ID, *state.mailbox).triangle;
+
+	if (recursive) {
+		const KdStructs::Vector& min = node->triangleMin;
+		const KdStructs::Vector& max = node->triangleMax;
+		KdStructs::Vector corners[8] = {
+			KdStructs::Vector(min[0], min[1], min[2]), KdStructs::Vector(max[0], min[1], min[2]),
+			KdStructs::Vector(min[0], max[1], min[2]), KdStructs::Vector(max[0], max[1], min[2]),
+			KdStructs::Vector(min[0], min[1], max[2]), KdStructs::Vector(max[0], min[1], max[2]),
+			KdStructs::Vector(min[0], max[1], max[2]), KdStructs::Vector(max[0], max[1], max[2])
+		};
+		float upperBound = std::sqrt(getFurthestDistance(*state.target->triangles[state.hint], corners, 8));
+		if (upperBound <= state.lowerBound->load() + state.tolerance) {
+			state.result.upperBound = std::max(state.result.upperBound, upperBound);
+			return;
+		}
+	}
+
+	for (unsigned int i = node->ownedBegin; i < node->ownedBegin + node->ownedCount; i++)
+	{
+		const KdStructs::Triangle* triangle = triangles[ownedTriangleIds[i]];
+		KdStructs::Vector corners[3] = { triangle->a, triangle->b, triangle->c };
+		float upperBound = std::sqrt(getFurthestDistance(*state.target->triangles[state.hint], corners, 3));
+		if (upperBound <= state.lowerBound->load() + state.tolerance) {
+			state.result.upperBound = std::max(state.result.upperBound, upperBound);
+			continue;
+		}
+
+		KdStructs::SurfacePoint nearest[3];
+		for (int j = 0; j < 3; j++) {
+			nearest[j] = state.target->closestPointFromHint(corners[j], state.hint, *state.mailbox);
+			state.hint = nearest[j].triangle;
+			offerHausdorffPoint(corners[j], nearest[j], triangle->id, state);
+		}
+		refineHausdorffDistance(corners, nearest, triangle->id, 0, state);
+	}
+
+	if (recursive) {
+		findHausdorffDistance(node->left, true, state);
+		findHausdorffDistance(node->right, true, state);
+	}
+}
+
+/// <summary>
+/// The corners' distances are lower bounds of the triangle's. The closest target triangles of the corners give upper bounds, the best of them is kept.
+/// While they are further apart than tolerance, the triangle is split into four at its edge midpoints.
+/// </summary>
+void KdTree::refineHausdorffDistance(const KdStructs::Vector corners[3], const KdStructs::SurfacePoint nearest[3], unsigned int triangle, unsigned int depth, HausdorffState& state)
+{
+	float upperBound = std::numeric_limits<float>::infinity();
+	for (int j = 0; j < 3; j++)
+		upperBound = std::min(upperBound, getFurthestDistance(*state.target->triangles[nearest[j].triangle], corners, 3));
+	upperBound = std::sqrt(upperBound);
+	// The distance grows at most as fast as the position, and no point of a triangle is further than its longest edge / sqrt(3) from a corner.
+	// Unlike the bound above, this one shrinks with every split.
+	float longestEdge = 0;
+	for (int j = 0; j < 3; j++)
+		longestEdge = std::max(longestEdge, (corners[(j + 1) % 3] - corners[j]).dot(corners[(j + 1) % 3] - corners[j]));
+	float furthestCorner = std::max({ nearest[0].distance, nearest[1].distance, nearest[2].distance });
+	upperBound = std::min(upperBound, furthestCorner + std::sqrt(longestEdge / 3));
+	if (upperBound <= state.lowerBound->load() + state.tolerance || depth == KdStructs::MAX_HAUSDORFF_DEPTH) {
+		state.result.upperBound = std::max(state.result.upperBound, upperBound);
+		return;
+	}
+
+	KdStructs::Vector midpoints[3] = { (corners[0] + corners[1]) * 0.5f, (corners[1] + corners[2]) * 0.5f, (corners[2] + corners[0]) * 0.5f };
+	KdStructs::SurfacePoint midpointNearest[3];
+	for (int j = 0; j < 3; j++) {
+		midpointNearest[j] = state.target->closestPointFromHint(midpoints[j], nearest[j].triangle, *state.mailbox);
+		offerHausdorffPoint(midpoints[j], midpointNearest[j], triangle, state);
+	}
+
+	KdStructs::Vector children[4][3] = {
+		{ corners[0], midpoints[0], midpoints[2] },
+		{ midpoints[0], corners[1], midpoints[1] },
+		{ midpoints[2], midpoints[1], corners[2] },
+		{ midpoints[0], midpoints[1], midpoints[2] }
+	};
+	KdStructs::SurfacePoint childNearest[4][3] = {
+		{ nearest[0], midpointNearest[0], midpointNearest[2] },
+		{ midpointNearest[0], nearest[1], midpointNearest[1] },
+		{ midpointNearest[2], midpointNearest[1], nearest[2] },
+		{ midpointNearest[0], midpointNearest[1], midpointNearest[2] }
+	};
+	for (int i = 0; i < 4; i++)
+		refineHausdorffDistance(children[i], childNearest[i], triangle, depth + 1, state);
+}
+
+KdStructs::SurfacePoint KdTree::closestPointFromHint(const KdStructs::Vector& query, unsigned int hint, KdStructs::Mailbox& mailbox, float maxDistance)
+{
+	KdStructs::SurfacePoint best;
+	float bestDistance = maxDistance * maxDistance;
+	float position[DIMENSIONS] = { query[0], query[1], query[2] };
+	mailbox.next();
+	if (hint != KdStructs::NO_ID) {
+		float closest[DIMENSIONS];
+		float distance = closestPointOnTriangle(*triangles[hint], position, closest);
+		if (distance <= bestDistance) {
+			bestDistance = distance;
+			best.triangle = hint;
+			best.position = KdStructs::Vector(closest[0], closest[1], closest[2]);
+			best.valid = true;
+		}
+		mailbox.check(hint);
+	}
+	findClosestPoint(root, position, getTriangleBoundsDistance(root, position), best, bestDistance, mailbox);
+
+	if (best.valid)
+		best.distance = std::sqrt(bestDistance);
+	return best;
+}
+
+void KdTree::offerHausdorffPoint(const KdStructs::Vector& from, const KdStructs::SurfacePoint& to, unsigned int triangle, HausdorffState& state)
+{
+	if (state.result.triangle != KdStructs::NO_ID && to.distance <= state.result.distance)
+		return;
+	state.result.distance = to.distance;
+	state.result.from = from;
+	state.result.triangle = triangle;
+	state.result.to = to;
+
+	float lowerBound = state.lowerBound->load();
+	while (to.distance > lowerBound && !state.lowerBound->compare_exchange_weak(lowerBound, to.distance)) {}
+}
+
+float KdTree::getFurthestDistance(const KdStructs::Triangle& triangle, const KdStructs::Vector* points, unsigned int count)
+{
+	float furthest = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		float closest[DIMENSIONS];
+		furthest = std::max(furthest, closestPointOnTriangle(triangle, points[i].values, closest));
+	}
+	return furthest;
+}
+
+/// <summary>
+/// Classifies the node's triangle bounds against the remaining planes: subtrees outside any plane are skipped,
+/// planes the bounds are completely inside of are dropped for the whole subtree.
+/// Only the node's owned triangles are tested, so no triangle is reported twice.
+/// </summary>
+void KdTree::findTrianglesInPolytope(KdStructs::Node* node, const KdStructs::Plane* planes, unsigned int planeMask, std::vector<unsigned int>& triangleIds)
+{
+	if (node == nullptr)
+		return;
+
+	for (unsigned int i = 0; i < KdStructs::MAX_PLANES; i++)
+	{
+		if ((planeMask & (1u << i)) == 0)
+			continue;
+
+		// Corners of the bounds furthest along and against the normal.
+		const KdStructs::Vector& normal = planes[i].normal;
+		float inner[DIMENSIONS], outer[DIMENSIONS];
+		for (int axis = 0; axis < DIMENSIONS; axis++) {
+			inner[axis] = normal[axis] >= 0 ? node->triangleMax[axis] : node->triangleMin[axis];
+			outer[axis] = normal[axis] >= 0 ? node->triangleMin[axis] : node->triangleMax[axis];
+		}
+		if (planes[i].getDistance(inner) < 0)
+			return;
+		if (planes[i].getDistance(outer) >= 0)
+			planeMask &= ~(1u << i);
+	}
+
+	if (planeMask == 0) {
+		triangleIds.insert(triangleIds.end(), ownedTriangleIds.begin() + node->ownedBegin, ownedTriangleIds.begin() + node->ownedEnd);
+		return;
+	}
+
+	for (unsigned int i = node->ownedBegin; i < node->ownedBegin + node->ownedCount; i++)
+	{
+		const KdStructs::Triangle* triangle = triangles[ownedTriangleIds[i]];
+		bool outside = false;
+		for (unsigned int plane = 0; plane < KdStructs::MAX_PLANES && !outside; plane++)
+			if ((planeMask & (1u << plane)) != 0)
+				outside = planes[plane].getDistance(triangle->a.values) < 0 && planes[plane].getDistance(triangle->b.values) < 0 && planes[plane].getDistance(triangle->c.values) < 0;
+		if (!outside)
+			triangleIds.push_back(triangle->id);
+	}
+
+	findTrianglesInPolytope(node->left, planes, planeMask, triangleIds);
+	findTrianglesInPolytope(node->right, planes, planeMask, triangleIds);
+}
+
+/// <summary>
+/// Skips subtrees whose triangle bounds miss the box, tests the triangles of each remaining point once per query.
+/// </summary>
+void KdTree::findTrianglesInBox(KdStructs::Node* node, const KdStructs::Vector& min, const KdStructs::Vector& max, std::vector<unsigned int>& triangleIds, KdStructs::Mailbox& mailbox)
+{
+	if (node == nullptr)
+		return;
+
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+		if (node->triangleMin[axis] > max[axis] || node->triangleMax[axis] < min[axis])
+			return;
+
+	for (KdStructs::Triangle* triangle : node->point->triangles)
+		if (mailbox.check(triangle->id) && triangleOverlapsBox(*triangle, min, max))
+			triangleIds.push_back(triangle->id);
+
+	// The children's triangle bounds extend the split plane by the triangles crossing it.
+	findTrianglesInBox(node->left, min, max, triangleIds, mailbox);
+	findTrianglesInBox(node->right, min, max, triangleIds, mailbox);
+}
+
+void KdTree::getNodeDistances(KdStructs::Node* node, const float center[3], float& closest, float& furthest)
+{
+	closest = 0;
+	furthest = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+	{
+		// Cell and triangle bounds both contain all points of the subtree, so does their intersection.
+		float min = std::max(node->min[axis], node->triangleMin[axis]);
+		float max = std::min(node->max[axis], node->triangleMax[axis]);
+
+		float outside = std::max({ min - center[axis], center[axis] - max, 0.0f });
+		float corner = std::max(center[axis] - min, max - center[axis]);
+		closest += outside * outside;
+		furthest += corner * corner;
+	}
+}
+
+void KdTree::findPointsInRadius(KdStructs::Node* node, const float center[3], float radiusSquared, const std::function<void(const KdStructs::Point*, float)>& callback)
+{
+	if (node == nullptr)
+		return;
+
+	float closest, furthest;
+	getNodeDistances(node, center, closest, furthest);
+	if (closest > radiusSquared)
+		return;
+	if (furthest <= radiusSquared) {
+		reportSubtree(node, center, callback);
+		return;
+	}
+
+	const KdStructs::Vector& position = node->point->pos;
+	float distance = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+		distance += (center[axis] - position[axis]) * (center[axis] - position[axis]);
+	if (distance <= radiusSquared)
+		callback(node->point, std::sqrt(distance));
+
+	findPointsInRadius(node->left, center, radiusSquared, callback);
+	findPointsInRadius(node->right, center, radiusSquared, callback);
+}
+
+void KdTree::reportSubtree(KdStructs::Node* node, const float center[3], const std::function<void(const KdStructs::Point*, float)>& callback)
+{
+	if (node == nullptr)
+		return;
+
+	const KdStructs::Vector& position = node->point->pos;
+	float distance = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+		distance += (center[axis] - position[axis]) * (center[axis] - position[axis]);
+	callback(node->point, std::sqrt(distance));
+
+	reportSubtree(node->left, center, callback);
+	reportSubtree(node->right, center, callback);
+}
+
+size_t KdTree::countPointsInRadius(KdStructs::Node* node, const float center[3], float radiusSquared)
+{
+	if (node == nullptr)
+		return 0;
+
+	float closest, furthest;
+	getNodeDistances(node, center, closest, furthest);
+	if (closest > radiusSquared)
+		return 0;
+	if (furthest <= radiusSquared)
+		return node->pointCount;
+
+	const KdStructs::Vector& position = node->point->pos;
+	float distance = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+		distance += (center[axis] - position[axis]) * (center[axis] - position[axis]);
+
+	size_t count = distance <= radiusSquared ? 1 : 0;
+	return count + countPointsInRadius(node->left, center, radiusSquared) + countPointsInRadius(node->right, center, radiusSquared);
+}
+
+/// <summary>
+/// Traverses like findIntersection, but collects every hit in [tMin, maxDistance].
+/// Nodes are only cut off once the buffer is full, then at its furthest hit.
+/// </summary>
+void KdTree::findAllIntersections(KdStructs::Node* node, const KdStructs::Ray& ray, const KdStructs::PreparedRay& prepared, float tMin, float tNear, float tFar, KdStructs::HitBuffer& buffer, KdStructs::Mailbox& mailbox)
+{
+	if (node == nullptr)
+		return;
+
+	// Check current node.
+	for (KdStructs::Triangle* triangle : node->point->triangles) {
+		if (!mailbox.check(triangle->id))
+			continue;
+
+		KdStructs::Hit hit;
+		hit.distance = intersectTriangle(triangle, ray, prepared, hit.u, hit.v);
+		if (hit.distance < 0 || hit.distance < tMin || hit.distance > prepared.maxDistance)
+			continue;
+
+		hit.triangle = triangle->id;
+		hit.valid = true;
+		buffer.insert(hit);
+	}
+
+	float tLeft, tRight;
+	getChildPlaneDistances(node, prepared, tLeft, tRight);
+
+	bool leftFirst = prepared.sign[node->axis] == 0;
+	KdStructs::Node* near = leftFirst ? node->left : node->right;
+	KdStructs::Node* far = leftFirst ? node->right : node->left;
+
+	float nearEnd = std::min(buffer.getCutoff(tFar), leftFirst ? tLeft : tRight);
+	if (near != nullptr && tNear <= nearEnd)
+		findAllIntersections(near, ray, prepared, tMin, tNear, nearEnd, buffer, mailbox);
+
+	float farStart = std::max(tNear, leftFirst ? tRight : tLeft);
+	float farEnd = buffer.getCutoff(tFar);
+	if (far != nullptr && farStart <= farEnd)
+		findAllIntersections(far, ray, prepared, tMin, farStart, farEnd, buffer, mailbox);
+}
+
+bool KdTree::isInside(const KdStructs::Vector& point, unsigned int directions, std::vector<Crossing>& crossings, KdStructs::Mailbox& mailbox)
+{
+	directions = std::min(std::max(directions, 1u), KdStructs::MAX_CONTAINMENT_DIRECTIONS);
+	unsigned int votes = 0;
+	for (unsigned int i = 0; i < directions; i++)
+		if (countCrossings(point, getContainmentDirection(i), std::numeric_limits<float>::infinity(), crossings, mailbox) % 2 == 1)
+			votes++;
+	return 2 * votes > directions;
+}
+
+/// <summary>
+/// Collects all crossings in one traversal, then merges hits on edges and vertices: within a run of them at (nearly) the same distance,
+/// each side counts once. A ray through a shared edge counts one crossing, one grazing the mesh's silhouette counts two (in and out).
+/// </summary>
+unsigned int KdTree::countCrossings(const KdStructs::Vector& origin, const KdStructs::Vector& direction, float maxDistance, std::vector<Crossing>& crossings, KdStructs::Mailbox& mailbox)
+{
+	const float MERGE_EPSILON = 0.00001f;
+
+	crossings.clear();
+	if (root == nullptr)
+		return 0;
+	KdStructs::PreparedRay prepared(KdStructs::Ray(origin, direction, maxDistance));
+	float tNear, tFar;
+	if (!clipToBounds(prepared, tNear, tFar))
+		return 0;
+
+	mailbox.next();
+	findCrossings(root, prepared, tNear, tFar, crossings, mailbox);
+	std::sort(crossings.begin(), crossings.end(), [](const Crossing& a, const Crossing& b) { return a.distance < b.distance; });
+
+	unsigned int count = 0;
+	float runStart = 0;
+	int runSides = 0;
+	for (size_t i = 0; i < crossings.size(); i++)
+	{
+		Crossing crossing = crossings[i];
+		if (!crossing.onEdge) {
+			crossings[count++] = crossing;
+			continue;
+		}
+		if (runSides == 0 || crossing.distance - runStart > MERGE_EPSILON * std::max(1.0f, crossing.distance)) {
+			runStart = crossing.distance;
+			runSides = 0;
+		}
+		int side = crossing.side > 0 ? 1 : 2;
+		if ((runSides & side) == 0) {
+			runSides |= side;
+			crossings[count++] = crossing;
+		}
+	}
+	crossings.resize(count);
+	return count;
+}
+
+/// <summary>
+/// Traverses like findAllIntersections without cutting off nodes, testing with the watertight test in any intersection mode:
+/// a ray through a shared edge hits at least one of the triangles.
+/// </summary>
+void KdTree::findCrossings(KdStructs::Node* node, const KdStructs::PreparedRay& prepared, float tNear, float tFar, std::vector<Crossing>& crossings, KdStructs::Mailbox& mailbox)
+{
+	const float EDGE_EPSILON = 0.00001f;
+
+	if (node == nullptr)
+		return;
+
+	for (KdStructs::Triangle* triangle : node->point->triangles) {
+		if (!mailbox.check(triangle->id))
+			continue;
+
+		float u, v;
+		float distance = rayIntersectionWithTriangleWatertight(triangle, prepared, u, v);
+		if (distance <= 0 || distance > prepared.maxDistance)
+			continue;
+
+		KdStructs::Vector normal = (triangle->b - triangle->a).cross(triangle->c - triangle->a);
+		float facing = normal[0] * prepared.direction[0] + normal[1] * prepared.direction[1] + normal[2] * prepared.direction[2];
+		Crossing crossing = { distance, facing > 0 ? 1 : -1, std::min({ u, v, 1 - u - v }) <= EDGE_EPSILON };
+		crossings.push_back(crossing);
+	}
+
+	float tLeft, tRight;
+	getChildPlaneDistances(node, prepared, tLeft, tRight);
+
+	bool leftFirst = prepared.sign[node->axis] == 0;
+	KdStructs::Node* near = leftFirst ? node->left : node->right;
+	KdStructs::Node* far = leftFirst ? node->right : node->left;
+
+	float nearEnd = std::min(tFar, leftFirst ? tLeft : tRight);
+	if (near != nullptr && tNear <= nearEnd)
+		findCrossings(near, prepared, tNear, nearEnd, crossings, mailbox);
+
+	float farStart = std::max(tNear, leftFirst ? tRight : tLeft);
+	if (far != nullptr && farStart <= tFar)
+		findCrossings(far, prepared, farStart, tFar, crossings, mailbox);
+}
+
+/// <summary>
+/// A query at the tile's center tells whether any voxel of it can be in the band. If so, every voxel is searched within the band,
+/// starting from the triangle closest to the previous voxel.
+/// </summary>
+void KdTree::bakeDistanceTile(const KdStructs::SdfGrid& grid, const unsigned int tile[3], float band, float* distances, KdStructs::Mailbox& mailbox)
+{
+	unsigned int begin[DIMENSIONS], end[DIMENSIONS];
+	KdStructs::Vector center(0, 0, 0);
+	float halfDiagonal = 0;
+	for (int axis = 0; axis < DIMENSIONS; axis++) {
+		begin[axis] = tile[axis] * KdStructs::SDF_TILE_SIZE;
+		end[axis] = std::min(begin[axis] + KdStructs::SDF_TILE_SIZE, grid.resolution[axis]);
+		center[axis] = grid.origin[axis] + (begin[axis] + end[axis] - 1) * 0.5f * grid.voxelSize;
+		float halfSize = (end[axis] - begin[axis] - 1) * 0.5f * grid.voxelSize;
+		halfDiagonal += halfSize * halfSize;
+	}
+
+	KdStructs::SurfacePoint nearest = closestPointFromHint(center, KdStructs::NO_ID, mailbox, std::sqrt(halfDiagonal) + band);
+	unsigned int hint = nearest.triangle;
+	for (unsigned int z = begin[2]; z < end[2]; z++)
+		for (unsigned int y = begin[1]; y < end[1]; y++)
+			for (unsigned int x = begin[0]; x < end[0]; x++)
+			{
+				size_t index = (static_cast<size_t>(z) * grid.resolution[1] + y) * grid.resolution[0] + x;
+				distances[index] = std::numeric_limits<float>::infinity();
+				if (!nearest.valid)
+					continue;
+
+				KdStructs::Vector position(grid.origin[0] + x * grid.voxelSize, grid.origin[1] + y * grid.voxelSize, grid.origin[2] + z * grid.voxelSize);
+				KdStructs::SurfacePoint point = closestPointFromHint(position, hint, mailbox, band);
+				if (point.valid) {
+					distances[index] = -point.distance;
+					hint = point.triangle;
+				}
+			}
+}
+
+/// <summary>
+/// Gauss-Seidel update of the first order upwind discretization of |grad d| = 1, visiting voxels in the order given by direction.
+/// All voxels with the same x + y + z (counted along the sweep) only depend on the previous plane, so each plane is updated in parallel.
+/// Band voxels (negative) are fixed.
+/// </summary>
+void KdTree::sweepDistances(const KdStructs::SdfGrid& grid, unsigned int direction, float* distances)
+{
+	ThreadPool* pool = getThreadPool();
+	const unsigned int* resolution = grid.resolution;
+	const float size = grid.voxelSize;
+	const size_t strides[DIMENSIONS] = { 1, resolution[0], static_cast<size_t>(resolution[0]) * resolution[1] };
+
+	auto update = [distances, resolution, size, &strides](const unsigned int voxel[3]) {
+		size_t index = voxel[0] * strides[0] + voxel[1] * strides[1] + voxel[2] * strides[2];
+		if (std::signbit(distances[index]))
+			return;
+
+		// Smallest neighbour distance along each axis, sorted.
+		float neighbours[DIMENSIONS];
+		for (int axis = 0; axis < DIMENSIONS; axis++) {
+			neighbours[axis] = std::numeric_limits<float>::infinity();
+			if (voxel[axis] > 0)
+				neighbours[axis] = std::abs(distances[index - strides[axis]]);
+			if (voxel[axis] + 1 < resolution[axis])
+				neighbours[axis] = std::min(neighbours[axis], std::abs(distances[index + strides[axis]]));
+		}
+		std::sort(neighbours, neighbours + DIMENSIONS);
+		float a = neighbours[0], b = neighbours[1], c = neighbours[2];
+		if (a == std::numeric_limits<float>::infinity())
+			return;
+
+		float distance = a + size;
+		if (distance > b) {
+			distance = 0.5f * (a + b + std::sqrt(std::max(0.0f, 2 * size * size - (a - b) * (a - b))));
+			if (distance > c) {
+				float sum = a + b + c;
+				distance = (sum + std::sqrt(std::max(0.0f, sum * sum - 3 * (a * a + b * b + c * c - size * size)))) / 3;
+			}
+		}
+		distances[index] = std::min(distances[index], distance);
+	};
+
+	unsigned int planeCount = resolution[0] + resolution[1] + resolution[2] - 2;
+	for (unsigned int plane = 0; plane < planeCount; plane++)
+	{
+		// Sweep coordinates (s0, s1, s2) with s0 + s1 + s2 = plane, parallel over s2.
+		unsigned int zBegin = plane > resolution[0] + resolution[1] - 2 ? plane - (resolution[0] + resolution[1] - 2) : 0;
+		unsigned int zEnd = std::min(plane, resolution[2] - 1) + 1;
+		pool->parallelFor(zEnd - zBegin, 4, [direction, resolution, plane, zBegin, &update](size_t begin, size_t end, unsigned int) {
+			for (size_t i = begin; i < end; i++) {
+				unsigned int s2 = zBegin + static_cast<unsigned int>(i);
+				unsigned int rest = plane - s2;
+				unsigned int yBegin = rest > resolution[0] - 1 ? rest - (resolution[0] - 1) : 0;
+				unsigned int yEnd = std::min(rest, resolution[1] - 1) + 1;
+				for (unsigned int s1 = yBegin; s1 < yEnd; s1++) {
+					unsigned int sweep[DIMENSIONS] = { rest - s1, s1, s2 };
+					unsigned int voxel[DIMENSIONS];
+					for (int axis = 0; axis < DIMENSIONS; axis++)
+						voxel[axis] = (direction >> axis) & 1 ? resolution[axis] - 1 - sweep[axis] : sweep[axis];
+					update(voxel);
+				}
+			}
+		});
+	}
+}
+
+/// <summary>
+/// Rows start outside the mesh bounds, so each voxel is inside if an odd number of crossings lies in front of it.
+/// </summary>
+void KdTree::voteInside(const KdStructs::SdfGrid& grid, int axis, std::vector<unsigned char>& votes)
+{
+	ThreadPool* pool = getThreadPool();
+	const unsigned int* resolution = grid.resolution;
+	const size_t strides[DIMENSIONS] = { 1, resolution[0], static_cast<size_t>(resolution[0]) * resolution[1] };
+	int first = (axis + 1) % DIMENSIONS;
+	int second = (axis + 2) % DIMENSIONS;
+
+	float start = std::min(grid.origin[axis], root->triangleMin[axis]) - grid.voxelSize;
+	float length = grid.origin[axis] + resolution[axis] * grid.voxelSize - start;
+	KdStructs::Vector direction(0, 0, 0);
+	direction[axis] = 1;
+
+	std::vector<std::vector<Crossing>> workerCrossings(pool->getThreadCount());
+	size_t rowCount = static_cast<size_t>(resolution[first]) * resolution[second];
+	pool->parallelFor(rowCount, 64, [this, &grid, axis, first, second, start, length, &direction, &strides, &votes, &workerCrossings](size_t begin, size_t end, unsigned int worker) {
+		std::vector<Crossing>& crossings = workerCrossings[worker];
+		for (size_t row = begin; row < end; row++)
+		{
+			unsigned int u = static_cast<unsigned int>(row % grid.resolution[first]);
+			unsigned int v = static_cast<unsigned int>(row / grid.resolution[first]);
+			KdStructs::Vector origin(0, 0, 0);
+			origin[axis] = start;
+			origin[first] = grid.origin[first] + u * grid.voxelSize;
+			origin[second] = grid.origin[second] + v * grid.voxelSize;
+			unsigned int count = countCrossings(origin, direction, length, crossings, workerMailboxes[worker]);
+
+			size_t base = u * strides[first] + v * strides[second];
+			unsigned int passed = 0;
+			for (unsigned int i = 0; i < grid.resolution[axis]; i++) {
+				float distance = grid.origin[axis] + i * grid.voxelSize - start;
+				while (passed < count && crossings[passed].distance < distance)
+					passed++;
+				if (passed % 2 == 1)
+					votes[base + i * strides[axis]]++;
+			}
+		}
+	});
+}
+
+/// <summary>
+/// Fixed unit directions, none close to an axis or to each other, so that axis aligned meshes don't line up edges with the rays.
+/// </summary>
+KdStructs::Vector KdTree::getContainmentDirection(unsigned int index)
+{
+	static const float directions[KdStructs::MAX_CONTAINMENT_DIRECTIONS][DIMENSIONS] = {
+		{ 0.8017f, 0.4527f, 0.3905f },
+		{ -0.3511f, 0.8749f, -0.3335f },
+		{ -0.4902f, -0.5127f, 0.7049f },
+		{ 0.2113f, -0.6219f, -0.7541f },
+		{ -0.8805f, 0.0867f, -0.4660f },
+		{ 0.1398f, 0.9016f, 0.4095f },
+		{ 0.5290f, -0.1543f, 0.8345f }
+	};
+	const float* direction = directions[index % KdStructs::MAX_CONTAINMENT_DIRECTIONS];
+	float length = std::sqrt(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+	return KdStructs::Vector(direction[0] / length, direction[1] / length, direction[2] / length);
+}
+
+void KdTree::intersectNode(KdStructs::Node* node, const KdStructs::Ray& ray, const KdStructs::PreparedRay& prepared, KdStructs::Hit& hit, KdStructs::Mailbox& mailbox)
+{
+	if (intersectionMode == KdStructs::IntersectionMode::SIMD) {
+		// Owned triangles are only tested at one node, no mailbox needed.
+		float distances[TriangleKernel::MAX_WIDTH], u[TriangleKernel::MAX_WIDTH], v[TriangleKernel::MAX_WIDTH];
+		for (unsigned int begin = node->ownedBegin; begin < node->ownedBegin + node->ownedCount; begin += TriangleKernel::MAX_WIDTH)
+		{
+			unsigned int count = std::min<unsigned int>(TriangleKernel::MAX_WIDTH, node->ownedBegin + node->ownedCount - begin);
+			TriangleKernel::intersect(isa, triangleSoA, begin, count, prepared.origin, prepared.direction, distances, u, v);
+			for (unsigned int i = 0; i < count; i++) {
+				if (distances[i] < 0 || distances[i] > prepared.maxDistance)
+					continue;
+				if (!hit.valid || distances[i] <= hit.distance) {
+					hit.triangle = ownedTriangleIds[begin + i];
+					hit.distance = distances[i];
+					hit.u = u[i];
+					hit.v = v[i];
+					hit.valid = true;
+				}
+			}
+		}
+		return;
+	}
+
+	for (KdStructs::Triangle* triangle : node->point->triangles) {
+		if (!mailbox.check(triangle->id))
+			continue;
+
+		float u, v;
+		float distance = intersectTriangle(triangle, ray, prepared, u, v);
+		if (distance < 0 || distance > prepared.maxDistance)
+			continue;
+
+		if (!hit.valid || distance <= hit.distance) {
+			hit.triangle = triangle->id;
+			hit.distance = distance;
+			hit.u = u;
+			hit.v = v;
+			hit.valid = true;
+		}
+	}
+}
+
+void KdTree::setIntersectionMode(KdStructs::IntersectionMode mode)
+{
+	if (mode == KdStructs::IntersectionMode::SIMD && triangleSoA.count == 0)
+		buildTriangleSoA();
+	if (mode == KdStructs::IntersectionMode::PROJECTION && projectedTriangles.empty()) {
+		projectedTriangles.reserve(triangles.size());
+		for (KdStructs::Triangle* triangle : triangles)
+			projectedTriangles.push_back(KdStructs::ProjectedTriangle(*triangle));
+	}
+	intersectionMode = mode;
+}
+
+/// <summary>
+/// Hands every triangle to the first node (in depth-first order) of one of its vertices
+/// and stores the triangles of each node next to each other.
+/// Node bounds already contain all triangles connected to the node, so traversal stays exact.
+/// </summary>
+void KdTree::buildTriangleSoA()
+{
+	if (ownedTriangleIds.empty())
+		buildOwnedTriangles();
+
+	triangleSoA.resize(ownedTriangleIds.size());
+	for (size_t i = 0; i < ownedTriangleIds.size(); i++)
+		triangleSoA.set(i, *triangles[ownedTriangleIds[i]]);
+}
+
+void KdTree::buildOwnedTriangles()
+{
+	std::vector<bool> owned(triangles.size(), false);
+	ownedTriangleIds.clear();
+	ownedTriangleIds.reserve(triangles.size());
+	assignOwnedTriangles(root, owned);
+}
+
+void KdTree::assignOwnedTriangles(KdStructs::Node* node, std::vector<bool>& owned)
+{
+	if (node == nullptr)
+		return;
+
+	node->ownedBegin = ownedTriangleIds.size();
+	for (KdStructs::Triangle* triangle : node->point->triangles) {
+		if (owned[triangle->id])
+			continue;
+		owned[triangle->id] = true;
+		ownedTriangleIds.push_back(triangle->id);
+	}
+	node->ownedCount = ownedTriangleIds.size() - node->ownedBegin;
+
+	assignOwnedTriangles(node->left, owned);
+	assignOwnedTriangles(node->right, owned);
+	node->ownedEnd = ownedTriangleIds.size();
+}
+
+/// <summary>
+/// Traverses like findIntersection, but returns as soon as any triangle closer than maxDistance is hit.
+/// </summary>
+bool KdTree::findOcclusion(KdStructs::Node* node, const KdStructs::Ray& ray, const KdStructs::PreparedRay& prepared, float tNear, float tFar, KdStructs::Mailbox& mailbox)
+{
+	if (node == nullptr)
+		return false;
+
+	// Check current node.
+	for (KdStructs::Triangle* triangle : node->point->triangles) {
+		if (!mailbox.check(triangle->id))
+			continue;
+
+		float u, v;
+		float distance = intersectTriangle(triangle, ray, prepared, u, v);
+		if (distance >= 0 && distance < prepared.maxDistance)
+			return true;
+	}
+
+	float tLeft, tRight;
+	getChildPlaneDistances(node, prepared, tLeft, tRight);
+
+	bool leftFirst = prepared.sign[node->axis] == 0;
+	KdStructs::Node* near = leftFirst ? node->left : node->right;
+	KdStructs::Node* far = leftFirst ? node->right : node->left;
+
+	float nearEnd = std::min(tFar, leftFirst ? tLeft : tRight);
+	if (near != nullptr && tNear <= nearEnd && findOcclusion(near, ray, prepared, tNear, nearEnd, mailbox))
+		return true;
+
+	float farStart = std::max(tNear, leftFirst ? tRight : tLeft);
+	return far != nullptr && farStart <= tFar && findOcclusion(far, ray, prepared, farStart, tFar, mailbox);
+}
+
+unsigned int KdTree::createRopeCell(KdStructs::Node* node, const float min[3], const float max[3])
+{
+	unsigned int index = ropeCells.size();
+	ropeCells.push_back(KdStructs::RopeCell(min, max));
+
+	// Nodes without children and missing children are leaves.
+	if (node == nullptr || (node->left == nullptr && node->right == nullptr))
+		return index;
+
+	int axis = node->axis;
+	float split = node->point->pos[axis];
+	float childMax[DIMENSIONS] = { max[0], max[1], max[2] };
+	float childMin[DIMENSIONS] = { min[0], min[1], min[2] };
+	childMax[axis] = split;
+	childMin[axis] = split;
+
+	unsigned int left = createRopeCell(node->left, min, childMax);
+	unsigned int right = createRopeCell(node->right, childMin, max);
+
+	KdStructs::RopeCell& cell = ropeCells[index];
+	cell.axis = axis;
+	cell.split = split;
+	cell.children[0] = left;
+	cell.children[1] = right;
+	return index;
+}
+
+void KdTree::linkRopes(unsigned int cellIndex, const unsigned int ropes[6])
+{
+	KdStructs::RopeCell& cell = ropeCells[cellIndex];
+
+	if (!cell.isLeaf()) {
+		// Children are each other's neighbour across the splitting plane.
+		unsigned int leftRopes[6], rightRopes[6];
+		std::copy(ropes, ropes + 6, leftRopes);
+		std::copy(ropes, ropes + 6, rightRopes);
+		leftRopes[cell.axis * 2 + 1] = cell.children[1];
+		rightRopes[cell.axis * 2] = cell.children[0];
+
+		unsigned int left = cell.children[0];
+		unsigned int right = cell.children[1];
+		linkRopes(left, leftRopes);
+		linkRopes(right, rightRopes);
+		return;
+	}
+
+	for (int face = 0; face < 6; face++)
+	{
+		int faceAxis = face / 2;
+		bool maxFace = face % 2 == 1;
+		unsigned int rope = ropes[face];
+
+		// Push the rope down to the smallest cell still containing the whole face.
+		while (rope != KdStructs::NO_ID && !ropeCells[rope].isLeaf())
+		{
+			const KdStructs::RopeCell& neighbour = ropeCells[rope];
+			if (neighbour.axis == faceAxis)
+				rope = neighbour.children[maxFace ? 0 : 1];
+			else if (neighbour.split >= cell.max[neighbour.axis])
+				rope = neighbour.children[0];
+			else if (neighbour.split <= cell.min[neighbour.axis])
+				rope = neighbour.children[1];
+			else
+				break;
+		}
+		cell.ropes[face] = rope;
+	}
+}
+
+void KdTree::addRopeTriangle(unsigned int cellIndex, KdStructs::Triangle* triangle, const float min[3], const float max[3], std::vector<std::vector<unsigned int>>& leafTriangles)
+{
+	const KdStructs::RopeCell& cell = ropeCells[cellIndex];
+	if (cell.isLeaf()) {
+		leafTriangles[cellIndex].push_back(triangle->id);
+		return;
+	}
+
+	if (min[cell.axis] <= cell.split)
+		addRopeTriangle(cell.children[0], triangle, min, max, leafTriangles);
+	if (max[cell.axis] >= cell.split)
+		addRopeTriangle(cell.children[1], triangle, min, max, leafTriangles);
+}
+
+unsigned int KdTree::findRopeLeaf(unsigned int cellIndex, const KdStructs::PreparedRay& ray, float t)
+{
+	while (!ropeCells[cellIndex].isLeaf())
+	{
+		const KdStructs::RopeCell& cell = ropeCells[cellIndex];
+		int axis = cell.axis;
+		bool right;
+		if (ray.direction[axis] == 0.0f) {
+			right = ray.origin[axis] > cell.split;
+		}
+		else {
+			// Compared by distance instead of position: a leaf's exit distance is computed the same way,
+			// so a ray leaving through a splitting plane always ends up on the other side of it.
+			float tSplit = (cell.split - ray.origin[axis]) * ray.inverseDirection[axis];
+			right = ray.sign[axis] == 0 ? t >= tSplit : t < tSplit;
+		}
+		cellIndex = cell.children[right ? 1 : 0];
+	}
+	return cellIndex;
+}
+
+/// <summary>
+/// 1. Find the leaf containing the ray's entry point
+/// 2. Test the leaf's triangles
+/// 3. Stop if the closest hit lies within the leaf (or the ray ends)
+/// 4. Otherwise follow the rope of the face the ray leaves through and continue at 1. from there
+/// </summary>
+void KdTree::traceRayStackless(const KdStructs::Ray& ray, KdStructs::Hit& hit, KdStructs::Mailbox& mailbox)
+{
+	KdStructs::PreparedRay prepared(ray);
+	float tNear, tFar;
+	if (!clipToBounds(prepared, tNear, tFar))
+		return;
+
+	mailbox.next();
+	unsigned int cellIndex = findRopeLeaf(0, prepared, tNear);
+	while (true)
+	{
+		const KdStructs::RopeCell& cell = ropeCells[cellIndex];
+
+		for (unsigned int i = cell.triangleBegin; i < cell.triangleBegin + cell.triangleCount; i++) {
+			KdStructs::Triangle* triangle = triangles[ropeTriangles[i]];
+			if (!mailbox.check(triangle->id))
+				continue;
+
+			float u, v;
+			float distance = intersectTriangle(triangle, ray, prepared, u, v);
+			if (distance < 0 || distance > prepared.maxDistance)
+				continue;
+
+			if (!hit.valid || distance <= hit.distance) {
+				hit.triangle = triangle->id;
+				hit.distance = distance;
+				hit.u = u;
+				hit.v = v;
+				hit.valid = true;
+			}
+		}
+
+		// Face through which the ray leaves the leaf.
+		float tExit = std::numeric_limits<float>::infinity();
+		int exitFace = -1;
+		for (int axis = 0; axis < DIMENSIONS; axis++)
+		{
+			if (prepared.direction[axis] == 0.0f)
+				continue;
+			float bound = prepared.sign[axis] ? cell.min[axis] : cell.max[axis];
+			float t = (bound - prepared.origin[axis]) * prepared.inverseDirection[axis];
+			if (t < tExit) {
+				tExit = t;
+				exitFace = axis * 2 + (prepared.sign[axis] ? 0 : 1);
+			}
+		}
+
+		if ((hit.valid && hit.distance <= tExit) || tExit >= tFar || exitFace < 0)
+			return;
+
+		unsigned int next = cell.ropes[exitFace];
+		if (next == KdStructs::NO_ID)
+			return;
+		cellIndex = findRopeLeaf(next, prepared, tExit);
+	}
+}
+
+/// <summary>
+/// Distances along the ray to the end of the left child's bounds (tLeft) and the start of the right child's (tRight),
+/// along the node's splitting axis.
+/// For rays parallel to the axis these are +-infinity, depending on whether the ray lies inside the child's bounds.
+/// </summary>
+void KdTree::getChildPlaneDistances(KdStructs::Node* node, const KdStructs::PreparedRay& ray, float& tLeft, float& tRight)
+{
+	const float INFINITE = std::numeric_limits<float>::infinity();
+	int axis = node->axis;
+	float leftMax = node->left != nullptr ? node->left->triangleMax[axis] : -INFINITE;
+	float rightMin = node->right != nullptr ? node->right->triangleMin[axis] : INFINITE;
+	float origin = ray.origin[axis];
+
+	if (ray.direction[axis] == 0.0f) {
+		tLeft = origin <= leftMax ? INFINITE : -INFINITE;
+		tRight = origin >= rightMin ? -INFINITE : INFINITE;
+		return;
+	}
+
+	tLeft = (leftMax - origin) * ray.inverseDirection[axis];
+	tRight = (rightMin - origin) * ray.inverseDirection[axis];
+}
+
+/// <summary>
+/// Sort key: direction octant, then Morton code of the origin (within the tree's bounds),
+/// then Morton code of the quantized direction.
+/// Rays next to each other in this order visit similar nodes and can often be traced as packet.
+/// </summary>
+std::vector<unsigned int> KdTree::getRayOrder(const KdStructs::Ray* rays, size_t count)
+{
+	const int ORIGIN_BITS = 15;
+	const int DIRECTION_BITS = 5;
+
+	std::vector<std::pair<uint64_t, unsigned int>> keys(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		const KdStructs::Ray& ray = rays[i];
+
+		uint64_t octant = 0;
+		uint32_t origin[DIMENSIONS];
+		uint32_t direction[DIMENSIONS];
+		float length = std::sqrt(ray.direction.dot(ray.direction));
+		for (int axis = 0; axis < DIMENSIONS; axis++)
+		{
+			if (ray.direction[axis] < 0)
+				octant |= 1ull << axis;
+			origin[axis] = Morton::quantize(ray.origin[axis], root->min[axis], root->max[axis] - root->min[axis], ORIGIN_BITS);
+			direction[axis] = Morton::quantize(length > 0 ? ray.direction[axis] / length : 0, -1, 2, DIRECTION_BITS);
+		}
+
+		uint64_t key = octant << (3 * (ORIGIN_BITS + DIRECTION_BITS));
+		key |= Morton::encode(origin[0], origin[1], origin[2]) << (3 * DIRECTION_BITS);
+		key |= Morton::encode(direction[0], direction[1], direction[2]);
+		keys[i] = std::make_pair(key, static_cast<unsigned int>(i));
+	}
+
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<unsigned int> order(count);
+	for (size_t i = 0; i < count; i++)
+		order[i] = keys[i].second;
+	return order;
+}
+
+/// <summary>
+/// Morton order of the query points within the tree's bounds.
+/// </summary>
+std::vector<unsigned int> KdTree::getPointOrder(const KdStructs::Vector* queries, size_t count)
+{
+	const int BITS = 21;
+
+	std::vector<std::pair<uint64_t, unsigned int>> keys(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		uint32_t position[DIMENSIONS];
+		for (int axis = 0; axis < DIMENSIONS; axis++)
+			position[axis] = Morton::quantize(queries[i][axis], root->min[axis], root->max[axis] - root->min[axis], BITS);
+		keys[i] = std::make_pair(Morton::encode(position[0], position[1], position[2]), static_cast<unsigned int>(i));
+	}
+
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<unsigned int> order(count);
+	for (size_t i = 0; i < count; i++)
+		order[i] = keys[i].second;
+	return order;
+}
+
+int KdTree::raycastPacket(const KdStructs::Ray* rays, KdStructs::RayHit** hits, KdStructs::Mailbox& mailbox)
+{
+	int hitCount = 0;
+#ifdef KD_SSE
+	if (KdStructs::RayPacket::isCoherent(rays)) {
+		KdStructs::RayPacket packet(rays);
+		__m128 tNear, tFar;
+		int mask = clipPacketToBounds(packet, tNear, tFar);
+		mailbox.next();
+		findIntersectionPacket(root, packet, tNear, tFar, mask, mailbox);
+
+		float hitDistances[KdStructs::PACKET_SIZE];
+		_mm_storeu_ps(hitDistances, packet.hitDistance);
+		for (int i = 0; i < KdStructs::PACKET_SIZE; i++) {
+			hits[i] = nullptr;
+			if (packet.hitTriangles[i] == nullptr)
+				continue;
+			hits[i] = new KdStructs::RayHit(packet.hitTriangles[i], rays[i].origin + rays[i].direction * hitDistances[i], hitDistances[i]);
+			hitCount++;
+		}
+		return hitCount;
+	}
+#endif
+	// Incoherent rays are traced one by one.
+	for (int i = 0; i < KdStructs::PACKET_SIZE; i++) {
+		KdStructs::Hit hit;
+		traceRay(rays[i], hit, mailbox);
+		hits[i] = nullptr;
+		storeRayHit(rays[i], hit, hits[i]);
+		if (hit.valid)
+			hitCount++;
+	}
+	return hitCount;
+}
+
+#ifdef KD_SSE
+int KdTree::clipPacketToBounds(const KdStructs::RayPacket& packet, __m128& tNear, __m128& tFar)
+{
+	const __m128 zero = _mm_setzero_ps();
+	tNear = zero;
+	tFar = packet.distance;
+	__m128 valid = _mm_castsi128_ps(_mm_set1_epi32(-1));
+	for (int axis = 0; axis < DIMENSIONS; axis++)
+	{
+		__m128 min = _mm_set1_ps(root->triangleMin[axis]);
+		__m128 max = _mm_set1_ps(root->triangleMax[axis]);
+		__m128 origin = packet.origin[axis];
+		__m128 parallel = _mm_cmpeq_ps(packet.direction[axis], zero);
+		__m128 negative = _mm_cmplt_ps(packet.direction[axis], zero);
+
+		// Parallel lanes have to lie within the slab.
+		__m128 outside = _mm_or_ps(_mm_cmplt_ps(origin, min), _mm_cmpgt_ps(origin, max));
+		valid = _mm_andnot_ps(_mm_and_ps(parallel, outside), valid);
+
+		__m128 entry = _mm_or_ps(_mm_and_ps(negative, max), _mm_andnot_ps(negative, min));
+		__m128 exit = _mm_or_ps(_mm_and_ps(negative, min), _mm_andnot_ps(negative, max));
+		__m128 tEntry = _mm_mul_ps(_mm_sub_ps(entry, origin), packet.inverseDirection[axis]);
+		__m128 tExit = _mm_mul_ps(_mm_sub_ps(exit, origin), packet.inverseDirection[axis]);
+
+		__m128 closer = _mm_andnot_ps(parallel, _mm_cmpgt_ps(tEntry, tNear));
+		tNear = _mm_or_ps(_mm_and_ps(closer, tEntry), _mm_andnot_ps(closer, tNear));
+		__m128 farther = _mm_andnot_ps(parallel, _mm_cmplt_ps(tExit, tFar));
+		tFar = _mm_or_ps(_mm_and_ps(farther, tExit), _mm_andnot_ps(farther, tFar));
+	}
+	valid = _mm_and_ps(valid, _mm_cmple_ps(tNear, tFar));
+	return _mm_movemask_ps(valid);
+}
+
+/// <summary>
+/// Same traversal as findIntersection for up to four rays at once.
+/// mask holds the rays (lanes) which still need to visit this node, [tNear, tFar] their intervals.
+/// A child is visited by the lanes whose interval reaches it.
+/// </summary>
+void KdTree::findIntersectionPacket(KdStructs::Node* node, KdStructs::RayPacket& packet, __m128 tNear, __m128 tFar, int mask, KdStructs::Mailbox& mailbox)
+{
+	if (node == nullptr || mask == 0)
+		return;
+
+	// Check current node.
+	for (KdStructs::Triangle* triangle : node->point->triangles) {
+		int untested = mailbox.checkLanes(triangle->id, mask);
+		if (untested != 0)
+			rayPacketIntersectionWithTriangle(triangle, packet, untested);
+	}
+
+	const float INFINITE = std::numeric_limits<float>::infinity();
+	int axis = node->axis;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 infinite = _mm_set1_ps(INFINITE);
+	const __m128 negativeInfinite = _mm_set1_ps(-INFINITE);
+	__m128 leftMax = _mm_set1_ps(node->left != nullptr ? node->left->triangleMax[axis] : -INFINITE);
+	__m128 rightMin = _mm_set1_ps(node->right != nullptr ? node->right->triangleMin[axis] : INFINITE);
+	__m128 origin = packet.origin[axis];
+	__m128 direction = packet.direction[axis];
+
+	// See getChildPlaneDistances.
+	__m128 parallel = _mm_cmpeq_ps(direction, zero);
+	__m128 tLeft = _mm_mul_ps(_mm_sub_ps(leftMax, origin), packet.inverseDirection[axis]);
+	__m128 tRight = _mm_mul_ps(_mm_sub_ps(rightMin, origin), packet.inverseDirection[axis]);
+	__m128 insideLeft = _mm_cmple_ps(origin, leftMax);
+	__m128 insideRight = _mm_cmpge_ps(origin, rightMin);
+	__m128 parallelLeft = _mm_or_ps(_mm_and_ps(insideLeft, infinite), _mm_andnot_ps(insideLeft, negativeInfinite));
+	__m128 parallelRight = _mm_or_ps(_mm_and_ps(insideRight, negativeInfinite), _mm_andnot_ps(insideRight, infinite));
+	tLeft = _mm_or_ps(_mm_and_ps(parallel, parallelLeft), _mm_andnot_ps(parallel, tLeft));
+	tRight = _mm_or_ps(_mm_and_ps(parallel, parallelRight), _mm_andnot_ps(parallel, tRight));
+
+	// Lanes moving towards lower coordinates visit the right node first.
+	int rightFirst = _mm_movemask_ps(_mm_cmplt_ps(direction, zero)) & mask;
+
+	// Lanes disagreeing on the near node split up here.
+	int groups[2] = { mask & ~rightFirst, rightFirst };
+	for (int group : groups)
+	{
+		if (group == 0)
+			continue;
+
+		bool leftFirst = group != rightFirst;
+		KdStructs::Node* near = leftFirst ? node->left : node->right;
+		KdStructs::Node* far = leftFirst ? node->right : node->left;
+		__m128 tNearExit = leftFirst ? tLeft : tRight;
+		__m128 tFarEntry = leftFirst ? tRight : tLeft;
+
+		__m128 nearEnd = _mm_min_ps(_mm_min_ps(tFar, packet.hitDistance), tNearExit);
+		int nearMask = _mm_movemask_ps(_mm_cmple_ps(tNear, nearEnd)) & group;
+		if (near != nullptr)
+			findIntersectionPacket(near, packet, tNear, nearEnd, nearMask, mailbox);
+
+		__m128 farStart = _mm_max_ps(tNear, tFarEntry);
+		__m128 farEnd = _mm_min_ps(tFar, packet.hitDistance);
+		int farMask = _mm_movemask_ps(_mm_cmple_ps(farStart, farEnd)) & group;
+		if (far != nullptr)
+			findIntersectionPacket(far, packet, farStart, farEnd, farMask, mailbox);
+	}
+}
+
+/// <summary>
+/// Mller-Trumbore for one triangle and all lanes in mask, closer hits are written into the packet.
+/// Same operations as rayIntersectionWithTriangle.
+/// </summary>
+void KdTree::rayPacketIntersectionWithTriangle(KdStructs::Triangle* triangle, KdStructs::RayPacket& packet, int mask)
+{
+	const __m128 epsilon = _mm_set1_ps(0.0000001f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	const KdStructs::Vector& v1 = triangle->a;
+	const KdStructs::Vector& v2 = triangle->b;
+	const KdStructs::Vector& v3 = triangle->c;
+	__m128 e1[3] = { _mm_set1_ps(v2[0] - v1[0]), _mm_set1_ps(v2[1] - v1[1]), _mm_set1_ps(v2[2] - v1[2]) };
+	__m128 e2[3] = { _mm_set1_ps(v3[0] - v1[0]), _mm_set1_ps(v3[1] - v1[1]), _mm_set1_ps(v3[2] - v1[2]) };
+	const __m128* d = packet.direction;
+
+	// h = direction x edge2
+	__m128 h[3] = {
+		_mm_sub_ps(_mm_mul_ps(d[1], e2[2]), _mm_mul_ps(d[2], e2[1])),
+		_mm_sub_ps(_mm_mul_ps(d[2], e2[0]), _mm_mul_ps(d[0], e2[2])),
+		_mm_sub_ps(_mm_mul_ps(d[0], e2[1]), _mm_mul_ps(d[1], e2[0]))
+	};
+	__m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], h[0]), _mm_mul_ps(e1[1], h[1])), _mm_mul_ps(e1[2], h[2]));
+
+	// Rays parallel to this triangle.
+	__m128 valid = _mm_or_ps(_mm_cmple_ps(a, _mm_sub_ps(zero, epsilon)), _mm_cmpge_ps(a, epsilon));
+
+	__m128 f = _mm_div_ps(one, a);
+	__m128 s[3] = {
+		_mm_sub_ps(packet.origin[0], _mm_set1_ps(v1[0])),
+		_mm_sub_ps(packet.origin[1], _mm_set1_ps(v1[1])),
+		_mm_sub_ps(packet.origin[2], _mm_set1_ps(v1[2]))
+	};
+	__m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(s[0], h[0]), _mm_mul_ps(s[1], h[1])), _mm_mul_ps(s[2], h[2])));
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+	// q = s x edge1
+	__m128 q[3] = {
+		_mm_sub_ps(_mm_mul_ps(s[1], e1[2]), _mm_mul_ps(s[2], e1[1])),
+		_mm_sub_ps(_mm_mul_ps(s[2], e1[0]), _mm_mul_ps(s[0], e1[2])),
+		_mm_sub_ps(_mm_mul_ps(s[0], e1[1]), _mm_mul_ps(s[1], e1[0]))
+	};
+	__m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], q[0]), _mm_mul_ps(d[1], q[1])), _mm_mul_ps(d[2], q[2])));
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+	__m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2[0], q[0]), _mm_mul_ps(e2[1], q[1])), _mm_mul_ps(e2[2], q[2])));
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, epsilon), _mm_cmple_ps(t, packet.distance)));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(t, packet.hitDistance));
+
+	int hitMask = _mm_movemask_ps(valid) & mask;
+	if (hitMask == 0)
+		return;
+
+	__m128 hitLanes = _mm_castsi128_ps(_mm_setr_epi32(hitMask & 1 ? -1 : 0, hitMask & 2 ? -1 : 0, hitMask & 4 ? -1 : 0, hitMask & 8 ? -1 : 0));
+	packet.hitDistance = _mm_or_ps(_mm_and_ps(hitLanes, t), _mm_andnot_ps(hitLanes, packet.hitDistance));
+	for (int i = 0; i < KdStructs::PACKET_SIZE; i++)
+		if (hitMask & (1 << i))
+			packet.hitTriangles[i] = triangle;
+}
+#endif
+
+/// <summary>
+/// MllerTrumbore intersection algorithm
+/// https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
+/// </summary>
+void KdTree::storeRayHit(const KdStructs::Ray& ray, const KdStructs::Hit& result, KdStructs::RayHit*& hit)
+{
+	if (!result.valid)
+		return;
+
+	KdStructs::Triangle* triangle = triangles[result.triangle];
+	if (hit == nullptr)
+		hit = new KdStructs::RayHit(triangle, result.getPosition(ray), result.distance);
+	else if (result.distance <= hit->distance) {
+		hit->triangle = triangle;
+		hit->position = result.getPosition(ray);
+		hit->distance = result.distance;
+	}
+}
+
+float KdTree::intersectTriangle(KdStructs::Triangle* triangle, const KdStructs::Ray& ray, const KdStructs::PreparedRay& prepared, float& u, float& v)
+{
+	if (intersectionMode == KdStructs::IntersectionMode::WATERTIGHT)
+		return rayIntersectionWithTriangleWatertight(triangle, prepared, u, v);
+	if (intersectionMode == KdStructs::IntersectionMode::PROJECTION)
+		return rayIntersectionWithTriangleProjected(projectedTriangles[triangle->id], prepared, u, v);
+	return rayIntersectionWithTriangle(triangle, ray, u, v);
+}
+
+/// <summary>
+/// Projection test (Wald 2004): distance to the triangle's plane, then two 2D edge functions of the hit point
+/// projected along the dominant normal axis. No cross products per ray.
+/// </summary>
+float KdTree::rayIntersectionWithTriangleProjected(const KdStructs::ProjectedTriangle& triangle, const KdStructs::PreparedRay& ray, float& u, float& v)
+{
+	const float EPSILON = 0.0000001;
+
+	int k = triangle.k;
+	if (k < 0)
+		return -1;
+	int ku = (k + 1) % 3;
+	int kv = (k + 2) % 3;
+
+	// Distance to the plane, infinite or NaN for parallel rays.
+	float denominator = ray.direction[k] + triangle.normalU * ray.direction[ku] + triangle.normalV * ray.direction[kv];
+	float t = (triangle.distance - ray.origin[k] - triangle.normalU * ray.origin[ku] - triangle.normalV * ray.origin[kv]) / denominator;
+	if (!(t > EPSILON && t <= ray.maxDistance))
+		return -1;
+
+	float hitU = ray.origin[ku] + t * ray.direction[ku];
+	float hitV = ray.origin[kv] + t * ray.direction[kv];
+
+	u = hitU * triangle.betaU + hitV * triangle.betaV + triangle.betaD;
+	if (u < 0)
+		return -1;
+	v = hitU * triangle.gammaU + hitV * triangle.gammaV + triangle.gammaD;
+	if (v < 0 || u + v > 1)
+		return -1;
+	return t;
+}
+
+/// <summary>
+/// Watertight ray/triangle intersection (Woop, Benthin, Wald 2013).
+/// The vertices are moved into a space where the ray starts at the origin and runs along +z,
+/// using the ray's precomputed permutation and shear. Then the edge functions U, V, W tell on which side
+/// of each edge the ray passes. Edges shared by two triangles give exactly opposite values in both,
+/// so a ray can't slip through between them. Ties (0) are recomputed in double precision.
+/// </summary>
+float KdTree::rayIntersectionWithTriangleWatertight(KdStructs::Triangle* triangle, const KdStructs::PreparedRay& ray, float& u, float& v)
+{
+	const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+
+	// Vertices relative to the ray origin.
+	float a[3], b[3], c[3];
+	for (int axis = 0; axis < DIMENSIONS; axis++) {
+		a[axis] = triangle->a[axis] - ray.origin[axis];
+		b[axis] = triangle->b[axis] - ray.origin[axis];
+		c[axis] = triangle->c[axis] - ray.origin[axis];
+	}
+
+	// Shear and scale of the vertices.
+	float ax = a[kx] - ray.shearX * a[kz];
+	float ay = a[ky] - ray.shearY * a[kz];
+	float bx = b[kx] - ray.shearX * b[kz];
+	float by = b[ky] - ray.shearY * b[kz];
+	float cx = c[kx] - ray.shearX * c[kz];
+	float cy = c[ky] - ray.shearY * c[kz];
+
+	// Scaled barycentric coordinates.
+	float edgeU = cx * by - cy * bx;
+	float edgeV = ax * cy - ay * cx;
+	float edgeW = bx * ay - by * ax;
+
+	if (edgeU == 0.0f || edgeV == 0.0f || edgeW == 0.0f) {
+		edgeU = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+		edgeV = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+		edgeW = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+	}
+
+	// Edge tests, no backface culling.
+	if ((edgeU < 0 || edgeV < 0 || edgeW < 0) && (edgeU > 0 || edgeV > 0 || edgeW > 0))
+		return -1;
+
+	float determinant = edgeU + edgeV + edgeW;
+	if (determinant == 0.0f)
+		return -1;
+
+	// Scaled hit distance.
+	float az = ray.shearZ * a[kz];
+	float bz = ray.shearZ * b[kz];
+	float cz = ray.shearZ * c[kz];
+	float t = edgeU * az + edgeV * bz + edgeW * cz;
+
+	// Behind the origin (t and determinant have different signs).
+	if ((determinant < 0) != (t < 0) || t == 0.0f)
+		return -1;
+
+	float inverseDeterminant = 1.0f / determinant;
+	// U weighs vertex a, V vertex b and W vertex c.
+	u = edgeV * inverseDeterminant;
+	v = edgeW * inverseDeterminant;
+	return t * inverseDeterminant;
+}
+
+float KdTree::rayIntersectionWithTriangle(KdStructs::Triangle* triangle, const KdStructs::Ray& ray)
+{
+	float u, v;
+	return rayIntersectionWithTriangle(triangle, ray, u, v);
+}
+
+float KdTree::rayIntersectionWithTriangle(KdStructs::Triangle* triangle, const KdStructs::Ray& ray, float& u, float& v)
 {
 	const float EPSILON = 0.0000001;
 
@@ -353,13 +3199,13 @@ float KdTree::rayIntersectionWithTriangle(KdStructs::Triangle* triangle, KdStruc
 
 	float f = 1.0f / a;
 	KdStructs::Vector s = ray.origin - v1;
-	float u = f * s.dot(h);
+	u = f * s.dot(h);
 
 	if (u < 0 || u > 1)
 		return -1;
 
 	KdStructs::Vector q = s.cross(edge1);
-	float v = f * ray.direction.dot(q);
+	v = f * ray.direction.dot(q);
 
 	if (v < 0 || u + v > 1)
 		return -1;
@@ -1,8 +1,14 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
+#include <limits>
+#include <functional>
 
 #include "Structures.h"
+#include "RayPacket.h"
+#include "ThreadPool.h"
+#include "TriangleKernel.h"
 
 constexpr int DIMENSIONS = 3;
 
@@ -15,6 +21,190 @@ public:
 	~KdTree();
 
 	void raycast(KdStructs::Ray ray, KdStructs::RayHit*& hit);
+	/// <summary>
+	/// Closest hit along the ray, returned by value. Does not allocate.
+	/// </summary>
+	KdStructs::Hit raycast(const KdStructs::Ray& ray);
+	/// <summary>
+	/// raycast that also interpolates the hit triangle's vertex normals and texture coordinates
+	/// with the barycentric coordinates of the hit.
+	/// </summary>
+	KdStructs::Hit raycast(const KdStructs::Ray& ray, KdStructs::HitAttributes& attributes);
+	/// <summary>
+	/// Keeps a copy of the normals (3 floats) and texture coordinates (2 floats) per vertex,
+	/// indexed like the vertices the tree was built from. Either may be nullptr.
+	/// </summary>
+	void setVertexAttributes(const float* normals, const float* uvs, unsigned int vertexCount);
+	/// <summary>
+	/// Casts all rays in parallel, hits[i] receives the result of rays[i] (nullptr if nothing was hit).
+	/// The caller owns the returned hits. With BatchOptions::attributes, each hit also gets the interpolated vertex attributes.
+	/// </summary>
+	KdStructs::BatchStatistics raycastBatch(const KdStructs::Ray* rays, size_t count, KdStructs::RayHit** hits, const KdStructs::BatchOptions& options = KdStructs::BatchOptions());
+	/// <summary>
+	/// Any-hit query: true if a triangle lies on the ray closer than maxDistance.
+	/// Stops at the first intersection found.
+	/// </summary>
+	bool occluded(const KdStructs::Ray& ray, float maxDistance);
+	/// <summary>
+	/// occluded() for all rays in parallel, using each ray's distance as maxDistance.
+	/// Bit i % 64 of occludedMask[i / 64] is set if rays[i] is occluded. occludedMask needs (count + 63) / 64 words.
+	/// </summary>
+	KdStructs::BatchStatistics occludedBatch(const KdStructs::Ray* rays, size_t count, uint64_t* occludedMask, const KdStructs::BatchOptions& options = KdStructs::BatchOptions());
+	/// <summary>
+	/// Multi-hit query: every triangle the ray crosses with tMin <= distance <= tMax (and within the ray's distance),
+	/// collected in a single traversal. Writes the closest maxHits of them to hits, sorted by distance,
+	/// and returns how many were written. Each triangle is reported once.
+	/// </summary>
+	size_t raycastAll(const KdStructs::Ray& ray, float tMin, float tMax, KdStructs::Hit* hits, size_t maxHits);
+	/// <summary>
+	/// True if point lies inside the mesh, which has to be closed and consistently oriented.
+	/// Counts the crossings of a ray in each direction in one traversal each, the majority of odd counts decides.
+	/// Hits on edges and vertices shared by several triangles count once (per side the triangles face).
+	/// </summary>
+	bool contains(const KdStructs::Vector& point, unsigned int directions = 1);
+	/// <summary>
+	/// contains() for every point in parallel, inside[i] receives the result of points[i]. Hit count is the number of points inside.
+	/// Points are processed in Morton order and grouped (see ContainmentOptions::groupSize): only the first point of a group casts
+	/// full rays, the others flip its answer for every crossing on the short segment to it. With several directions, each direction's answer
+	/// is carried to the other points along a separate two-segment path, and they vote as in contains().
+	/// </summary>
+	KdStructs::BatchStatistics containsBatch(const KdStructs::Vector* points, size_t count, bool* inside,
+		const KdStructs::BatchOptions& options = KdStructs::BatchOptions(), const KdStructs::ContainmentOptions& containment = KdStructs::ContainmentOptions());
+	/// <summary>
+	/// Signed distance of every voxel of grid to the surface, negative inside (the mesh has to be closed, see contains). distances needs grid.getVoxelCount() floats.
+	/// 1. Tiles of voxels in parallel: exact closest point distances in the narrow band, each query starting from the previous one's triangle.
+	///    Tiles further from the surface than the band are skipped with a single query.
+	/// 2. Fast sweeping fills in the rest, solving the eikonal equation outward from the band. Sweeps run plane by plane (x + y + z constant) in parallel.
+	///    If no voxel lies within the band (e.g. the surface is outside the grid), every voxel gets an exact closest point query instead.
+	/// 3. One ray per row of voxels counts the crossings in front of each voxel for the sign.
+	/// Hit count is the number of voxels inside. Without triangles or with a voxel size <= 0 every voxel is infinite.
+	/// </summary>
+	KdStructs::BatchStatistics bakeSignedDistanceField(const KdStructs::SdfGrid& grid, float* distances);
+	/// <summary>
+	/// Closest vertex to query within maxDistance, found by descending to query's cell first
+	/// and skipping every subtree whose cell lies further away than the best point so far. Does not allocate.
+	/// </summary>
+	KdStructs::Neighbour nearestPoint(const KdStructs::Vector& query, float maxDistance = std::numeric_limits<float>::infinity());
+	/// <summary>
+	/// k nearest points of every query, in parallel. Queries are processed in Morton order for cache locality.
+	/// ids[i * k + j] and distances[i * k + j] receive the j-th closest point of queries[i] (closest first),
+	/// NO_ID and infinity if the tree has fewer than k points.
+	/// k is limited to MAX_NEIGHBOURS: for larger k nothing is searched and all outputs are NO_ID and infinity.
+	/// approximation trades accuracy for speed, the default is exact.
+	/// </summary>
+	KdStructs::BatchStatistics knnBatch(const KdStructs::Vector* queries, size_t count, unsigned int k, unsigned int* ids, float* distances,
+		const KdStructs::BatchOptions& options = KdStructs::BatchOptions(), const KdStructs::Approximation& approximation = KdStructs::Approximation());
+	/// <summary>
+	/// k nearest other points of every point (min(k, point count - 1) each), written to graph.
+	/// Subtrees of up to GRAPH_BUCKET_SIZE points are buckets, contiguous in a flat copy of the tree. Each bucket searches the tree as a block:
+	/// a reference subtree is skipped once its bounds are further from the bucket's than the worst k-th distance within the bucket,
+	/// and the points of reference buckets are compared to all queries in one tight loop. Buckets are processed in parallel.
+	/// Hit count is the number of points with k neighbours. k is limited to MAX_NEIGHBOURS, nothing is searched for larger k.
+	/// </summary>
+	KdStructs::BatchStatistics buildKnnGraph(unsigned int k, KdStructs::NeighbourGraph& graph);
+	// Called for every pair of epsilonJoin: point of this tree, point of the other tree, their distance and the calling worker.
+	using JoinCallback = std::function<void(const KdStructs::Point*, const KdStructs::Point*, float, unsigned int)>;
+	/// <summary>
+	/// Calls callback for every pair of a point of this tree and a point of other at most epsilon apart, and returns their number.
+	/// Traverses both trees together, skipping pairs of subtrees whose bounds are further apart than epsilon
+	/// and reporting pairs whose bounds are completely within epsilon without further tests.
+	/// Runs on the worker threads of this tree: callback is called concurrently, with worker indices below getThreadCount().
+	/// </summary>
+	size_t epsilonJoin(const KdTree& other, float epsilon, const JoinCallback& callback);
+	// Called for every overlapping pair of findOverlappingTriangles: triangle id in this tree, triangle id in the other tree and the calling worker.
+	using OverlapCallback = std::function<void(unsigned int, unsigned int, unsigned int)>;
+	/// <summary>
+	/// Calls callback once for every pair of overlapping triangles of this tree and other (touching counts), and returns their number.
+	/// Descends both trees together, skipping pairs of subtrees whose triangle bounds are disjoint.
+	/// Each triangle is only tested from the node owning it (see Node::ownedBegin), so no pair is reported twice.
+	/// Runs on the worker threads of this tree: callback is called concurrently, with worker indices below getThreadCount().
+	/// </summary>
+	size_t findOverlappingTriangles(KdTree& other, const OverlapCallback& callback);
+	/// <summary>
+	/// Moller's interval test: each triangle must cross the other's plane, and both must overlap on the line where the planes meet.
+	/// Coplanar triangles are tested for overlapping edges or containment in 2D. Degenerate (zero area) triangles never overlap.
+	/// </summary>
+	static bool trianglesOverlap(const KdStructs::Triangle& first, const KdStructs::Triangle& second);
+	/// <summary>
+	/// k nearest points of a single query, exact or approximate, see knnBatch for the output.
+	/// Returns the number of points found.
+	/// </summary>
+	unsigned int knn(const KdStructs::Vector& query, unsigned int k, unsigned int* ids, float* distances, const KdStructs::Approximation& approximation = KdStructs::Approximation());
+	/// <summary>
+	/// Closest point to query on any triangle within maxDistance. Subtrees are visited nearest first
+	/// and skipped once their triangle bounds lie further away than the closest point so far.
+	/// </summary>
+	KdStructs::SurfacePoint closestPointOnMesh(const KdStructs::Vector& query, float maxDistance = std::numeric_limits<float>::infinity());
+	/// <summary>
+	/// closestPointOnMesh for every query, in parallel and in Morton order. The hit count is the number of valid results.
+	/// </summary>
+	KdStructs::BatchStatistics closestPointOnMeshBatch(const KdStructs::Vector* queries, size_t count, float maxDistance, KdStructs::SurfacePoint* results, const KdStructs::BatchOptions& options = KdStructs::BatchOptions());
+	/// <summary>
+	/// Writes the point of the triangle closest to query to closest and returns its squared distance.
+	/// </summary>
+	static float closestPointOnTriangle(const KdStructs::Triangle& triangle, const float query[3], float closest[3]);
+	/// <summary>
+	/// One-sided Hausdorff distance from the surface of this mesh to the surface of other: how far any point of this mesh is from other.
+	/// Branch and bound over this tree: subtrees and triangles whose upper bound cannot raise the largest distance found so far by more than tolerance are skipped,
+	/// the remaining triangles are subdivided until they can (or MAX_HAUSDORFF_DEPTH is reached).
+	/// Closest point searches on other start with the triangle found by the previous one as upper bound.
+	/// </summary>
+	KdStructs::HausdorffDistance hausdorffDistance(KdTree& other, float tolerance);
+	/// <summary>
+	/// The larger of both one-sided Hausdorff distances. If it is the one from other to this, from and triangle lie on other and to on this mesh.
+	/// </summary>
+	KdStructs::HausdorffDistance symmetricHausdorffDistance(KdTree& other, float tolerance);
+	/// <summary>
+	/// Calls callback(point, distance) for every vertex within radius of center.
+	/// Subtrees lying completely inside the sphere are reported without testing their points.
+	/// </summary>
+	void radiusSearch(const KdStructs::Vector& center, float radius, const std::function<void(const KdStructs::Point*, float)>& callback);
+	/// <summary>
+	/// Number of vertices within radius of center. Subtrees lying completely inside the sphere
+	/// are counted with their stored point count, without visiting their points.
+	/// </summary>
+	size_t radiusCount(const KdStructs::Vector& center, float radius);
+	/// <summary>
+	/// Replaces triangleIds with the ids of all triangles overlapping the box [min, max] (touching counts) and returns their number.
+	/// </summary>
+	size_t queryBox(const KdStructs::Vector& min, const KdStructs::Vector& max, std::vector<unsigned int>& triangleIds);
+	/// <summary>
+	/// queryBox for many boxes on the worker threads, triangleIds[i] receives the triangles of box i.
+	/// Boxes are processed in Morton order of their centers. The hit count is the number of boxes overlapping any triangle.
+	/// </summary>
+	KdStructs::BatchStatistics queryBoxBatch(const KdStructs::Vector* mins, const KdStructs::Vector* maxs, size_t count, std::vector<unsigned int>* triangleIds, const KdStructs::BatchOptions& options = KdStructs::BatchOptions());
+	/// <summary>
+	/// Replaces triangleIds with the triangles inside the convex polytope bounded by planes (at most MAX_PLANES, e.g. a camera frustum)
+	/// and returns their number. Like clipping, a triangle is only left out if all its vertices lie outside the same plane.
+	/// Subtrees completely inside are copied from the owned triangle list without testing their triangles.
+	/// Nothing is returned for more than MAX_PLANES planes.
+	/// </summary>
+	size_t queryPolytope(const KdStructs::Plane* planes, unsigned int planeCount, std::vector<unsigned int>& triangleIds);
+	/// <summary>
+	/// Separating axis test of a triangle against the box [min, max]: box normals, triangle normal and the nine edge cross products.
+	/// </summary>
+	static bool triangleOverlapsBox(const KdStructs::Triangle& triangle, const KdStructs::Vector& min, const KdStructs::Vector& max);
+	size_t getPointCount() const { return points.size(); }
+	const KdStructs::Point* getPoint(unsigned int id) const { return points[id]; }
+	/// <summary>
+	/// Builds the rope tree used by raycastStackless (done automatically on first use).
+	/// </summary>
+	void buildRopes();
+	/// <summary>
+	/// Same result as raycast, but walks from leaf to leaf along the ropes.
+	/// Only needs the current cell and interval per ray, no traversal stack.
+	/// </summary>
+	void raycastStackless(KdStructs::Ray ray, KdStructs::RayHit*& hit);
+	size_t getRopeMemory() const;
+	KdStructs::Triangle* getTriangle(unsigned int id) const { return triangles[id]; }
+	size_t getTriangleCount() const { return triangles.size(); }
+	size_t getProjectionMemory() const { return projectedTriangles.size() * sizeof(KdStructs::ProjectedTriangle); }
+	// Builds the SIMD triangle list or the projected triangles when switching to that mode for the first time.
+	void setIntersectionMode(KdStructs::IntersectionMode mode);
+	// 0 -> one thread per hardware thread.
+	void setThreadCount(unsigned int threadCount);
+	// Worker threads used by batch queries (creates them if needed).
+	unsigned int getThreadCount() { return getThreadPool()->getThreadCount(); }
 	std::vector<KdStructs::Node*> getNodes();
 
 	void print();
@@ -25,8 +215,176 @@ private:
 	std::vector<KdStructs::Point*> getPointList(float* vertices, unsigned int vertexCount, unsigned int* indices, unsigned int indexCount);
 	std::vector<KdStructs::Point*> getPointList(float* vertices, unsigned int vertexCount);
 	KdStructs::Node* createKdTree(std::vector<KdStructs::Point*> points, int depth, KdStructs::Vector max, KdStructs::Vector min);
-	void findIntersection(KdStructs::Node* node, KdStructs::Ray ray, KdStructs::RayHit*& hit);
-	float rayIntersectionWithTriangle(KdStructs::Triangle* triangle, KdStructs::Ray ray);
+	void computeTriangleBounds(KdStructs::Node* node);
+	// Single ray queries, starting at the root.
+	void traceRay(const KdStructs::Ray& ray, KdStructs::Hit& hit, KdStructs::Mailbox& mailbox);
+	bool traceOcclusion(const KdStructs::Ray& ray, float maxDistance, KdStructs::Mailbox& mailbox);
+	// Clips [0, maxDistance] of the ray against the bounds of the tree. False if the ray misses them.
+	// The bounds of the tree are the bounds of all its triangles.
+	bool clipToBounds(const KdStructs::PreparedRay& ray, float& tNear, float& tFar);
+	void findIntersection(KdStructs::Node* node, const KdStructs::Ray& ray, const KdStructs::PreparedRay& prepared, float tNear, float tFar, KdStructs::Hit& hit, KdStructs::Mailbox& mailbox);
+	bool findOcclusion(KdStructs::Node* node, const KdStructs::Ray& ray, const KdStructs::PreparedRay& prepared, float tNear, float tFar, KdStructs::Mailbox& mailbox);
+	// Tests the node's triangles and keeps the closest hit.
+	void intersectNode(KdStructs::Node* node, const KdStructs::Ray& ray, const KdStructs::PreparedRay& prepared, KdStructs::Hit& hit, KdStructs::Mailbox& mailbox);
+	void buildTriangleSoA();
+	void buildOwnedTriangles();
+	void assignOwnedTriangles(KdStructs::Node* node, std::vector<bool>& owned);
+	// offsets: distance from query to the node's cell per axis, cellDistance: squared distance to the cell.
+	void findNearestPoint(KdStructs::Node* node, const float query[3], float offsets[3], float cellDistance, KdStructs::Neighbour& nearest, float& nearestDistance);
+	// pruneScale: (1 + epsilon)^2, visitsLeft: nodes that may still be visited.
+	void findNearestPoints(KdStructs::Node* node, const float query[3], float offsets[3], float cellDistance, float pruneScale, unsigned int& visitsLeft, KdStructs::NeighbourHeap& heap);
+	// Compact copy of a tree node for dual-tree traversals, with the exact bounds of its subtree's points.
+	// Nodes are stored in depth-first order: the left child follows its parent, a subtree is the range [node, node + pointCount).
+	struct FlatNode
+	{
+		float min[3];
+		float max[3];
+		float position[3];
+		// Point id
+		unsigned int id;
+		// NO_ID if missing.
+		unsigned int left;
+		unsigned int right;
+		unsigned int pointCount;
+		int axis;
+	};
+	// Appends the subtree to nodes and returns its index.
+	static unsigned int flattenTree(KdStructs::Node* node, std::vector<FlatNode>& nodes);
+	// Splits a flat tree into enough subtrees for all threads, the nodes above them go to upperNodes.
+	void splitForThreads(const std::vector<FlatNode>& nodes, std::vector<unsigned int>& subtrees, std::vector<unsigned int>& upperNodes);
+
+	// Work state of buildKnnGraph. Everything indexed by node follows nodes.
+	struct KnnGraphState
+	{
+		unsigned int k;
+		std::vector<FlatNode> nodes;
+		// Node positions by axis, for the loops over buckets.
+		std::vector<float> positions[DIMENSIONS];
+		// Neighbour heaps of all points, in the graph's arrays by node until they are moved to point order at the end.
+		unsigned int* ids;
+		float* distances;
+		std::vector<unsigned int> sizes;
+		// Squared k-th distance of each node's point, infinite until it has k neighbours.
+		std::vector<float> bounds;
+	};
+	void findBucketNeighbours(unsigned int block, std::vector<unsigned int>& stack, KnnGraphState& state);
+	void compareBuckets(unsigned int queryBegin, unsigned int queryEnd, unsigned int referenceBegin, unsigned int referenceEnd,
+		const float referenceMin[3], const float referenceMax[3], KnnGraphState& state);
+	// Work state of epsilonJoin for one thread.
+	struct JoinState
+	{
+		const std::vector<FlatNode>* firstNodes;
+		const std::vector<FlatNode>* secondNodes;
+		const KdTree* second;
+		float epsilonSquared;
+		const JoinCallback* callback;
+		unsigned int worker;
+		size_t pairCount;
+	};
+	void joinSubtrees(unsigned int first, unsigned int second, JoinState& state);
+	// Point of the node on one side against the subtree on the other.
+	void joinPoint(unsigned int first, unsigned int second, bool pointInFirst, JoinState& state);
+	void reportJoinPair(unsigned int first, unsigned int second, float distance, JoinState& state);
+	// Work state of findOverlappingTriangles for one thread.
+	struct OverlapState
+	{
+		KdTree* second;
+		const OverlapCallback* callback;
+		unsigned int worker;
+		size_t pairCount;
+	};
+	void splitForThreads(KdStructs::Node* node, std::vector<KdStructs::Node*>& subtrees, std::vector<KdStructs::Node*>& upperNodes);
+	void overlapSubtrees(KdStructs::Node* first, KdStructs::Node* second, OverlapState& state);
+	// Owned triangles of node against the subtree of the other tree.
+	void overlapOwnedTriangles(KdStructs::Node* node, bool inFirst, KdStructs::Node* subtree, OverlapState& state);
+	void overlapTriangle(const KdStructs::Triangle* triangle, const float min[3], const float max[3], bool inFirst, KdStructs::Node* subtree, OverlapState& state);
+	// Interval where the triangle crosses the other plane along one axis, false if it lies in the plane. distances: vertices to the plane.
+	static bool getTriangleInterval(const float projections[3], const float distances[3], float interval[2]);
+	static bool coplanarTrianglesOverlap(const KdStructs::Triangle& first, const KdStructs::Triangle& second, const KdStructs::Vector& normal);
+	// Work state of hausdorffDistance for one thread. this is the source mesh.
+	struct HausdorffState
+	{
+		KdTree* target;
+		KdStructs::Mailbox* mailbox;
+		std::atomic<float>* lowerBound;
+		float tolerance;
+		// Target triangle closest to the last query, upper bound for the next one.
+		unsigned int hint;
+		KdStructs::HausdorffDistance result;
+	};
+	// lowerBound: distance known to be reached already (from the other direction), nothing below it is refined.
+	KdStructs::HausdorffDistance computeHausdorffDistance(KdTree& other, float tolerance, float lowerBound);
+	void findHausdorffDistance(KdStructs::Node* node, bool recursive, HausdorffState& state);
+	void refineHausdorffDistance(const KdStructs::Vector corners[3], const KdStructs::SurfacePoint nearest[3], unsigned int triangle, unsigned int depth, HausdorffState& state);
+	// Closest point on this mesh within maxDistance, searching only closer than the hint triangle. Invalid if there is none.
+	KdStructs::SurfacePoint closestPointFromHint(const KdStructs::Vector& query, unsigned int hint, KdStructs::Mailbox& mailbox, float maxDistance = std::numeric_limits<float>::infinity());
+	void offerHausdorffPoint(const KdStructs::Vector& from, const KdStructs::SurfacePoint& to, unsigned int triangle, HausdorffState& state);
+	// Squared distance from the furthest of the points to the triangle, an upper bound for their convex hull.
+	static float getFurthestDistance(const KdStructs::Triangle& triangle, const KdStructs::Vector* points, unsigned int count);
+	unsigned int searchNearestPoints(const KdStructs::Vector& query, unsigned int k, unsigned int* ids, float* distances, const KdStructs::Approximation& approximation);
+	// Squared distances from center to the closest and furthest point of the node's bounds (cell and triangle bounds).
+	void getNodeDistances(KdStructs::Node* node, const float center[3], float& closest, float& furthest);
+	void findPointsInRadius(KdStructs::Node* node, const float center[3], float radiusSquared, const std::function<void(const KdStructs::Point*, float)>& callback);
+	void reportSubtree(KdStructs::Node* node, const float center[3], const std::function<void(const KdStructs::Point*, float)>& callback);
+	size_t countPointsInRadius(KdStructs::Node* node, const float center[3], float radiusSquared);
+	// boundsDistance: squared distance from query to the node's triangle bounds, bestDistance: squared distance of best.
+	void findClosestPoint(KdStructs::Node* node, const float query[3], float boundsDistance, KdStructs::SurfacePoint& best, float& bestDistance, KdStructs::Mailbox& mailbox);
+	float getTriangleBoundsDistance(KdStructs::Node* node, const float query[3]);
+	// planeMask: planes the node's triangle bounds are not completely inside of.
+	void findTrianglesInPolytope(KdStructs::Node* node, const KdStructs::Plane* planes, unsigned int planeMask, std::vector<unsigned int>& triangleIds);
+	void findTrianglesInBox(KdStructs::Node* node, const KdStructs::Vector& min, const KdStructs::Vector& max, std::vector<unsigned int>& triangleIds, KdStructs::Mailbox& mailbox);
+	std::vector<unsigned int> getPointOrder(const KdStructs::Vector* queries, size_t count);
+	void findAllIntersections(KdStructs::Node* node, const KdStructs::Ray& ray, const KdStructs::PreparedRay& prepared, float tMin, float tNear, float tFar, KdStructs::HitBuffer& buffer, KdStructs::Mailbox& mailbox);
+	// Ray/surface crossing of contains.
+	struct Crossing
+	{
+		float distance;
+		// 1 if the triangle faces along the ray, -1 if against it.
+		int side;
+		// On an edge or vertex, the neighbouring triangles are crossed there as well.
+		bool onEdge;
+	};
+	bool isInside(const KdStructs::Vector& point, unsigned int directions, std::vector<Crossing>& crossings, KdStructs::Mailbox& mailbox);
+	// Number of distinct surface crossings between origin and origin + direction * maxDistance. They are left at the front of crossings, sorted by distance.
+	unsigned int countCrossings(const KdStructs::Vector& origin, const KdStructs::Vector& direction, float maxDistance, std::vector<Crossing>& crossings, KdStructs::Mailbox& mailbox);
+	void findCrossings(KdStructs::Node* node, const KdStructs::PreparedRay& prepared, float tNear, float tFar, std::vector<Crossing>& crossings, KdStructs::Mailbox& mailbox);
+	static KdStructs::Vector getContainmentDirection(unsigned int index);
+	// Distances up to band of one tile of SDF_TILE_SIZE^3 voxels, other voxels are set to infinity. Band voxels are stored negated, marking them as fixed for the sweeps.
+	void bakeDistanceTile(const KdStructs::SdfGrid& grid, const unsigned int tile[3], float band, float* distances, KdStructs::Mailbox& mailbox);
+	// One fast sweeping pass in the direction given by the bits of direction (set -> decreasing along that axis).
+	void sweepDistances(const KdStructs::SdfGrid& grid, unsigned int direction, float* distances);
+	// Crossing parity of each voxel along rows parallel to axis, added to votes.
+	void voteInside(const KdStructs::SdfGrid& grid, int axis, std::vector<unsigned char>& votes);
+	void traceRayStackless(const KdStructs::Ray& ray, KdStructs::Hit& hit, KdStructs::Mailbox& mailbox);
+	unsigned int createRopeCell(KdStructs::Node* node, const float min[3], const float max[3]);
+	void linkRopes(unsigned int cellIndex, const unsigned int ropes[6]);
+	void addRopeTriangle(unsigned int cellIndex, KdStructs::Triangle* triangle, const float min[3], const float max[3], std::vector<std::vector<unsigned int>>& leafTriangles);
+	// Leaf containing the ray at distance t, starting the search at cellIndex.
+	unsigned int findRopeLeaf(unsigned int cellIndex, const KdStructs::PreparedRay& ray, float t);
+	void getChildPlaneDistances(KdStructs::Node* node, const KdStructs::PreparedRay& ray, float& tLeft, float& tRight);
+	float rayIntersectionWithTriangle(KdStructs::Triangle* triangle, const KdStructs::Ray& ray);
+	// Also returns the barycentric coordinates of the hit.
+	float rayIntersectionWithTriangle(KdStructs::Triangle* triangle, const KdStructs::Ray& ray, float& u, float& v);
+	// Watertight test, expects the shear of the prepared ray.
+	float rayIntersectionWithTriangleWatertight(KdStructs::Triangle* triangle, const KdStructs::PreparedRay& ray, float& u, float& v);
+	// Projection test, expects the triangle's precomputed record.
+	float rayIntersectionWithTriangleProjected(const KdStructs::ProjectedTriangle& triangle, const KdStructs::PreparedRay& ray, float& u, float& v);
+	// Single triangle test of the current intersection mode.
+	float intersectTriangle(KdStructs::Triangle* triangle, const KdStructs::Ray& ray, const KdStructs::PreparedRay& prepared, float& u, float& v);
+	// Converts a hit into the allocated form, keeps an existing closer hit.
+	void storeRayHit(const KdStructs::Ray& ray, const KdStructs::Hit& result, KdStructs::RayHit*& hit);
+	// Vertex normal and texture coordinates at the barycentric coordinates of hit, see raycast.
+	void interpolateAttributes(const KdStructs::Hit& hit, KdStructs::HitAttributes& attributes) const;
+	// Order in which a batch of rays is traced when sorting them.
+	std::vector<unsigned int> getRayOrder(const KdStructs::Ray* rays, size_t count);
+	// Traces four rays, as packet if possible. Returns number of hits.
+	int raycastPacket(const KdStructs::Ray* rays, KdStructs::RayHit** hits, KdStructs::Mailbox& mailbox);
+#ifdef KD_SSE
+	void findIntersectionPacket(KdStructs::Node* node, KdStructs::RayPacket& packet, __m128 tNear, __m128 tFar, int mask, KdStructs::Mailbox& mailbox);
+	void rayPacketIntersectionWithTriangle(KdStructs::Triangle* triangle, KdStructs::RayPacket& packet, int mask);
+	// clipToBounds for all lanes, returns the lanes hitting the bounds.
+	int clipPacketToBounds(const KdStructs::RayPacket& packet, __m128& tNear, __m128& tFar);
+#endif
 
 	inline auto getComparatorForAxis(int axis) const
 	{ 
@@ -44,9 +402,36 @@ private:
 	}
 
 	KdStructs::Node* root;
-	// Used for clean up.
+	// Used for clean up. Index equals the triangle's id.
 	std::vector<KdStructs::Triangle*> triangles;
+	// Index equals the point's id (points are deleted by their nodes).
+	std::vector<KdStructs::Point*> points;
+
+	// Used by single queries.
+	KdStructs::Mailbox mailbox;
+
+	ThreadPool* getThreadPool();
+
+	KdStructs::IntersectionMode intersectionMode = KdStructs::IntersectionMode::MOLLER_TRUMBORE;
+	// Triangles grouped by owning node, see Node::ownedBegin. Empty until needed.
+	TriangleKernel::Triangles triangleSoA;
+	// Triangle id of each entry in triangleSoA, also used without it by queryPolytope. Empty until needed.
+	std::vector<unsigned int> ownedTriangleIds;
+	TriangleKernel::Isa isa = TriangleKernel::getBestIsa();
+	// Indexed by vertex, see Triangle::vertices.
+	std::vector<KdStructs::VertexAttributes> vertexAttributes;
+	// Index equals triangle id. Empty until needed.
+	std::vector<KdStructs::ProjectedTriangle> projectedTriangles;
+
+	// Rope tree, empty until buildRopes is called.
+	std::vector<KdStructs::RopeCell> ropeCells;
+	// Triangle ids per leaf, see RopeCell::triangleBegin.
+	std::vector<unsigned int> ropeTriangles;
 
-	unsigned int checkCache = 0;
+	// Created on first batch query.
+	ThreadPool* threadPool = nullptr;
+	unsigned int threadCount = 0;
+	// One per worker thread of the pool.
+	std::vector<KdStructs::Mailbox> workerMailboxes;
 };
 
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+/// <summary>
+/// Morton codes (Z-order curve).
+/// Interleaves the bits of three coordinates, so values close in space end up close in the sorted order.
+/// </summary>
+namespace Morton {
+
+	// Spreads the lower 21 bits of value apart, leaving two zero bits between each of them.
+	inline uint64_t splitBy3(uint32_t value)
+	{
+		uint64_t x = value & 0x1fffff;
+		x = (x | x << 32) & 0x1f00000000ffff;
+		x = (x | x << 16) & 0x1f0000ff0000ff;
+		x = (x | x << 8) & 0x100f00f00f00f00f;
+		x = (x | x << 4) & 0x10c30c30c30c30c3;
+		x = (x | x << 2) & 0x1249249249249249;
+		return x;
+	}
+
+	// Coordinates have to be already quantized to at most 21 bits.
+	inline uint64_t encode(uint32_t x, uint32_t y, uint32_t z)
+	{
+		return splitBy3(x) | splitBy3(y) << 1 | splitBy3(z) << 2;
+	}
+
+	// Maps value from [min, min + extent] to [0, 2^bits - 1].
+	inline uint32_t quantize(float value, float min, float extent, int bits)
+	{
+		float maxValue = static_cast<float>((1u << bits) - 1);
+		float normalized = extent > 0 ? (value - min) / extent : 0;
+		if (!(normalized > 0))
+			return 0;
+		if (normalized >= 1)
+			return static_cast<uint32_t>(maxValue);
+		return static_cast<uint32_t>(normalized * maxValue);
+	}
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <limits>
+
+#include "Structures.h"
+
+// SSE2 is always available on x64 and the default for x86 builds.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KD_SSE
+#include <emmintrin.h>
+#endif
+
+namespace KdStructs {
+
+	constexpr int PACKET_SIZE = 4;
+	constexpr int PACKET_MASK = (1 << PACKET_SIZE) - 1;
+
+#ifdef KD_SSE
+	/// <summary>
+	/// Four rays traversing the tree together.
+	/// Stored as structure of arrays, every register holds one component of all four rays.
+	/// </summary>
+	struct RayPacket
+	{
+		RayPacket(const Ray* rays)
+		{
+			for (int axis = 0; axis < 3; axis++) {
+				origin[axis] = _mm_setr_ps(rays[0].origin[axis], rays[1].origin[axis], rays[2].origin[axis], rays[3].origin[axis]);
+				direction[axis] = _mm_setr_ps(rays[0].direction[axis], rays[1].direction[axis], rays[2].direction[axis], rays[3].direction[axis]);
+				inverseDirection[axis] = _mm_div_ps(_mm_set1_ps(1.0f), direction[axis]);
+			}
+			distance = _mm_setr_ps(rays[0].distance, rays[1].distance, rays[2].distance, rays[3].distance);
+			hitDistance = _mm_set1_ps(std::numeric_limits<float>::infinity());
+		}
+
+		/// <summary>
+		/// Rays are only traced together if their directions lie within a narrow cone.
+		/// Otherwise they split up at nearly every node and are faster on their own.
+		/// </summary>
+		static bool isCoherent(const Ray* rays)
+		{
+			const Vector& first = rays[0].direction;
+			float firstLength = first.dot(first);
+			for (int i = 1; i < PACKET_SIZE; i++) {
+				const Vector& direction = rays[i].direction;
+				float cosine = first.dot(direction);
+				// cos(angle) > MIN_COSINE without taking square roots.
+				if (cosine <= 0 || cosine * cosine < MIN_COSINE * MIN_COSINE * firstLength * direction.dot(direction))
+					return false;
+			}
+			return true;
+		}
+
+		// Cosine of the widest angle between rays of a packet (~8 degrees).
+		static constexpr float MIN_COSINE = 0.99f;
+
+		__m128 origin[3];
+		__m128 direction[3];
+		__m128 inverseDirection[3];
+		// Maximum distance of the rays.
+		__m128 distance;
+
+		// Closest hit per ray.
+		__m128 hitDistance;
+		Triangle* hitTriangles[PACKET_SIZE] = { nullptr, nullptr, nullptr, nullptr };
+	};
+#endif
+}
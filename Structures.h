@@ -1,25 +1,25 @@
 #pragma once
 
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 namespace KdStructs {
 
 	// Because C++ is a procedural programming language
 	struct Triangle;
 
+	// Id of triangles which are not (yet) part of a tree.
+	constexpr unsigned int NO_ID = 0xFFFFFFFF;
+
 
 	struct Vector
 	{
-		Vector(float values[3]) : values(values) {}
-		Vector(float x, float y, float z) : values(new float[3]{ x,y,z }) {}
-		Vector(const Vector& vector) : values(new float[3]{ vector[0], vector[1], vector[2] }) {}
-
-		~Vector() {
-			delete[] values;
-			values = nullptr;
-		}
+		Vector(const float values[3]) : values{ values[0], values[1], values[2] } {}
+		Vector(float x, float y, float z) : values{ x, y, z } {}
 
-		Vector& operator=(const Vector& other) { values[0] = other[0]; values[1] = other[1]; values[2] = other[2]; return *this; }
 		float operator[](int i) const { return values[i]; }
 		float& operator[](int i) { return values[i]; }
 		Vector operator+(const Vector& other) const { return Vector(values[0] + other[0], values[1] + other[1], values[2] + other[2]); }
@@ -38,8 +38,9 @@ namespace KdStructs {
 
 		void print() { std::cout << "{" << values[0] << "," << values[1] << "," << values[2] << "}" << std::endl; }
 
-		float* values = nullptr;
-		const float EPSILON = 0.0001f;
+		// Stored inline, creating and copying vectors never allocates.
+		float values[3];
+		static constexpr float EPSILON = 0.0001f;
 	};
 
 	inline std::ostream& operator<<(std::ostream& str, const Vector& vector) {
@@ -58,6 +59,162 @@ namespace KdStructs {
 		Vector pos;
 		// Triangles this point belongs to
 		std::vector<Triangle*> triangles;
+		// Index into the point list of the tree, assigned when building it.
+		unsigned int id = NO_ID;
+	};
+
+	// Largest k of KdTree::knnBatch.
+	constexpr unsigned int MAX_NEIGHBOURS = 64;
+
+	/// <summary>
+	/// The closest points found so far by a kNN query, as max-heap on the squared distance (furthest point on top).
+	/// Fixed capacity, so it lives on the stack, or works on external storage (e.g. one slice of a kNN graph).
+	/// </summary>
+	struct NeighbourHeap
+	{
+		NeighbourHeap(unsigned int capacity) : ids(localIds), distances(localDistances), capacity(capacity) {}
+		// Heap over capacity entries of ids and distances, of which the first size already form a heap.
+		NeighbourHeap(unsigned int capacity, unsigned int* ids, float* distances, unsigned int size) : ids(ids), distances(distances), size(size), capacity(capacity) {}
+		NeighbourHeap(const NeighbourHeap&) = delete;
+		NeighbourHeap& operator=(const NeighbourHeap&) = delete;
+
+		// Squared distance a point has to beat to get in.
+		float getBound() const { return size == capacity ? distances[0] : std::numeric_limits<float>::infinity(); }
+
+		void push(unsigned int id, float distance)
+		{
+			if (size < capacity) {
+				// Sift up from the end.
+				unsigned int i = size++;
+				while (i > 0 && distances[(i - 1) / 2] < distance) {
+					ids[i] = ids[(i - 1) / 2];
+					distances[i] = distances[(i - 1) / 2];
+					i = (i - 1) / 2;
+				}
+				ids[i] = id;
+				distances[i] = distance;
+				return;
+			}
+			if (distance >= distances[0])
+				return;
+
+			// Replace the furthest point and sift down.
+			siftDown(0, size, id, distance);
+		}
+
+		// Sorts by distance, closest first. The heap can't be used afterwards.
+		void sort()
+		{
+			for (unsigned int end = size; end > 1; end--) {
+				unsigned int lastId = ids[end - 1];
+				float lastDistance = distances[end - 1];
+				ids[end - 1] = ids[0];
+				distances[end - 1] = distances[0];
+				siftDown(0, end - 1, lastId, lastDistance);
+			}
+		}
+
+		unsigned int* ids;
+		float* distances;
+		unsigned int size = 0;
+		unsigned int capacity;
+
+	private:
+		unsigned int localIds[MAX_NEIGHBOURS];
+		float localDistances[MAX_NEIGHBOURS];
+
+		// Places id at i and moves it down within [0, end) until the heap is valid again.
+		void siftDown(unsigned int i, unsigned int end, unsigned int id, float distance)
+		{
+			while (true) {
+				unsigned int child = 2 * i + 1;
+				if (child >= end)
+					break;
+				if (child + 1 < end && distances[child + 1] > distances[child])
+					child++;
+				if (distances[child] <= distance)
+					break;
+				ids[i] = ids[child];
+				distances[i] = distances[child];
+				i = child;
+			}
+			ids[i] = id;
+			distances[i] = distance;
+		}
+	};
+
+	/// <summary>
+	/// Trades accuracy of kNN queries for speed. The default searches exactly.
+	/// </summary>
+	struct Approximation
+	{
+		// Subtrees are skipped unless they could hold a point closer than 1 / (1 + epsilon) times the current k-th distance,
+		// so every returned distance is at most (1 + epsilon) times the true one.
+		float epsilon = 0;
+		// Stop after visiting this many nodes (each holds one point), 0 for no limit. Voids the epsilon guarantee when reached.
+		unsigned int maxVisits = 0;
+	};
+
+	// Subtrees of at most this many points are searched and compared as one block by KdTree::buildKnnGraph.
+	constexpr unsigned int GRAPH_BUCKET_SIZE = 32;
+
+	/// <summary>
+	/// k nearest neighbours of every point in compressed sparse row form, see KdTree::buildKnnGraph.
+	/// The neighbours of point i are neighbours[offsets[i]] to neighbours[offsets[i + 1] - 1], closest first.
+	/// </summary>
+	struct NeighbourGraph
+	{
+		// One per point plus one at the end.
+		std::vector<size_t> offsets;
+		std::vector<unsigned int> neighbours;
+		std::vector<float> distances;
+	};
+
+	// Result of KdTree::nearestPoint.
+	struct Neighbour
+	{
+		// Vertex and the triangles connected to it, nullptr if there is none within the search distance.
+		const Point* point = nullptr;
+		float distance = 0;
+	};
+
+	// Result of KdTree::closestPointOnMesh.
+	struct SurfacePoint
+	{
+		unsigned int triangle = NO_ID;
+		Vector position = Vector(0, 0, 0);
+		float distance = std::numeric_limits<float>::infinity();
+		// False if no triangle lies within the search distance.
+		bool valid = false;
+	};
+
+	// Subdivision levels of a source triangle before KdTree::hausdorffDistance gives up on narrowing its bounds.
+	constexpr unsigned int MAX_HAUSDORFF_DEPTH = 8;
+
+	// Result of KdTree::hausdorffDistance. The exact distance lies in [distance, upperBound].
+	struct HausdorffDistance
+	{
+		// Largest distance found, from the point from on the source mesh to its closest point to on the target mesh.
+		float distance = 0;
+		float upperBound = 0;
+		Vector from = Vector(0, 0, 0);
+		// Source triangle containing from.
+		unsigned int triangle = NO_ID;
+		SurfacePoint to;
+	};
+
+	constexpr unsigned int MAX_PLANES = 8;
+
+	// Half-space normal . x + offset >= 0, see KdTree::queryPolytope. Normals of a frustum's planes point inwards.
+	struct Plane
+	{
+		Plane() : normal(0, 0, 0), offset(0) {}
+		Plane(const Vector& normal, float offset) : normal(normal), offset(offset) {}
+
+		float getDistance(const float position[3]) const { return normal[0] * position[0] + normal[1] * position[1] + normal[2] * position[2] + offset; }
+
+		Vector normal;
+		float offset;
 	};
 
 
@@ -69,7 +226,111 @@ namespace KdStructs {
 		Vector b;
 		Vector c;
 
-		unsigned int checkCache = 0;
+		// Index into the triangle list of the tree, assigned when building it.
+		unsigned int id = NO_ID;
+		// Indices of a, b and c in the vertex array the tree was built from (NO_ID if unknown).
+		unsigned int vertices[3] = { NO_ID, NO_ID, NO_ID };
+	};
+
+	// Per-vertex shading data, see KdTree::setVertexAttributes.
+	struct VertexAttributes
+	{
+		float normal[3];
+		float uv[2];
+	};
+
+	/// <summary>
+	/// Triangle precomputed for the projection test (Wald): its plane, and two edge functions in the projection
+	/// onto the axes u and v besides the dominant normal axis k. 40 bytes per triangle.
+	/// </summary>
+	struct ProjectedTriangle
+	{
+		ProjectedTriangle(const Triangle& triangle)
+		{
+			Vector edgeB = triangle.b - triangle.a;
+			Vector edgeC = triangle.c - triangle.a;
+			Vector normal = edgeB.cross(edgeC);
+
+			k = 0;
+			for (int axis = 1; axis < 3; axis++)
+				if (std::fabs(normal[axis]) > std::fabs(normal[k]))
+					k = axis;
+			int u = (k + 1) % 3;
+			int v = (k + 2) % 3;
+
+			// Solves a[u, v] + beta * edgeB[u, v] + gamma * edgeC[u, v] = hit[u, v].
+			float determinant = edgeB[u] * edgeC[v] - edgeB[v] * edgeC[u];
+			if (normal[k] == 0 || determinant == 0) {
+				// Degenerate, never hit.
+				k = -1;
+				return;
+			}
+
+			// Plane: hit[k] + normalU * hit[u] + normalV * hit[v] = distance.
+			normalU = normal[u] / normal[k];
+			normalV = normal[v] / normal[k];
+			distance = normal.dot(triangle.a) / normal[k];
+
+			float inverse = 1.0f / determinant;
+			betaU = edgeC[v] * inverse;
+			betaV = -edgeC[u] * inverse;
+			betaD = (edgeC[u] * triangle.a[v] - edgeC[v] * triangle.a[u]) * inverse;
+			gammaU = -edgeB[v] * inverse;
+			gammaV = edgeB[u] * inverse;
+			gammaD = (edgeB[v] * triangle.a[u] - edgeB[u] * triangle.a[v]) * inverse;
+		}
+
+		float normalU, normalV, distance;
+		// Dominant axis of the normal, -1 for degenerate triangles.
+		int k;
+		// Barycentric coordinates of b (beta) and c (gamma) as functions of the projected hit point.
+		float betaU, betaV, betaD;
+		float gammaU, gammaV, gammaD;
+	};
+
+	/// <summary>
+	/// Remembers which triangles were already tested by the current query.
+	/// Each thread uses its own mailbox, so queries can run concurrently.
+	/// </summary>
+	struct Mailbox
+	{
+		void resize(size_t triangleCount) { stamps.assign(triangleCount, 0); lanes.assign(triangleCount, 0); current = 0; }
+
+		// Starts a new query, clears all stamps once the counter wraps around.
+		void next()
+		{
+			current++;
+			if (current == 0) {
+				std::fill(stamps.begin(), stamps.end(), 0);
+				current = 1;
+			}
+		}
+
+		// Returns true if the triangle was not tested yet during this query and marks it.
+		bool check(unsigned int id)
+		{
+			if (stamps[id] == current)
+				return false;
+			stamps[id] = current;
+			return true;
+		}
+
+		// Version of check for ray packets. Returns the lanes of mask which did not test the triangle yet and marks them.
+		int checkLanes(unsigned int id, int mask)
+		{
+			if (stamps[id] != current) {
+				stamps[id] = current;
+				lanes[id] = 0;
+			}
+			int untested = mask & ~lanes[id];
+			lanes[id] |= mask;
+			return untested;
+		}
+
+		std::vector<unsigned int> stamps;
+		// Lanes of a ray packet which already tested the triangle.
+		std::vector<unsigned char> lanes;
+		unsigned int current = 0;
 	};
 
 	/// <summary>
@@ -105,9 +366,57 @@ namespace KdStructs {
 		// 0 -> undefined/endless
 		Vector max;
 		Vector min;
+
+		// Bounds of the points in this subtree and all triangles connected to them.
+		// Triangles reach out of the node's cell, so these define where the subtree can be hit.
+		Vector triangleMax = Vector(0, 0, 0);
+		Vector triangleMin = Vector(0, 0, 0);
+
+		// Number of points in this subtree (including this node's).
+		unsigned int pointCount = 1;
+
+		// Range of the triangles owned by this node in the tree's owned triangle list.
+		// Every triangle is owned by exactly one of its vertices' nodes.
+		unsigned int ownedBegin = 0;
+		unsigned int ownedCount = 0;
+		// End of the triangles owned by the whole subtree. Nodes get their ranges in depth-first order,
+		// so these are [ownedBegin, ownedEnd).
+		unsigned int ownedEnd = 0;
 	};
 
 
+	/// <summary>
+	/// Cell of the rope tree: the kd-tree's subdivision of space, flattened for stackless traversal.
+	/// Leaves list every triangle overlapping them and know their neighbour across each face (ropes),
+	/// so a ray can walk from leaf to leaf without a stack.
+	/// </summary>
+	struct RopeCell
+	{
+		RopeCell(const float min[3], const float max[3])
+		{
+			for (int axis = 0; axis < 3; axis++) {
+				this->min[axis] = min[axis];
+				this->max[axis] = max[axis];
+			}
+		}
+
+		bool isLeaf() const { return axis < 0; }
+
+		float min[3];
+		float max[3];
+
+		// Splitting plane of inner cells, -1 for leaves.
+		int axis = -1;
+		float split = 0;
+		unsigned int children[2] = { NO_ID, NO_ID };
+
+		// Leaves: neighbour cell across each face (-x, +x, -y, +y, -z, +z). NO_ID -> outside of the tree.
+		unsigned int ropes[6] = { NO_ID, NO_ID, NO_ID, NO_ID, NO_ID, NO_ID };
+		// Leaves: range in the tree's list of rope triangles.
+		unsigned int triangleBegin = 0;
+		unsigned int triangleCount = 0;
+	};
+
 	struct Ray
 	{
 		Ray(Vector origin, Vector direction, float distance) : origin(origin), direction(direction), distance(distance) {}
@@ -117,6 +426,60 @@ namespace KdStructs {
 		float distance = 0;
 	};
 
+	/// <summary>
+	/// Values each traversal step needs, computed once per ray.
+	/// Plain floats, so preparing a ray does not allocate.
+	/// </summary>
+	struct PreparedRay
+	{
+		PreparedRay(const Ray& ray) : maxDistance(ray.distance)
+		{
+			for (int axis = 0; axis < 3; axis++) {
+				origin[axis] = ray.origin[axis];
+				direction[axis] = ray.direction[axis];
+				// +-infinity for directions parallel to an axis.
+				inverseDirection[axis] = 1.0f / ray.direction[axis];
+				sign[axis] = ray.direction[axis] < 0 ? 1 : 0;
+			}
+
+			// Watertight intersection: z is the largest direction component, winding is kept for negative directions.
+			kz = 0;
+			for (int axis = 1; axis < 3; axis++)
+				if (std::fabs(direction[axis]) > std::fabs(direction[kz]))
+					kz = axis;
+			kx = (kz + 1) % 3;
+			ky = (kx + 1) % 3;
+			if (direction[kz] < 0)
+				std::swap(kx, ky);
+			shearX = direction[kx] / direction[kz];
+			shearY = direction[ky] / direction[kz];
+			shearZ = 1.0f / direction[kz];
+		}
+
+		float origin[3];
+		float direction[3];
+		float inverseDirection[3];
+		// 1 if the direction is negative along the axis.
+		int sign[3];
+		float maxDistance;
+
+		// Permutation and shear moving the ray onto the +z axis (see KdTree::rayIntersectionWithTriangleWatertight).
+		int kx, ky, kz;
+		float shearX, shearY, shearZ;
+	};
+
+	// Vertex attributes interpolated at a hit, see KdTree::raycast.
+	struct HitAttributes
+	{
+		// Normalized.
+		float normal[3] = { 0, 0, 0 };
+		float uv[2] = { 0, 0 };
+		// False if nothing was hit or the tree has no vertex attributes.
+		bool valid = false;
+		// False if the interpolated normal has length 0 (no vertex normals, or opposite ones cancelling out). It is left at 0 then.
+		bool validNormal = false;
+	};
+
 	struct RayHit
 	{
 		RayHit(Triangle* triangle, Vector position, float distance) : triangle(triangle), position(position), distance(distance) {}
@@ -124,5 +487,126 @@ namespace KdStructs {
 		Triangle* triangle = nullptr;
 		Vector position;
 		float distance = 0;
+		// Only filled in with BatchOptions::attributes.
+		HitAttributes attributes;
+	};
+
+	/// <summary>
+	/// Compact result of KdTree::raycast, returned by value (20 bytes).
+	/// Barycentric coordinates: position = a * (1 - u - v) + b * u + c * v.
+	/// </summary>
+	struct Hit
+	{
+		// Only computed on request.
+		Vector getPosition(const Ray& ray) const { return ray.origin + ray.direction * distance; }
+
+		// Id of the triangle, see KdTree::getTriangle.
+		unsigned int triangle = NO_ID;
+		float distance = 0;
+		float u = 0;
+		float v = 0;
+		bool valid = false;
+	};
+
+	/// <summary>
+	/// Caller supplied storage for KdTree::raycastAll.
+	/// Keeps the closest hits (up to capacity) sorted by distance.
+	/// </summary>
+	struct HitBuffer
+	{
+		HitBuffer(Hit* hits, size_t capacity) : hits(hits), capacity(capacity) {}
+
+		// Hits further away than this can't make it into the buffer anymore.
+		float getCutoff(float tFar) const { return count == capacity ? std::min(tFar, hits[count - 1].distance) : tFar; }
+
+		void insert(const Hit& hit)
+		{
+			if (count == capacity && hit.distance >= hits[count - 1].distance)
+				return;
+
+			// Insertion sort, the furthest hit drops out of a full buffer.
+			size_t i = count < capacity ? count++ : count - 1;
+			for (; i > 0 && hits[i - 1].distance > hit.distance; i--)
+				hits[i] = hits[i - 1];
+			hits[i] = hit;
+		}
+
+		Hit* hits;
+		size_t capacity;
+		size_t count = 0;
+	};
+
+	// How triangles are tested during KdTree::raycast and raycastBatch.
+	enum class IntersectionMode
+	{
+		// Each triangle of a node on its own.
+		MOLLER_TRUMBORE,
+		// All triangles owned by a node at once, using the widest SIMD instruction set available (see TriangleKernel).
+		SIMD,
+		// Each triangle on its own, rays can't slip through edges shared by two triangles (Woop et al.).
+		WATERTIGHT,
+		// Each triangle on its own, using precomputed plane and edge functions (Wald). Needs 40 extra bytes per triangle.
+		PROJECTION
+	};
+
+	struct BatchOptions
+	{
+		// Number of rays a thread takes at once. Consecutive rays share cache lines of the output.
+		size_t chunkSize = 64;
+		// Trace groups of four consecutive rays as packet if they point in the same direction.
+		// Packets have their own Moller-Trumbore test, so they are only used with IntersectionMode::MOLLER_TRUMBORE.
+		bool packets = true;
+		// Sort rays by direction and origin before tracing them, hits are returned in the original order.
+		// Worth it for incoherent rays (e.g. random or secondary rays).
+		bool sortRays = false;
+		// Walk from leaf to leaf along the ropes instead of using a traversal stack (see KdTree::buildRopes).
+		// Replaces packets.
+		bool stackless = false;
+		// Interpolate the vertex attributes of every hit into RayHit::attributes (see KdTree::setVertexAttributes).
+		// Packets don't keep the barycentric coordinates, so they are not used then.
+		bool attributes = false;
+	};
+
+	constexpr unsigned int MAX_CONTAINMENT_DIRECTIONS = 7;
+
+	// Options of KdTree::containsBatch.
+	struct ContainmentOptions
+	{
+		// Rays per point in different directions, the majority decides. Odd counts avoid ties. Limited to MAX_CONTAINMENT_DIRECTIONS.
+		unsigned int directions = 1;
+		// Consecutive points (in Morton order) sharing the rays of the first one of their group.
+		// The others only count the crossings on the path to it, one path per direction. 1 -> every point casts its own rays.
+		unsigned int groupSize = 8;
+	};
+
+	// Edge length of the cubic tiles KdTree::bakeSignedDistanceField hands to the threads.
+	constexpr unsigned int SDF_TILE_SIZE = 8;
+
+	/// <summary>
+	/// Sampling grid of KdTree::bakeSignedDistanceField. Voxel (x, y, z) lies at origin + (x, y, z) * voxelSize
+	/// and is stored at (z * resolution[1] + y) * resolution[0] + x.
+	/// </summary>
+	struct SdfGrid
+	{
+		Vector origin = Vector(0, 0, 0);
+		float voxelSize = 1;
+		unsigned int resolution[3] = { 0, 0, 0 };
+		// Voxels closer to the surface than this many voxel sizes get exact distances, the others are propagated from them.
+		float bandWidth = 2;
+		// 1 -> the sign is taken from rows along x, 3 -> along x, y and z and the majority decides.
+		unsigned int signDirections = 1;
+
+		size_t getVoxelCount() const { return static_cast<size_t>(resolution[0]) * resolution[1] * resolution[2]; }
+	};
+
+	struct BatchStatistics
+	{
+		BatchStatistics(size_t rayCount, size_t hitCount, double seconds) : rayCount(rayCount), hitCount(hitCount), seconds(seconds) {}
+
+		double raysPerSecond() const { return seconds > 0 ? rayCount / seconds : 0; }
+
+		size_t rayCount = 0;
+		size_t hitCount = 0;
+		double seconds = 0;
 	};
 }
\ No newline at end of file
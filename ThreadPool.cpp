@@ -0,0 +1,94 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+
+ThreadPool::ThreadPool(unsigned int threadCount) : nextChunk(0)
+{
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	// Calling thread is worker 0.
+	for (unsigned int i = 1; i < threadCount; i++)
+		workers.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	jobAvailable.notify_all();
+
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+void ThreadPool::parallelFor(size_t count, size_t chunkSize, const Task& task)
+{
+	if (count == 0)
+		return;
+
+	chunkSize = std::max<size_t>(1, chunkSize);
+
+	std::lock_guard<std::mutex> dispatchLock(dispatchMutex);
+
+	// Not worth waking anyone up.
+	if (workers.empty() || count <= chunkSize) {
+		task(0, count, 0);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->task = &task;
+		this->count = count;
+		this->chunkSize = chunkSize;
+		nextChunk = 0;
+		busyWorkers = static_cast<unsigned int>(workers.size());
+		generation++;
+	}
+	jobAvailable.notify_all();
+
+	runChunks(0);
+
+	// Wait for the other workers to finish their last chunk.
+	std::unique_lock<std::mutex> lock(mutex);
+	jobFinished.wait(lock, [this]() { return busyWorkers == 0; });
+	this->task = nullptr;
+}
+
+void ThreadPool::work(unsigned int workerIndex)
+{
+	unsigned int seenGeneration = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			jobAvailable.wait(lock, [this, seenGeneration]() { return stopping || generation != seenGeneration; });
+			if (stopping)
+				return;
+			seenGeneration = generation;
+		}
+
+		runChunks(workerIndex);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		busyWorkers--;
+		if (busyWorkers == 0)
+			jobFinished.notify_one();
+	}
+}
+
+void ThreadPool::runChunks(unsigned int workerIndex)
+{
+	while (true)
+	{
+		size_t begin = nextChunk.fetch_add(chunkSize);
+		if (begin >= count)
+			return;
+
+		(*task)(begin, std::min(begin + chunkSize, count), workerIndex);
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+/// <summary>
+/// Persistent worker threads for batch queries.
+/// Work is handed out in chunks, threads grab the next free chunk until none is left.
+/// </summary>
+class ThreadPool
+{
+public:
+	// Task(begin, end, workerIndex). Worker index is in [0, getThreadCount()).
+	using Task = std::function<void(size_t, size_t, unsigned int)>;
+
+	// 0 -> one thread per hardware thread.
+	ThreadPool(unsigned int threadCount = 0);
+	~ThreadPool();
+
+	/// <summary>
+	/// Splits [0, count) into chunks of chunkSize and runs them on all threads.
+	/// The calling thread works as worker 0 and returns once every chunk is done.
+	/// Must not be called from inside a task.
+	/// </summary>
+	void parallelFor(size_t count, size_t chunkSize, const Task& task);
+
+	unsigned int getThreadCount() const { return static_cast<unsigned int>(workers.size()) + 1; }
+
+private:
+	void work(unsigned int workerIndex);
+	void runChunks(unsigned int workerIndex);
+
+	std::vector<std::thread> workers;
+
+	// Only one batch at a time.
+	std::mutex dispatchMutex;
+
+	std::mutex mutex;
+	std::condition_variable jobAvailable;
+	std::condition_variable jobFinished;
+
+	// Current job
+	const Task* task = nullptr;
+	size_t count = 0;
+	size_t chunkSize = 1;
+	std::atomic<size_t> nextChunk;
+
+	unsigned int generation = 0;
+	unsigned int busyWorkers = 0;
+	bool stopping = false;
+};
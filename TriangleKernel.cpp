@@ -0,0 +1,319 @@
+#include "TriangleKernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KD_SIMD_DISPATCH
+#define KD_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define KD_SIMD_DISPATCH
+// MSVC allows intrinsics of any instruction set without changing the build flags.
+#define KD_TARGET(isa)
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+// Fused multiply-adds round differently, the instruction sets would no longer agree with each other.
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+
+namespace TriangleKernel {
+
+	// Same value as the scalar rayIntersectionWithTriangle.
+	const float EPSILON = static_cast<float>(0.0000001);
+
+	void Triangles::resize(size_t count)
+	{
+		this->count = count;
+		// Vectors starting at the last triangle may read up to MAX_WIDTH - 1 triangles past the end.
+		size_t padded = count + MAX_WIDTH;
+		for (int axis = 0; axis < 3; axis++) {
+			vertex[axis].assign(padded, 0);
+			edge1[axis].assign(padded, 0);
+			edge2[axis].assign(padded, 0);
+		}
+	}
+
+	void Triangles::set(size_t index, const KdStructs::Triangle& triangle)
+	{
+		for (int axis = 0; axis < 3; axis++) {
+			vertex[axis][index] = triangle.a[axis];
+			edge1[axis][index] = triangle.b[axis] - triangle.a[axis];
+			edge2[axis][index] = triangle.c[axis] - triangle.a[axis];
+		}
+	}
+
+	/// <summary>
+	/// Reference version, every vector version below performs exactly these operations per lane.
+	/// </summary>
+	void intersectScalar(const Triangles& triangles, size_t begin, size_t count, const float origin[3], const float direction[3], float* distance, float* u, float* v)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t j = begin + i;
+			float e1x = triangles.edge1[0][j], e1y = triangles.edge1[1][j], e1z = triangles.edge1[2][j];
+			float e2x = triangles.edge2[0][j], e2y = triangles.edge2[1][j], e2z = triangles.edge2[2][j];
+
+			float hx = direction[1] * e2z - direction[2] * e2y;
+			float hy = direction[2] * e2x - direction[0] * e2z;
+			float hz = direction[0] * e2y - direction[1] * e2x;
+			float a = e1x * hx + e1y * hy + e1z * hz;
+			float f = 1.0f / a;
+
+			float sx = origin[0] - triangles.vertex[0][j];
+			float sy = origin[1] - triangles.vertex[1][j];
+			float sz = origin[2] - triangles.vertex[2][j];
+			float hitU = f * (sx * hx + sy * hy + sz * hz);
+
+			float qx = sy * e1z - sz * e1y;
+			float qy = sz * e1x - sx * e1z;
+			float qz = sx * e1y - sy * e1x;
+			float hitV = f * (direction[0] * qx + direction[1] * qy + direction[2] * qz);
+			float t = f * (e2x * qx + e2y * qy + e2z * qz);
+
+			bool parallel = a > -EPSILON && a < EPSILON;
+			bool outside = (hitU < 0 || hitU > 1) || (hitV < 0 || hitU + hitV > 1);
+			bool hit = !(parallel || outside) && t > EPSILON;
+
+			distance[i] = hit ? t : -1;
+			u[i] = hitU;
+			v[i] = hitV;
+		}
+	}
+
+#ifdef KD_SIMD_DISPATCH
+	KD_TARGET("sse2")
+	void intersectSse(const Triangles& triangles, size_t begin, size_t count, const float origin[3], const float direction[3], float* distance, float* u, float* v)
+	{
+		const __m128 dx = _mm_set1_ps(direction[0]), dy = _mm_set1_ps(direction[1]), dz = _mm_set1_ps(direction[2]);
+		const __m128 ox = _mm_set1_ps(origin[0]), oy = _mm_set1_ps(origin[1]), oz = _mm_set1_ps(origin[2]);
+		const __m128 epsilon = _mm_set1_ps(EPSILON), minusEpsilon = _mm_set1_ps(-EPSILON);
+		const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), miss = _mm_set1_ps(-1.0f);
+
+		for (size_t i = 0; i < count; i += 4)
+		{
+			size_t j = begin + i;
+			__m128 e1x = _mm_loadu_ps(&triangles.edge1[0][j]), e1y = _mm_loadu_ps(&triangles.edge1[1][j]), e1z = _mm_loadu_ps(&triangles.edge1[2][j]);
+			__m128 e2x = _mm_loadu_ps(&triangles.edge2[0][j]), e2y = _mm_loadu_ps(&triangles.edge2[1][j]), e2z = _mm_loadu_ps(&triangles.edge2[2][j]);
+
+			__m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+			__m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+			__m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+			__m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+			__m128 f = _mm_div_ps(one, a);
+
+			__m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(&triangles.vertex[0][j]));
+			__m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(&triangles.vertex[1][j]));
+			__m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(&triangles.vertex[2][j]));
+			__m128 hitU = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)));
+
+			__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+			__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+			__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+			__m128 hitV = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)));
+			__m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+
+			__m128 parallel = _mm_and_ps(_mm_cmpgt_ps(a, minusEpsilon), _mm_cmplt_ps(a, epsilon));
+			__m128 outside = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(hitU, zero), _mm_cmpgt_ps(hitU, one)),
+				_mm_or_ps(_mm_cmplt_ps(hitV, zero), _mm_cmpgt_ps(_mm_add_ps(hitU, hitV), one)));
+			__m128 hit = _mm_andnot_ps(_mm_or_ps(parallel, outside), _mm_cmpgt_ps(t, epsilon));
+
+			_mm_storeu_ps(distance + i, _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, miss)));
+			_mm_storeu_ps(u + i, hitU);
+			_mm_storeu_ps(v + i, hitV);
+		}
+	}
+
+	KD_TARGET("avx2")
+	void intersectAvx2(const Triangles& triangles, size_t begin, size_t count, const float origin[3], const float direction[3], float* distance, float* u, float* v)
+	{
+		const __m256 dx = _mm256_set1_ps(direction[0]), dy = _mm256_set1_ps(direction[1]), dz = _mm256_set1_ps(direction[2]);
+		const __m256 ox = _mm256_set1_ps(origin[0]), oy = _mm256_set1_ps(origin[1]), oz = _mm256_set1_ps(origin[2]);
+		const __m256 epsilon = _mm256_set1_ps(EPSILON), minusEpsilon = _mm256_set1_ps(-EPSILON);
+		const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), miss = _mm256_set1_ps(-1.0f);
+
+		for (size_t i = 0; i < count; i += 8)
+		{
+			size_t j = begin + i;
+			__m256 e1x = _mm256_loadu_ps(&triangles.edge1[0][j]), e1y = _mm256_loadu_ps(&triangles.edge1[1][j]), e1z = _mm256_loadu_ps(&triangles.edge1[2][j]);
+			__m256 e2x = _mm256_loadu_ps(&triangles.edge2[0][j]), e2y = _mm256_loadu_ps(&triangles.edge2[1][j]), e2z = _mm256_loadu_ps(&triangles.edge2[2][j]);
+
+			__m256 hx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+			__m256 hy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+			__m256 hz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+			__m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)), _mm256_mul_ps(e1z, hz));
+			__m256 f = _mm256_div_ps(one, a);
+
+			__m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(&triangles.vertex[0][j]));
+			__m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(&triangles.vertex[1][j]));
+			__m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(&triangles.vertex[2][j]));
+			__m256 hitU = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)), _mm256_mul_ps(sz, hz)));
+
+			__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+			__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+			__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+			__m256 hitV = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)));
+			__m256 t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)));
+
+			__m256 parallel = _mm256_and_ps(_mm256_cmp_ps(a, minusEpsilon, _CMP_GT_OQ), _mm256_cmp_ps(a, epsilon, _CMP_LT_OQ));
+			__m256 outside = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(hitU, zero, _CMP_LT_OQ), _mm256_cmp_ps(hitU, one, _CMP_GT_OQ)),
+				_mm256_or_ps(_mm256_cmp_ps(hitV, zero, _CMP_LT_OQ), _mm256_cmp_ps(_mm256_add_ps(hitU, hitV), one, _CMP_GT_OQ)));
+			__m256 hit = _mm256_andnot_ps(_mm256_or_ps(parallel, outside), _mm256_cmp_ps(t, epsilon, _CMP_GT_OQ));
+
+			_mm256_storeu_ps(distance + i, _mm256_blendv_ps(miss, t, hit));
+			_mm256_storeu_ps(u + i, hitU);
+			_mm256_storeu_ps(v + i, hitV);
+		}
+	}
+
+	KD_TARGET("avx512f")
+	void intersectAvx512(const Triangles& triangles, size_t begin, size_t count, const float origin[3], const float direction[3], float* distance, float* u, float* v)
+	{
+		const __m512 dx = _mm512_set1_ps(direction[0]), dy = _mm512_set1_ps(direction[1]), dz = _mm512_set1_ps(direction[2]);
+		const __m512 ox = _mm512_set1_ps(origin[0]), oy = _mm512_set1_ps(origin[1]), oz = _mm512_set1_ps(origin[2]);
+		const __m512 epsilon = _mm512_set1_ps(EPSILON), minusEpsilon = _mm512_set1_ps(-EPSILON);
+		const __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f), miss = _mm512_set1_ps(-1.0f);
+
+		for (size_t i = 0; i < count; i += 16)
+		{
+			size_t j = begin + i;
+			__m512 e1x = _mm512_loadu_ps(&triangles.edge1[0][j]), e1y = _mm512_loadu_ps(&triangles.edge1[1][j]), e1z = _mm512_loadu_ps(&triangles.edge1[2][j]);
+			__m512 e2x = _mm512_loadu_ps(&triangles.edge2[0][j]), e2y = _mm512_loadu_ps(&triangles.edge2[1][j]), e2z = _mm512_loadu_ps(&triangles.edge2[2][j]);
+
+			__m512 hx = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+			__m512 hy = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+			__m512 hz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+			__m512 a = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, hx), _mm512_mul_ps(e1y, hy)), _mm512_mul_ps(e1z, hz));
+			__m512 f = _mm512_div_ps(one, a);
+
+			__m512 sx = _mm512_sub_ps(ox, _mm512_loadu_ps(&triangles.vertex[0][j]));
+			__m512 sy = _mm512_sub_ps(oy, _mm512_loadu_ps(&triangles.vertex[1][j]));
+			__m512 sz = _mm512_sub_ps(oz, _mm512_loadu_ps(&triangles.vertex[2][j]));
+			__m512 hitU = _mm512_mul_ps(f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(sx, hx), _mm512_mul_ps(sy, hy)), _mm512_mul_ps(sz, hz)));
+
+			__m512 qx = _mm512_sub_ps(_mm512_mul_ps(sy, e1z), _mm512_mul_ps(sz, e1y));
+			__m512 qy = _mm512_sub_ps(_mm512_mul_ps(sz, e1x), _mm512_mul_ps(sx, e1z));
+			__m512 qz = _mm512_sub_ps(_mm512_mul_ps(sx, e1y), _mm512_mul_ps(sy, e1x));
+			__m512 hitV = _mm512_mul_ps(f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz)));
+			__m512 t = _mm512_mul_ps(f, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz)));
+
+			__mmask16 parallel = _mm512_cmp_ps_mask(a, minusEpsilon, _CMP_GT_OQ) & _mm512_cmp_ps_mask(a, epsilon, _CMP_LT_OQ);
+			__mmask16 outside = _mm512_cmp_ps_mask(hitU, zero, _CMP_LT_OQ) | _mm512_cmp_ps_mask(hitU, one, _CMP_GT_OQ)
+				| _mm512_cmp_ps_mask(hitV, zero, _CMP_LT_OQ) | _mm512_cmp_ps_mask(_mm512_add_ps(hitU, hitV), one, _CMP_GT_OQ);
+			__mmask16 hit = static_cast<__mmask16>(~(parallel | outside) & _mm512_cmp_ps_mask(t, epsilon, _CMP_GT_OQ));
+
+			_mm512_storeu_ps(distance + i, _mm512_mask_blend_ps(hit, miss, t));
+			_mm512_storeu_ps(u + i, hitU);
+			_mm512_storeu_ps(v + i, hitV);
+		}
+	}
+
+#ifdef _MSC_VER
+	bool hasCpuFeature(Isa isa)
+	{
+		int info[4];
+		__cpuid(info, 0);
+		int maxLeaf = info[0];
+		__cpuid(info, 1);
+		if (isa == Isa::SSE)
+			return (info[3] & (1 << 26)) != 0;
+
+		// The OS has to save the AVX (and AVX-512) registers on context switches.
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+		if (!osxsave || maxLeaf < 7)
+			return false;
+		unsigned long long enabled = _xgetbv(0);
+		__cpuidex(info, 7, 0);
+		if (isa == Isa::AVX2)
+			return (enabled & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0;
+		return (enabled & 0xe6) == 0xe6 && (info[1] & (1 << 16)) != 0;
+	}
+#else
+	bool hasCpuFeature(Isa isa)
+	{
+		__builtin_cpu_init();
+		if (isa == Isa::SSE)
+			return __builtin_cpu_supports("sse2");
+		if (isa == Isa::AVX2)
+			return __builtin_cpu_supports("avx2");
+		return __builtin_cpu_supports("avx512f");
+	}
+#endif
+#endif
+
+	bool isSupported(Isa isa)
+	{
+		if (isa == Isa::SCALAR)
+			return true;
+#ifdef KD_SIMD_DISPATCH
+		return hasCpuFeature(isa);
+#else
+		return false;
+#endif
+	}
+
+	Isa getBestIsa()
+	{
+		static const Isa best = []() {
+			for (Isa isa : { Isa::AVX512, Isa::AVX2, Isa::SSE })
+				if (isSupported(isa))
+					return isa;
+			return Isa::SCALAR;
+		}();
+		return best;
+	}
+
+	const char* getName(Isa isa)
+	{
+		switch (isa)
+		{
+		case Isa::SSE:
+			return "SSE";
+		case Isa::AVX2:
+			return "AVX2";
+		case Isa::AVX512:
+			return "AVX-512";
+		default:
+			return "Scalar";
+		}
+	}
+
+	int getWidth(Isa isa)
+	{
+		switch (isa)
+		{
+		case Isa::SSE:
+			return 4;
+		case Isa::AVX2:
+			return 8;
+		case Isa::AVX512:
+			return 16;
+		default:
+			return 1;
+		}
+	}
+
+	void intersect(Isa isa, const Triangles& triangles, size_t begin, size_t count, const float origin[3], const float direction[3], float* distance, float* u, float* v)
+	{
+#ifdef KD_SIMD_DISPATCH
+		switch (isa)
+		{
+		case Isa::SSE:
+			intersectSse(triangles, begin, count, origin, direction, distance, u, v);
+			return;
+		case Isa::AVX2:
+			intersectAvx2(triangles, begin, count, origin, direction, distance, u, v);
+			return;
+		case Isa::AVX512:
+			intersectAvx512(triangles, begin, count, origin, direction, distance, u, v);
+			return;
+		default:
+			break;
+		}
+#endif
+		intersectScalar(triangles, begin, count, origin, direction, distance, u, v);
+	}
+}
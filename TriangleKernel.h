@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+
+#include "Structures.h"
+
+/// <summary>
+/// Moller-Trumbore test of one ray against many triangles at once.
+/// Triangles are stored as structure of arrays, so SSE/AVX2/AVX-512 test 4/8/16 of them per instruction.
+/// The widest instruction set supported by the CPU is picked at runtime.
+/// All versions perform the same operations in the same order (no fused multiply-add),
+/// so their results are bit-identical to the scalar version.
+/// </summary>
+namespace TriangleKernel {
+
+	enum class Isa
+	{
+		SCALAR,
+		SSE,
+		AVX2,
+		AVX512
+	};
+
+	// Widest supported vector, the triangle list is padded to a multiple of it.
+	constexpr size_t MAX_WIDTH = 16;
+
+	struct Triangles
+	{
+		// Also pads with degenerate triangles, which never get hit.
+		void resize(size_t count);
+		void set(size_t index, const KdStructs::Triangle& triangle);
+
+		size_t count = 0;
+		// Vertex a and the edges b - a and c - a, per axis.
+		std::vector<float> vertex[3];
+		std::vector<float> edge1[3];
+		std::vector<float> edge2[3];
+	};
+
+	bool isSupported(Isa isa);
+	// Widest instruction set supported by this CPU (and compiler).
+	Isa getBestIsa();
+	const char* getName(Isa isa);
+	int getWidth(Isa isa);
+
+	/// <summary>
+	/// Tests the triangles [begin, begin + count).
+	/// distance[i] receives the distance to triangle begin + i, or -1 if it is missed; u[i] and v[i] its barycentric coordinates.
+	/// The outputs need room for count rounded up to MAX_WIDTH.
+	/// </summary>
+	void intersect(Isa isa, const Triangles& triangles, size_t begin, size_t count, const float origin[3], const float direction[3], float* distance, float* u, float* v);
+}
@@ -2,17 +2,19 @@
 #include <stdlib.h> 
 #include <chrono>
 #include <map>
+#include <fstream>
 
 #include "boost/random.hpp"
 #include "boost/random/uniform_int.hpp"
 #include "boost/random/variate_generator.hpp"
 
 #include "KdTree.h"
+#include "Benchmarks.h"
 #include "objLoader/OBJ_Loader.h"
 
 using namespace KdStructs;
 
-enum class ArgumentType { LOAD, TRIANGLES, POINT_RANGE, INTERACTIVE, VERBOSE, FORCE_SLOW, HELP };
+enum class ArgumentType { LOAD, TRIANGLES, POINT_RANGE, INTERACTIVE, VERBOSE, FORCE_SLOW, RAYS, THREADS, BENCHMARK, SDF, HELP };
 
 std::map<std::string, ArgumentType> argumentMap{
 	{"--load", ArgumentType::LOAD},
@@ -27,6 +29,14 @@ std::map<std::string, ArgumentType> argumentMap{
 	{"-v", ArgumentType::VERBOSE},
 	{"--slow", ArgumentType::FORCE_SLOW},
 	{"-s", ArgumentType::FORCE_SLOW},
+	{"--rays", ArgumentType::RAYS},
+	{"-n", ArgumentType::RAYS},
+	{"--threads", ArgumentType::THREADS},
+	{"-t", ArgumentType::THREADS},
+	{"--benchmark", ArgumentType::BENCHMARK},
+	{"-b", ArgumentType::BENCHMARK},
+	{"--sdf", ArgumentType::SDF},
+	{"-f", ArgumentType::SDF},
 	{"--help", ArgumentType::HELP},
 };
 
@@ -35,7 +45,7 @@ void handleArguments(int argc, char* argv[]);
 void showWrongArguments();
 void showHelp();
 
-void handleRayHit(RayHit* rayHit);
+void handleRayHit(const Ray& ray, const Hit& hit, const HitAttributes& attributes);
 float* createRandomTriangles(int numberOfTriangles, int range);
 unsigned int* getIndexList(unsigned int numberOfVertices);
 Ray createRandomRay(int originRange);
@@ -62,12 +72,20 @@ int pointRange = 1000;
 bool interactive = false;
 bool verbose = false;
 bool forceSlow = false;
+int rayAmount = 1;
+int threadAmount = 0;
+std::string benchmarkName = "";
+int sdfResolution = 0;
+std::string sdfPath = "";
 
 int main(int argc, char* argv[])
 {
 	handleArguments(argc, argv);
 
 	KdTree* kdtree = nullptr;
+	// Per-vertex normals (3 floats) and texture coordinates (2 floats) of the loaded file, empty without one.
+	std::vector<float> normals;
+	std::vector<float> uvs;
 
 	// Load file.
 	if (filePath != "") {
@@ -97,6 +115,14 @@ int main(int argc, char* argv[])
 			indices.push_back(index);
 		}
 
+		for (const objl::Vertex& vertex : loader.LoadedVertices) {
+			normals.push_back(vertex.Normal.X);
+			normals.push_back(vertex.Normal.Y);
+			normals.push_back(vertex.Normal.Z);
+			uvs.push_back(vertex.TextureCoordinate.X);
+			uvs.push_back(vertex.TextureCoordinate.Y);
+		}
+
 		// Create kd-tree.
 		std::chrono::steady_clock::time_point start, end;
 		if (forceSlow) {
@@ -115,6 +141,7 @@ int main(int argc, char* argv[])
 		std::cout << "[->] Done!" << std::endl;
 		std::cout << "Building time: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " microseconds." << std::endl;
 
+		kdtree->setVertexAttributes(normals.data(), uvs.data(), loader.LoadedVertices.size());
 	}
 	else {
 		int numberOfVertices = triangleAmount * 3;
@@ -132,7 +159,59 @@ int main(int argc, char* argv[])
 	if (verbose)
 		kdtree->printStatistics();
 
-	if (interactive) {
+	if (benchmarkName != "") {
+		// Benchmarks need a decent amount of rays.
+		int benchmarkRays = rayAmount > 1 ? rayAmount : 100000;
+		std::vector<Ray> rays;
+		rays.reserve(benchmarkRays);
+		for (int i = 0; i < benchmarkRays; i++)
+			rays.push_back(createRandomRay(pointRange));
+
+		kdtree->setThreadCount(threadAmount);
+		if (!Benchmarks::run(benchmarkName, kdtree, rays, normals, uvs)) {
+			std::cerr << "Unknown benchmark: " << benchmarkName << std::endl;
+			std::exit(1);
+		}
+	}
+	else if (sdfResolution > 0) {
+		// Grid over the mesh bounds plus 5% on every side, x fastest in the file.
+		Vector min = kdtree->getPoint(0)->pos;
+		Vector max = min;
+		for (unsigned int i = 1; i < kdtree->getPointCount(); i++)
+			for (int axis = 0; axis < 3; axis++) {
+				min[axis] = std::min(min[axis], kdtree->getPoint(i)->pos[axis]);
+				max[axis] = std::max(max[axis], kdtree->getPoint(i)->pos[axis]);
+			}
+		float longest = std::max(max[0] - min[0], std::max(max[1] - min[1], max[2] - min[2]));
+		if (!(longest > 0)) {
+			std::cout << "[X] The mesh has no extent!" << std::endl;
+			std::exit(1);
+		}
+		float margin = longest * 0.05f;
+		SdfGrid grid;
+		grid.voxelSize = (longest + 2 * margin) / (sdfResolution - 1);
+		for (int axis = 0; axis < 3; axis++) {
+			grid.origin[axis] = min[axis] - margin;
+			grid.resolution[axis] = static_cast<unsigned int>(std::ceil((max[axis] - min[axis] + 2 * margin) / grid.voxelSize)) + 1;
+		}
+		kdtree->setThreadCount(threadAmount);
+
+		std::cout << "\n[*] Baking signed distance field" << std::endl;
+		std::vector<float> distances(grid.getVoxelCount());
+		BatchStatistics statistics = kdtree->bakeSignedDistanceField(grid, distances.data());
+		std::cout << "[->] Done!" << std::endl;
+		std::cout << "Baking time: " << static_cast<long long>(statistics.seconds * 1000000) << " microseconds." << std::endl;
+		std::cout << "Size: " << grid.resolution[0] << " x " << grid.resolution[1] << " x " << grid.resolution[2]
+			<< ", origin: " << grid.origin << ", voxel size: " << grid.voxelSize << std::endl;
+
+		std::ofstream file(sdfPath, std::ios::binary);
+		file.write(reinterpret_cast<const char*>(distances.data()), distances.size() * sizeof(float));
+		if (!file) {
+			std::cout << "[X] Could not write file!" << std::endl;
+			std::exit(1);
+		}
+	}
+	else if (interactive) {
 		std::cout << "\n[->] Interaction enabled!" << std::endl;
 		std::cout << "You can shoot rays now. Example: 0,0,0;1,0,0 (<origin>,<direction>). You can also shhot a random ray by simply typing 'r'." << std::endl;
 		while (true)
@@ -165,28 +244,46 @@ int main(int argc, char* argv[])
 				ray = Ray(Vector(x, y, z), Vector(dx, dy, dz), 1000);
 			}
 
-			RayHit* rayHit = nullptr;
 			// Casting ray
 			std::cout << "\n[*] Casting Ray." << std::endl;
 			auto start = std::chrono::high_resolution_clock::now();
-			kdtree->raycast(ray, rayHit);
+			HitAttributes attributes;
+			Hit hit = kdtree->raycast(ray, attributes);
 			auto end = std::chrono::high_resolution_clock::now();
 			std::cout << "Raycast time: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " microseconds." << std::endl;
-			handleRayHit(rayHit);
+			handleRayHit(ray, hit, attributes);
 		}
 	}
+	else if (rayAmount > 1) {
+		std::vector<Ray> rays;
+		rays.reserve(rayAmount);
+		for (int i = 0; i < rayAmount; i++)
+			rays.push_back(createRandomRay(pointRange));
+		std::vector<RayHit*> rayHits(rayAmount, nullptr);
+
+		// Casting rays
+		std::cout << "\n[*] Casting " << rayAmount << " rays." << std::endl;
+		kdtree->setThreadCount(threadAmount);
+		BatchStatistics statistics = kdtree->raycastBatch(rays.data(), rays.size(), rayHits.data());
+		std::cout << "[->] Hits: " << statistics.hitCount << std::endl;
+		std::cout << "Raycast time: " << static_cast<long long>(statistics.seconds * 1000000) << " microseconds." << std::endl;
+		std::cout << "Rays per second: " << static_cast<long long>(statistics.raysPerSecond()) << std::endl;
+
+		for (RayHit* rayHit : rayHits)
+			delete rayHit;
+	}
 	else {
 		Ray ray = createRandomRay(pointRange);
-		RayHit* rayHit = nullptr;
 
 		// Casting ray
 		std::cout << "\n[*] Casting Ray." << std::endl;
 		if (verbose)
 			std::cout << "Ray origin: " << ray.origin << " Ray direction: " << ray.direction << std::endl;
 		auto start = std::chrono::high_resolution_clock::now();
-		kdtree->raycast(ray, rayHit);
+		HitAttributes attributes;
+		Hit hit = kdtree->raycast(ray, attributes);
 		auto end = std::chrono::high_resolution_clock::now();
-		handleRayHit(rayHit);
+		handleRayHit(ray, hit, attributes);
 		std::cout << "Raycast time: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " microseconds." << std::endl;
 	}
 }
@@ -230,6 +327,33 @@ void handleArguments(int argc, char* argv[])
 		case ArgumentType::FORCE_SLOW:
 			forceSlow = true;
 			break;
+		case ArgumentType::RAYS:
+			if (argData.empty())
+				showWrongArguments();
+			rayAmount = std::stoi(argData);
+			i++;
+			break;
+		case ArgumentType::THREADS:
+			if (argData.empty())
+				showWrongArguments();
+			threadAmount = std::stoi(argData);
+			i++;
+			break;
+		case ArgumentType::BENCHMARK:
+			if (argData.empty())
+				showWrongArguments();
+			benchmarkName = argData;
+			i++;
+			break;
+		case ArgumentType::SDF:
+			if (argData.empty() || argData2.empty())
+				showWrongArguments();
+			sdfResolution = std::stoi(argData);
+			sdfPath = argData2;
+			if (sdfResolution < 2)
+				showWrongArguments();
+			i += 2;
+			break;
 		case ArgumentType::HELP:
 			showHelp();
 			std::exit(0);
@@ -256,15 +380,24 @@ void showHelp()
 	std::cout << "--interactive [-i]                                 -> Enables 'interactive-mode' allowing to define custom rays." << std::endl;
 	std::cout << "--verbose [-v]                                     -> Prints out additional information." << std::endl;
 	std::cout << "--slow [-s]                                        -> Uses a slow procedure to check and merge same vertices." << std::endl;
+	std::cout << "--rays [-n] <numberOfRays>                         -> Number of random rays to be cast as one batch." << std::endl;
+	std::cout << "--threads [-t] <numberOfThreads>                   -> Number of threads used for batches (0 -> all hardware threads)." << std::endl;
+	std::cout << "--benchmark [-b] <name>                            -> Runs a benchmark with --rays random rays. Names: sorting, occlusion, stackless, all, kernel, watertight, projection, attributes, nearest, knn, radius, box, closest, frustum, approximate, graph, join, overlap, hausdorff, inside, sdf" << std::endl;
+	std::cout << "--sdf [-f] <resolution> <file>                     -> Writes a signed distance field of the mesh as raw floats, <resolution> voxels along its longest side." << std::endl;
 	std::cout << "--help                                             -> Prints out this message." << std::endl;
 	std::cout << std::endl;
 }
 #pragma endregion
 
-void handleRayHit(RayHit* rayHit) {
-	if (rayHit != nullptr) {
+void handleRayHit(const Ray& ray, const Hit& hit, const HitAttributes& attributes) {
+	if (hit.valid) {
 		std::cout << "[->] Hit at: ";
-		std::cout << rayHit->position << std::endl;
+		std::cout << hit.getPosition(ray) << std::endl;
+		if (attributes.valid) {
+			if (attributes.validNormal)
+				std::cout << "Normal: " << Vector(attributes.normal) << std::endl;
+			std::cout << "UV: {" << attributes.uv[0] << "," << attributes.uv[1] << "}" << std::endl;
+		}
 	}
 	else {
 		std::cout << "[->] Nothing hit!" << std::endl;